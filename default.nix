@@ -3,17 +3,19 @@
 pkgs.stdenv.mkDerivation {
   name = "offloaded-vulkan-tests";
   src = pkgs.nix-gitignore.gitignoreSourcePure [ ./.gitignore "*.spv" ] ./.;
-  buildInputs = with pkgs; [ coz glfw glm pkg-config shaderc vulkan-loader ];
+  buildInputs = with pkgs; [ coz glfw glm lz4 pkg-config shaderc vulkan-loader zstd ];
   buildPhase = ''
     pushd src
     make -f Makefile_nix
     popd
   '';
   installPhase = ''
-    install -Dt $out/bin src/client src/rendertest
+    install -Dt $out/bin src/client src/rendertest src/linkproxy
     install -Dt $out/bin/shaders -m0644 \
       src/shaders/vertexdefaultserver.spv \
       src/shaders/fragmentdefaultserver.spv \
+      src/shaders/computergbserver.spv \
+      src/shaders/computeycocgserver.spv \
       src/shaders/vertexmodelclient.spv \
       src/shaders/fragmentmodelclient.spv \
       src/shaders/vertexfsquadclient.spv \
@@ -0,0 +1,121 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "utils.h"
+
+
+/*
+	Throughput of every rgba_to_rgb/bgra_to_rgb/rgb_to_rgba variant this CPU supports, on
+	server sized frames. Also checks each one against the scalar version, so
+	a broken kernel shows up here before it shows up on screen, both on the
+	whole frame and on small and odd pixel counts that end in the kernels'
+	tail paths.
+	Usage: ./bench_convert [width height iterations]
+*/
+double gigabytes_per_second(PixelConvertFn convert, const uint8_t *in, uint8_t *out, size_t num_pixels, size_t num_bytes_touched, uint32_t iterations)
+{
+	convert(in, out, num_pixels); // warm up
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(uint32_t i = 0; i < iterations; i++)
+	{
+		convert(in, out, num_pixels);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return (double) num_bytes_touched * iterations / elapsed.count() / 1e9;
+}
+
+
+/*
+	Runs convert on exactly num_pixels pixels of in (in_bpp bytes each) and
+	compares it to reference. The output has guard bytes after it, so a
+	kernel writing past its last pixel is caught too.
+*/
+bool matches_reference(PixelConvertFn convert, PixelConvertFn reference, const uint8_t *in, size_t num_pixels, size_t in_bpp, size_t out_bpp)
+{
+	const size_t guard = 64;
+	std::vector<uint8_t> input(in, in + num_pixels * in_bpp);
+	std::vector<uint8_t> out(num_pixels * out_bpp + guard, 0xAB);
+	std::vector<uint8_t> expected(num_pixels * out_bpp + guard, 0xAB);
+
+	convert(input.data(), out.data(), num_pixels);
+	reference(input.data(), expected.data(), num_pixels);
+	return out == expected;
+}
+
+// Every size up to a couple of the widest blocks, plus a few awkward bigger ones
+bool tails_match(const PixelConvertKernels &kernel, const PixelConvertKernels &scalar, const uint8_t *rgba, size_t num_pixels)
+{
+	std::vector<size_t> sizes;
+	for(size_t n = 0; n <= 130 && n <= num_pixels; n++)
+	{
+		sizes.push_back(n);
+	}
+	if(num_pixels > 130)
+	{
+		sizes.push_back(num_pixels - 1);
+		sizes.push_back(num_pixels / 2 + 1);
+	}
+
+	for(size_t n : sizes)
+	{
+		if(!matches_reference(kernel.rgba_to_rgb, scalar.rgba_to_rgb, rgba, n, 4, 3) ||
+		   !matches_reference(kernel.bgra_to_rgb, scalar.bgra_to_rgb, rgba, n, 4, 3) ||
+		   !matches_reference(kernel.rgb_to_rgba, scalar.rgb_to_rgba, rgba, n, 3, 4))
+		{
+			printf("%s doesn't match the scalar kernel at %zu pixels\n", kernel.name, n);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+int main(int argc, char **argv)
+{
+	size_t width		= argc > 2 ? atoi(argv[1]) : 512;
+	size_t height		= argc > 2 ? atoi(argv[2]) : 512;
+	uint32_t iterations = argc > 3 ? atoi(argv[3]) : 1000;
+	size_t num_pixels	= width * height;
+
+	std::vector<uint8_t> rgba(num_pixels * 4);
+	std::vector<uint8_t> rgb(num_pixels * 3);
+	std::vector<uint8_t> expected_rgb(num_pixels * 3);
+	std::vector<uint8_t> expected_swizzled(num_pixels * 3);
+	std::vector<uint8_t> expected_rgba(num_pixels * 4);
+	for(size_t i = 0; i < rgba.size(); i++)
+	{
+		rgba[i] = rand();
+	}
+	rgba_to_rgb_scalar(rgba.data(), expected_rgb.data(), num_pixels);
+	rgba_to_rgb_scalar<true>(rgba.data(), expected_swizzled.data(), num_pixels);
+	rgb_to_rgba_scalar(expected_rgb.data(), expected_rgba.data(), num_pixels);
+
+	printf("%zux%zu, %u iterations, dispatching to %s\n", width, height, iterations, pixel_convert_kernels().name);
+	printf("%-12s %16s %16s %16s\n", "kernel", "rgba_to_rgb GB/s", "bgra_to_rgb GB/s", "rgb_to_rgba GB/s");
+
+	std::vector<PixelConvertKernels> kernels = supported_pixel_convert_kernels();
+	int failed = 0;
+	for(uint32_t k = 0; k < kernels.size(); k++)
+	{
+		// Throughput counts bytes read plus bytes written
+		double to_rgb  = gigabytes_per_second(kernels[k].rgba_to_rgb, rgba.data(), rgb.data(), num_pixels, num_pixels * 7, iterations);
+		bool rgb_ok	   = rgb == expected_rgb;
+		double to_bgr  = gigabytes_per_second(kernels[k].bgra_to_rgb, rgba.data(), rgb.data(), num_pixels, num_pixels * 7, iterations);
+		rgb_ok		   = rgb_ok && rgb == expected_swizzled;
+		std::vector<uint8_t> out_rgba(num_pixels * 4);
+		double to_rgba = gigabytes_per_second(kernels[k].rgb_to_rgba, expected_rgb.data(), out_rgba.data(), num_pixels, num_pixels * 7, iterations);
+		bool rgba_ok   = out_rgba == expected_rgba;
+
+		bool tails_ok  = tails_match(kernels[k], kernels[0], rgba.data(), num_pixels);
+
+		printf("%-12s %16.2f %16.2f %16.2f%s\n", kernels[k].name, to_rgb, to_bgr, to_rgba, rgb_ok && rgba_ok && tails_ok ? "" : "  MISMATCH");
+		failed |= !(rgb_ok && rgba_ok && tails_ok);
+	}
+
+	return failed;
+}
@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
@@ -8,6 +9,7 @@
 #include <fstream>
 #include <iostream>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <set>
 #include <stdexcept>
 #include <stdio.h>
@@ -33,6 +35,12 @@
 
 #include "camera.h"
 #include "defines.h"
+#include "frame_codec.h"
+#include "jitter_buffer.h"
+#include "job_system.h"
+#include "pose_channel.h"
+#include "protocol.h"
+#include "udp_transport.h"
 #include "utils.h"
 #include "vertex.h"
 #include "vk_debug_messenger.h"
@@ -50,6 +58,7 @@ std::string TEXTURE_PATH = "../models/laurenscan/Model.jpg";
 
 
 #define PORT 1234
+#define POSE_HISTORY 256 // poses whose send times are kept around
 
 Camera camera = Camera(glm::vec3(0.0f, 2.0f, 6.0f));
 
@@ -181,24 +190,134 @@ struct DeviceRenderer
 	VkBuffer ibo;
 	std::vector<VkBuffer> ubos;
 	std::vector<VkDeviceMemory> ubos_mem;
+	std::vector<VkBuffer> server_frame_ubos; // server_image, per swapchain image too
+	std::vector<VkDeviceMemory> server_frame_ubos_mem;
 	VkDeviceMemory vbo_mem;
 	VkDeviceMemory ibo_mem;
 
 	VulkanAttachment server_colour_attachment;
+	VulkanAttachment server_depth_attachment; // R16 copy of the server's depth, sampled with server_frame_sampler too
 	VkSampler server_frame_sampler;
 
 	VulkanAttachment texcolour_attachment;
 	VkSampler tex_sampler;
 
-	// Buffer that will be copied to
+	/*
+		Buffer the server's frames are received into, stays mapped to server_image_data.
+		It has a payload slot for every frame the jitter buffer can hold back,
+		one to receive into, and some for the frames in flight to copy out
+		of, so receiving a frame never overwrites one that's still needed.
+		A frame's depth, if it has any, goes right after its decoded colour.
+	*/
 	VkBuffer image_buffer;
 	VkDeviceMemory image_buffer_memory;
-
+	VkDeviceSize image_buffer_slot_size;
+	uint32_t image_buffer_slots;
+
+	/*
+		command_buffers are recorded once per swapchain image, and only
+		again when the swapchain is recreated, so everything that changes
+		from frame to frame is in the UBOs. The only commands that change are
+		the server frame copies, which go in this frame in flight's
+		transfer_command_buffer, submitted just before.
+		Each renderpass is recorded into its own secondary command buffer,
+		all of them in parallel on the job system, and each swapchain
+		image's command buffer just runs its two. Every job system thread
+		records into its own pool, so none of them has to lock one.
+	*/
 	VkCommandPool command_pool;
 	std::vector<VkCommandBuffer> command_buffers;
+	std::vector<VkCommandBuffer> transfer_command_buffers;
+	std::vector<VkCommandBuffer> offscreen_command_buffers;
+	std::vector<VkCommandBuffer> fsquad_command_buffers;
+	std::vector<VkCommandPool> worker_command_pools; // one per job system thread, they go with whatever was recorded from them
+
+	JobSystem jobs;
+	int workers = 2;
 
 	uint8_t *server_image_data;
 
+	/*
+		Where the tiles of a FRAME_FORMAT_RGB8_TILES frame go, and what the
+		frame in each image_buffer slot copies into the server images. The
+		grid follows the size of the frames coming in, which can be plain or
+		a foveated atlas.
+	*/
+	TileGrid server_tile_grid = TileGrid(SERVERWIDTH, SERVERHEIGHT);
+	std::vector<std::vector<VkBufferImageCopy>> slot_copy_regions;
+	std::vector<std::vector<VkBufferImageCopy>> slot_depth_copy_regions;
+
+	// Biggest frame the server can send, which everything on the receiving end is sized for
+	uint32_t server_max_width = foveated_atlas_width(SERVERWIDTH);
+
+	/*
+		What's in the server image, so the fullscreen quad knows how to read
+		it, and the camera it was rendered with. Every frame reprojects it
+		from that camera to the one the client has now, if it came with depth.
+	*/
+	ServerFrameUBO server_image = {FRAME_FORMAT_RGB8, 0, SERVERWIDTH, 0, {0, 0, 0, 0}, glm::mat4(1.0f)};
+	glm::mat4 server_view		= glm::mat4(1.0f);
+	glm::mat4 server_projection = glm::mat4(1.0f);
+	glm::mat4 camera_view		= glm::mat4(1.0f); // this frame's, from update_ubos()
+
+	// Where the server's fovea goes on screen, from --server-rect. No width centres it at its own size
+	int32_t server_rect[4] = {0, 0, 0, 0};
+
+	// Compressed payloads land here first and get decoded into image_buffer
+	FrameCompressor decompressor;
+	std::vector<uint8_t> compressed_payload;
+
+	// Last frame header received from the server, to spot dropped frames and measure latency
+	FrameHeader last_frame_header = {};
+	bool received_first_frame	  = false;
+
+	// Print per frame timings (--frame-stats). Off by default, they're a printf per frame on the hot paths
+	bool frame_stats = false;
+
+	/*
+		Receive frames over UDP instead of TCP (see udp_transport.h). A frame
+		that isn't all there deadline_ms after the receive starts is given
+		up on, and the server is asked for a keyframe to replace its tiles.
+	*/
+	bool udp			 = false;
+	int deadline_ms		 = 50;
+	UdpFrameReceiver udp_receiver;
+	uint64_t frames_lost = 0;
+
+	// How long the last frame took to arrive, first byte to last, for the server's rate control
+	uint64_t frame_receive_us = 0;
+
+	/*
+		rec_image_thread receives frames for as long as the client runs, into
+		the jitter buffer, and never waits on the render thread, which never
+		waits on it either. Every frame the pacer picks the server frames due
+		by then (see JitterBuffer), holding up to jitter_depth back to smooth
+		over uneven arrivals. 0 shows every frame as soon as it's there. A
+		frame with nothing new shows the last one again, reprojected to where
+		the camera is now. slots_in_flight are the slots each frame in flight
+		copies out of, which are free again once its fence is.
+	*/
+	int jitter_depth = 2;
+	JitterBuffer jitter_buffer;
+	std::vector<BufferedFrame> shown_frames; // picked for this frame
+	std::vector<std::vector<uint32_t>> slots_in_flight;
+
+	/*
+		The camera's pose goes to the server every frame, over UDP to
+		pose_port (port + 1 unless it's set), see pose_channel.h. When each
+		pose went out is kept for a while, so a frame rendered with it can
+		say how long it took to come back.
+	*/
+	PoseSender pose_sender;
+	int pose_port = 0;
+	std::vector<std::atomic<uint64_t>> pose_sent_us;
+	std::atomic<uint64_t> last_pose_id;
+
+	// Poses are sent ahead by the last pose round trip and the playout delay, see PosePredictor
+	bool predict_poses = true;
+	PosePredictor pose_predictor;
+	std::atomic<uint64_t> pose_round_trip_us;
+
 	struct
 	{
 		VkDescriptorSetLayout model;
@@ -235,10 +354,10 @@ struct DeviceRenderer
 	struct
 	{
 		pthread_t rec_image_thread;
-		pthread_t first_renderpass_thread;
 	} vk_pthread_t;
 
 	Client client;
+	int port = PORT;
 
 	void initWindow()
 	{
@@ -262,6 +381,7 @@ struct DeviceRenderer
 		swapchain								  = VulkanSwapchain(swapchain_support, surface, device, window);
 		renderpass								  = VulkanRenderpass(device, swapchain);
 		setup_command_pool();
+		jobs.start(workers);
 		setup_offscreen();
 		setup_descriptor_set_layout();
 		setup_graphics_pipeline();
@@ -275,13 +395,74 @@ struct DeviceRenderer
 		initialize_ubos();
 		setup_descriptor_pool();
 		setup_descriptor_sets();
-		//setup_command_buffers();
+		setup_command_buffers();
 		setup_vk_async();
 
 		create_copy_image_buffer();
 
 		client = Client();
-		client.connect_to_server(PORT);
+		client.connect_to_server(port);
+		setup_pose_channel();
+		if(udp)
+		{
+			setup_udp();
+		}
+		start_receiving();
+	}
+
+	// Poses go to the same host as the TCP connection, and the server is told where they come from
+	void setup_pose_channel()
+	{
+		sockaddr_in server_address = {
+			.sin_family = AF_INET,
+			.sin_port	= htons(static_cast<in_port_t>(pose_port != 0 ? pose_port : port + 1)),
+		};
+		pose_sender	 = PoseSender(server_address);
+		pose_sent_us = std::vector<std::atomic<uint64_t>>(POSE_HISTORY);
+		for(uint32_t i = 0; i < POSE_HISTORY; i++)
+		{
+			pose_sent_us[i].store(0);
+		}
+		last_pose_id.store(0);
+		pose_round_trip_us.store(0);
+
+		if(!send_client_message(client.socket_fd, CLIENT_MESSAGE_POSE_PORT, 0, pose_sender.port()))
+		{
+			throw std::runtime_error("Could not tell the server where poses come from");
+		}
+	}
+
+	// Render thread only
+	void send_pose()
+	{
+		float position[3] = {camera.position.x, camera.position.y, camera.position.z};
+		float front[3]	  = {camera.front.x, camera.front.y, camera.front.z};
+
+		uint64_t now_us = timestamp_us();
+		if(predict_poses)
+		{
+			pose_predictor.predict(position, now_us, pose_round_trip_us.load() + jitter_buffer.playout_delay_us.load(), position);
+		}
+		uint64_t pose_id = pose_sender.send_pose(position, front, now_us);
+		pose_sent_us[pose_id % POSE_HISTORY].store(now_us);
+		last_pose_id.store(pose_id);
+	}
+
+	// Tells the server which port to send frames to. Compressed frames can't be received into a buffer that grows as they come in
+	void setup_udp()
+	{
+		udp_receiver = UdpFrameReceiver(0);
+		if(!send_client_message(client.socket_fd, CLIENT_MESSAGE_UDP_PORT, 0, udp_receiver.port()))
+		{
+			throw std::runtime_error("Could not ask the server for frames over UDP");
+		}
+
+		size_t max_compressed_size = 0;
+		for(uint16_t codec = FRAME_CODEC_RAW; codec <= FRAME_CODEC_QOI; codec++)
+		{
+			max_compressed_size = std::max(max_compressed_size, FrameCompressor::max_encoded_size(codec, image_buffer_slot_size));
+		}
+		compressed_payload.resize(max_compressed_size);
 	}
 
 	void game_loop()
@@ -292,6 +473,8 @@ struct DeviceRenderer
 			render_complete_frame();
 		}
 
+		stop_receiving();
+
 		vkDeviceWaitIdle(device.logical_device);
 	}
 
@@ -311,6 +494,7 @@ struct DeviceRenderer
 		// Destroy server frame sampler and server colour attachment
 		vkDestroySampler(device.logical_device, server_frame_sampler, nullptr);
 		destroy_vulkan_attachment(device.logical_device, server_colour_attachment);
+		destroy_vulkan_attachment(device.logical_device, server_depth_attachment);
 
 		// Destroy tex colour attachment & sampler
 		vkDestroySampler(device.logical_device, tex_sampler, nullptr);
@@ -341,11 +525,16 @@ struct DeviceRenderer
 		}
 
 		vkDestroyCommandPool(device.logical_device, command_pool, nullptr);
+		jobs.stop();
 
 
 		// Destroy image buffer
+		vkUnmapMemory(device.logical_device, image_buffer_memory);
 		vkDestroyBuffer(device.logical_device, image_buffer, nullptr);
 		vkFreeMemory(device.logical_device, image_buffer_memory, nullptr);
+		decompressor.destroy();
+		udp_receiver.destroy();
+		pose_sender.destroy();
 
 		device.destroy();
 
@@ -375,11 +564,13 @@ struct DeviceRenderer
 		{
 			vkDestroyBuffer(device.logical_device, ubos[i], nullptr);
 			vkFreeMemory(device.logical_device, ubos_mem[i], nullptr);
+			vkDestroyBuffer(device.logical_device, server_frame_ubos[i], nullptr);
+			vkFreeMemory(device.logical_device, server_frame_ubos_mem[i], nullptr);
 		}
 
 		vkDestroyDescriptorPool(device.logical_device, descriptor_pool, nullptr);
 
-		vkFreeCommandBuffers(device.logical_device, command_pool, command_buffers.size(), command_buffers.data());
+		destroy_worker_command_pools();
 		vkDestroyPipeline(device.logical_device, pipelines.model, nullptr);
 		vkDestroyPipelineLayout(device.logical_device, pipeline_layouts.model, nullptr);
 		vkDestroyRenderPass(device.logical_device, renderpass.renderpass, nullptr);
@@ -449,7 +640,7 @@ struct DeviceRenderer
 					 1, 1,
 					 VK_SAMPLE_COUNT_1_BIT,
 					 VK_IMAGE_TILING_OPTIMAL,
-					 VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+					 VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
 					 VK_SHARING_MODE_EXCLUSIVE,
 					 VK_IMAGE_LAYOUT_UNDEFINED,
 					 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
@@ -476,17 +667,6 @@ struct DeviceRenderer
 			throw std::runtime_error("Could not create offscreen sampler");
 		}
 
-		transition_image_layout(device,
-								command_pool,
-								offscreen_pass.colour_attachment.image,
-								VK_FORMAT_R8G8B8A8_SRGB,
-								VK_IMAGE_LAYOUT_UNDEFINED,
-								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-		transition_image_layout(device, command_pool, offscreen_pass.colour_attachment.image,
-								VK_FORMAT_R8G8B8A8_SRGB,
-								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
 		// Renderpass creation
 		std::array<VkAttachmentDescription, 2> attachment_descriptions = {};
 		attachment_descriptions[0]									   = {
@@ -595,11 +775,15 @@ struct DeviceRenderer
 		// Use the ubo_layout_binding and push it on as well
 		VkDescriptorSetLayoutBinding server_framesampler_layout_binding	   = vki::descriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr);
 		VkDescriptorSetLayoutBinding local_rendered_sampler_layout_binding = vki::descriptorSetLayoutBinding(2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr);
+		VkDescriptorSetLayoutBinding server_depthsampler_layout_binding	   = vki::descriptorSetLayoutBinding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr);
+		VkDescriptorSetLayoutBinding server_frame_ubo_layout_binding	   = vki::descriptorSetLayoutBinding(4, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr);
 
 		std::vector<VkDescriptorSetLayoutBinding> descriptor_set_layout_bindings_fsquad;
 		descriptor_set_layout_bindings_fsquad.push_back(ubo_layout_binding);
 		descriptor_set_layout_bindings_fsquad.push_back(server_framesampler_layout_binding);
 		descriptor_set_layout_bindings_fsquad.push_back(local_rendered_sampler_layout_binding);
+		descriptor_set_layout_bindings_fsquad.push_back(server_depthsampler_layout_binding);
+		descriptor_set_layout_bindings_fsquad.push_back(server_frame_ubo_layout_binding);
 
 		descriptor_set_ci	  = vki::descriptorSetLayoutCreateInfo(descriptor_set_layout_bindings_fsquad.size(), descriptor_set_layout_bindings_fsquad.data());
 		descriptor_set_create = vkCreateDescriptorSetLayout(device.logical_device, &descriptor_set_ci, nullptr, &descriptor_set_layouts.fsquad);
@@ -612,8 +796,10 @@ struct DeviceRenderer
 
 	void setup_descriptor_pool()
 	{
-		VkDescriptorPoolSize poolsize_ubo	  = vki::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, swapchain.images.size());
-		VkDescriptorPoolSize poolsize_sampler = vki::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * swapchain.images.size());
+		// The model's UBO, and the fullscreen quad's two, per image
+		VkDescriptorPoolSize poolsize_ubo	  = vki::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3 * swapchain.images.size());
+		// One sampler per image for the model's texture, and three for the fullscreen quad
+		VkDescriptorPoolSize poolsize_sampler = vki::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4 * swapchain.images.size());
 		printf("poolsize_sampler: %d\n", poolsize_sampler.descriptorCount);
 
 
@@ -679,12 +865,16 @@ struct DeviceRenderer
 			VkDescriptorBufferInfo buffer_info			   = vki::descriptorBufferInfo(ubos[i], 0, sizeof(UBO));
 			VkDescriptorImageInfo serverimage_info		   = vki::descriptorImageInfo(server_frame_sampler, server_colour_attachment.image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 			VkDescriptorImageInfo local_renderedimage_info = vki::descriptorImageInfo(offscreen_pass.sampler, offscreen_pass.colour_attachment.image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+			VkDescriptorImageInfo serverdepth_info		   = vki::descriptorImageInfo(server_frame_sampler, server_depth_attachment.image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+			VkDescriptorBufferInfo server_frame_info	   = vki::descriptorBufferInfo(server_frame_ubos[i], 0, sizeof(ServerFrameUBO));
 
 			std::vector<VkWriteDescriptorSet> write_descriptor_sets;
 			write_descriptor_sets = {
 				vki::writeDescriptorSet(descriptor_sets.fsquad[i], 0, 0, 1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, &buffer_info),
 				vki::writeDescriptorSet(descriptor_sets.fsquad[i], 1, 0, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &serverimage_info),
 				vki::writeDescriptorSet(descriptor_sets.fsquad[i], 2, 0, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &local_renderedimage_info),
+				vki::writeDescriptorSet(descriptor_sets.fsquad[i], 3, 0, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &serverdepth_info),
+				vki::writeDescriptorSet(descriptor_sets.fsquad[i], 4, 0, 1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, &server_frame_info),
 			};
 
 			vkUpdateDescriptorSets(device.logical_device, write_descriptor_sets.size(), write_descriptor_sets.data(), 0, nullptr);
@@ -778,10 +968,17 @@ struct DeviceRenderer
 	}
 
 
+	/*
+		The server's frames come in as tightly packed RGB, which no GPU wants as
+		an image format. So they're copied into an R8 image three times as wide,
+		one texel per byte, and the fsquad shader puts the pixels back together
+		with texelFetch. Their depth is 16 bit already, so it goes into an R16
+		image as it is. Only unfoveated frames have depth, so that's their size.
+	*/
 	void setup_serverframe_sampler()
 	{
 		VkExtent3D texextent3D = {
-			.width	= (uint32_t) SERVERWIDTH,
+			.width	= server_max_width * 3,
 			.height = (uint32_t) SERVERHEIGHT,
 			.depth	= 1,
 		};
@@ -789,7 +986,7 @@ struct DeviceRenderer
 		// Create image that will be bound to sampler
 		create_image(device, 0,
 					 VK_IMAGE_TYPE_2D,
-					 VK_FORMAT_R8G8B8A8_SRGB,
+					 VK_FORMAT_R8_UNORM,
 					 texextent3D,
 					 1, 1,
 					 VK_SAMPLE_COUNT_1_BIT,
@@ -804,26 +1001,57 @@ struct DeviceRenderer
 		// Transition it to transfer dst optimal since it can't be directly transitioned to shader read-only optimal
 		transition_image_layout(device, command_pool,
 								server_colour_attachment.image,
-								VK_FORMAT_R8G8B8A8_SRGB,
+								VK_FORMAT_R8_UNORM,
 								VK_IMAGE_LAYOUT_UNDEFINED,
 								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
 
 		// Now transition to shader read only optimal
 		transition_image_layout(device, command_pool,
 								server_colour_attachment.image,
-								VK_FORMAT_R8G8B8A8_SRGB,
+								VK_FORMAT_R8_UNORM,
 								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
 		// Create image view for the colour attachment
-		server_colour_attachment.image_view = create_image_view(device.logical_device, server_colour_attachment.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
+		server_colour_attachment.image_view = create_image_view(device.logical_device, server_colour_attachment.image, VK_FORMAT_R8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT);
+
+		VkExtent3D depthextent3D = {
+			.width	= (uint32_t) SERVERWIDTH,
+			.height = (uint32_t) SERVERHEIGHT,
+			.depth	= 1,
+		};
+		create_image(device, 0,
+					 VK_IMAGE_TYPE_2D,
+					 VK_FORMAT_R16_UNORM,
+					 depthextent3D,
+					 1, 1,
+					 VK_SAMPLE_COUNT_1_BIT,
+					 VK_IMAGE_TILING_OPTIMAL,
+					 VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+					 VK_SHARING_MODE_EXCLUSIVE,
+					 VK_IMAGE_LAYOUT_UNDEFINED,
+					 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					 server_depth_attachment.image,
+					 server_depth_attachment.memory);
+		transition_image_layout(device, command_pool,
+								server_depth_attachment.image,
+								VK_FORMAT_R16_UNORM,
+								VK_IMAGE_LAYOUT_UNDEFINED,
+								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+		transition_image_layout(device, command_pool,
+								server_depth_attachment.image,
+								VK_FORMAT_R16_UNORM,
+								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		server_depth_attachment.image_view = create_image_view(device.logical_device, server_depth_attachment.image, VK_FORMAT_R16_UNORM, VK_IMAGE_ASPECT_COLOR_BIT);
 
 		// Create the sampler
 		VkPhysicalDeviceProperties properties;
 		vkGetPhysicalDeviceProperties(device.physical_device, &properties);
-		VkSamplerCreateInfo sampler_ci = vki::samplerCreateInfo(VK_FILTER_LINEAR, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR,
-																VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_SAMPLER_ADDRESS_MODE_REPEAT,
-																0.0f, VK_TRUE, properties.limits.maxSamplerAnisotropy, VK_FALSE, VK_COMPARE_OP_ALWAYS,
+		// Only ever texelFetch'ed, so filtering it would just blend neighbouring channels
+		VkSamplerCreateInfo sampler_ci = vki::samplerCreateInfo(VK_FILTER_NEAREST, VK_FILTER_NEAREST, VK_SAMPLER_MIPMAP_MODE_NEAREST,
+																VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+																0.0f, VK_FALSE, 1.0f, VK_FALSE, VK_COMPARE_OP_ALWAYS,
 																0.0f, 0.0f, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FALSE);
 
 		VkResult sampler_create = vkCreateSampler(device.logical_device, &sampler_ci, nullptr, &server_frame_sampler);
@@ -839,10 +1067,13 @@ struct DeviceRenderer
 		VkDeviceSize buffersize = sizeof(UBO);
 		ubos.resize(swapchain.images.size());
 		ubos_mem.resize(swapchain.images.size());
+		server_frame_ubos.resize(swapchain.images.size());
+		server_frame_ubos_mem.resize(swapchain.images.size());
 
 		for(uint32_t i = 0; i < swapchain.images.size(); i++)
 		{
 			create_buffer(device, buffersize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ubos[i], ubos_mem[i]);
+			create_buffer(device, sizeof(ServerFrameUBO), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, server_frame_ubos[i], server_frame_ubos_mem[i]);
 		}
 	}
 
@@ -855,6 +1086,7 @@ struct DeviceRenderer
 		float dt													 = std::chrono::duration<float, std::chrono::seconds::period>(current_time - start_time).count();
 
 		camera.move(dt, window);
+		send_pose();
 
 		UBOClient ubo = {
 			.model		= glm::rotate(glm::mat4(1.0f), dt * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f)),
@@ -862,6 +1094,7 @@ struct DeviceRenderer
 			.projection = glm::perspective(glm::radians(45.0f), swapchain.swapchain_extent.width / (float) swapchain.swapchain_extent.height, 0.1f, 10.0f),
 		};
 		ubo.projection[1][1] *= -1; // flip y coordinate from opengl
+		camera_view = ubo.view;
 
 		void *data;
 		vkMapMemory(device.logical_device, ubos_mem[current_image_index], 0, sizeof(ubo), 0, &data);
@@ -869,6 +1102,28 @@ struct DeviceRenderer
 		vkUnmapMemory(device.logical_device, ubos_mem[current_image_index]);
 	}
 
+	// What the server image holds now, where it goes, and how to reproject it, for the fullscreen quad
+	void update_server_frame_ubo(uint32_t current_image_index)
+	{
+		if(server_rect[2] > 0 && server_rect[3] > 0)
+		{
+			memcpy(server_image.rect, server_rect, sizeof(server_rect));
+		}
+		else
+		{
+			// Follows the window around when it's resized
+			server_image.rect[0] = ((int32_t) swapchain.swapchain_extent.width - (int32_t) SERVERWIDTH) / 2;
+			server_image.rect[1] = ((int32_t) swapchain.swapchain_extent.height - (int32_t) SERVERHEIGHT) / 2;
+			server_image.rect[2] = SERVERWIDTH;
+			server_image.rect[3] = SERVERHEIGHT;
+		}
+
+		void *data;
+		vkMapMemory(device.logical_device, server_frame_ubos_mem[current_image_index], 0, sizeof(server_image), 0, &data);
+		memcpy(data, &server_image, sizeof(server_image));
+		vkUnmapMemory(device.logical_device, server_frame_ubos_mem[current_image_index]);
+	}
+
 
 	void setup_graphics_pipeline()
 	{
@@ -1007,183 +1262,305 @@ struct DeviceRenderer
 	{
 		QueueFamilyIndices qf_indices = search_queue_families(device.physical_device, surface);
 
+		// The transfer command buffers get reset and recorded again every time they're used
 		VkCommandPoolCreateInfo pool_ci = vki::commandPoolCreateInfo(qf_indices.graphics_qf);
+		pool_ci.flags					= VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 		if(vkCreateCommandPool(device.logical_device, &pool_ci, nullptr, &command_pool) != VK_SUCCESS)
 		{
 			throw std::runtime_error("failed to create command pool!");
 		}
 	}
 
-	struct FirstRenderPassArgs
+	void setup_worker_command_pools()
 	{
-		OffscreenPass offscreen_pass;
-		VulkanSwapchain swapchain;
-		Pipelines pipelines;
-		VkCommandBuffer cmdbuf;
-		VkDescriptorSet descriptor_set;
-		VkBuffer vbo;
-		VkBuffer ibo;
-		PipelineLayouts pipeline_layouts;
-		Model model;
+		QueueFamilyIndices qf_indices = search_queue_families(device.physical_device, surface);
+
+		worker_command_pools.resize(jobs.workers + 1);
+		for(uint32_t i = 0; i < worker_command_pools.size(); i++)
+		{
+			VkCommandPoolCreateInfo pool_ci = vki::commandPoolCreateInfo(qf_indices.graphics_qf);
+			if(vkCreateCommandPool(device.logical_device, &pool_ci, nullptr, &worker_command_pools[i]) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create worker command pool!");
+			}
+		}
+	}
+
+	// Frees every command buffer recorded from them too
+	void destroy_worker_command_pools()
+	{
+		for(uint32_t i = 0; i < worker_command_pools.size(); i++)
+		{
+			vkDestroyCommandPool(device.logical_device, worker_command_pools[i], nullptr);
+		}
+		worker_command_pools.clear();
+	}
+
+	// What a recording job needs to know: whose command buffers, and for which swapchain image
+	struct RecordJobArgs
+	{
+		DeviceRenderer *dr;
+		uint32_t image;
 	};
 
-	static void *execute_first_renderpass(void *renderpassargs)
+	/*
+		Records both renderpasses for every swapchain image, once. Each
+		image's two renderpasses are recorded at the same time, and the
+		command buffer that runs them once they're both done:
+		  offscreen pass || fullscreen quad pass -> image's command buffer
+	*/
+	void setup_command_buffers()
 	{
-		COZ_BEGIN("execute_first_renderpass");
+		// Whatever was recorded before goes with the old pools
+		destroy_worker_command_pools();
+		setup_worker_command_pools();
+
+		offscreen_command_buffers.resize(command_buffers.size());
+		fsquad_command_buffers.resize(command_buffers.size());
+
+		std::vector<RecordJobArgs> record_args(command_buffers.size());
+		std::vector<Job> record_jobs(3 * command_buffers.size());
+		for(uint32_t i = 0; i < command_buffers.size(); i++)
+		{
+			record_args[i]	   = {this, i};
+			Job &offscreen_job = record_jobs[3 * i];
+			Job &fsquad_job	   = record_jobs[3 * i + 1];
+			Job &primary_job   = record_jobs[3 * i + 2];
+
+			offscreen_job.set(DeviceRenderer::record_offscreen_job, &record_args[i]);
+			fsquad_job.set(DeviceRenderer::record_fsquad_job, &record_args[i]);
+			primary_job.set(DeviceRenderer::record_primary_job, &record_args[i]);
+			primary_job.depends_on(offscreen_job);
+			primary_job.depends_on(fsquad_job);
+		}
+
+		for(Job &job : record_jobs)
+		{
+			jobs.submit(job);
+		}
+		for(Job &job : record_jobs)
+		{
+			jobs.wait(job);
+		}
+	}
+
+	static void record_offscreen_job(void *recordargs, uint32_t worker)
+	{
+		RecordJobArgs *args = (RecordJobArgs *) recordargs;
+		args->dr->record_offscreen_pass(args->image, worker);
+	}
+
+	static void record_fsquad_job(void *recordargs, uint32_t worker)
+	{
+		RecordJobArgs *args = (RecordJobArgs *) recordargs;
+		args->dr->record_fsquad_pass(args->image, worker);
+	}
 
-		FirstRenderPassArgs *args = (FirstRenderPassArgs *) renderpassargs;
+	static void record_primary_job(void *recordargs, uint32_t worker)
+	{
+		RecordJobArgs *args = (RecordJobArgs *) recordargs;
+		args->dr->record_primary_command_buffer(args->image, worker);
+	}
 
-		// First pass: The offscreen rendering
+	// A secondary command buffer from worker's pool, ready to record what goes in renderpass
+	VkCommandBuffer begin_secondary_command_buffer(uint32_t worker, VkRenderPass renderpass, VkFramebuffer framebuffer)
+	{
+		VkCommandBuffer cmdbuf;
+		VkCommandBufferAllocateInfo cmdbuf_ai = vki::commandBufferAllocateInfo(nullptr, worker_command_pools[worker], VK_COMMAND_BUFFER_LEVEL_SECONDARY, 1);
+		if(vkAllocateCommandBuffers(device.logical_device, &cmdbuf_ai, &cmdbuf) != VK_SUCCESS)
 		{
-			VkClearValue clear_values[2];
-			clear_values[0].color				= {0.0f, 0.0f, 0.0f, 1.0f};
-			clear_values[1].depthStencil		= {1.0f, 0};
-			VkRenderPassBeginInfo renderpass_bi = vki::renderPassBeginInfo(args->offscreen_pass.renderpass,
-																		   args->offscreen_pass.framebuffer,
-																		   {0, 0},
-																		   args->swapchain.swapchain_extent,
-																		   2, clear_values);
+			throw std::runtime_error("failed to allocate secondary command buffer!");
+		}
 
-			vkCmdBeginRenderPass(args->cmdbuf, &renderpass_bi, VK_SUBPASS_CONTENTS_INLINE);
+		VkCommandBufferInheritanceInfo inheritance_info = {
+			.sType		 = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+			.renderPass	 = renderpass,
+			.subpass	 = 0,
+			.framebuffer = framebuffer,
+		};
+		VkCommandBufferBeginInfo cmdbuf_bi = vki::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT);
+		cmdbuf_bi.pInheritanceInfo		   = &inheritance_info;
+		if(vkBeginCommandBuffer(cmdbuf, &cmdbuf_bi) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to begin recording secondary command buffer!");
+		}
 
-			vkCmdBindPipeline(args->cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, args->pipelines.model);
+		return cmdbuf;
+	}
 
-			VkBuffer vertex_buffers[] = {args->vbo};
-			VkDeviceSize offsets[]	  = {0};
+	// First pass: The offscreen rendering
+	void record_offscreen_pass(uint32_t image, uint32_t worker)
+	{
+		COZ_BEGIN("execute_first_renderpass");
+
+		VkCommandBuffer cmdbuf = begin_secondary_command_buffer(worker, offscreen_pass.renderpass, offscreen_pass.framebuffer);
+
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.model);
 
-			vkCmdBindVertexBuffers(args->cmdbuf, 0, 1, vertex_buffers, offsets);
-			vkCmdBindIndexBuffer(args->cmdbuf, args->ibo, 0, VK_INDEX_TYPE_UINT32);
+		VkBuffer vertex_buffers[] = {vbo};
+		VkDeviceSize offsets[]	  = {0};
 
-			vkCmdBindDescriptorSets(args->cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, args->pipeline_layouts.model, 0, 1, &args->descriptor_set, 0, nullptr);
+		vkCmdBindVertexBuffers(cmdbuf, 0, 1, vertex_buffers, offsets);
+		vkCmdBindIndexBuffer(cmdbuf, ibo, 0, VK_INDEX_TYPE_UINT32);
 
-			vkCmdDrawIndexed(args->cmdbuf, args->model.indices.size(), 1, 0, 0, 0);
+		vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layouts.model, 0, 1, &descriptor_sets.model[image], 0, nullptr);
 
-			vkCmdEndRenderPass(args->cmdbuf);
+		vkCmdDrawIndexed(cmdbuf, model.indices.size(), 1, 0, 0, 0);
+
+		if(vkEndCommandBuffer(cmdbuf) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to record offscreen command buffer!");
 		}
+		offscreen_command_buffers[image] = cmdbuf;
 
 		COZ_END("execute_first_renderpass");
-
-		return nullptr;
 	}
 
-	void setup_command_buffers()
+	// Second renderpass: Fullscreen quad draw
+	void record_fsquad_pass(uint32_t image, uint32_t worker)
 	{
+		COZ_BEGIN("fsquad_renderpass");
+
+		VkCommandBuffer cmdbuf = begin_secondary_command_buffer(worker, renderpass.renderpass, swapchain.framebuffers[image]);
 
-		VkCommandBufferAllocateInfo cmdbuf_ai = vki::commandBufferAllocateInfo(nullptr, command_pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, command_buffers.size());
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.fsquad);
+		vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layouts.fsquad, 0, 1, &descriptor_sets.fsquad[image], 0, nullptr);
+		vkCmdDraw(cmdbuf, 3, 1, 0, 0);
 
-		if(vkAllocateCommandBuffers(device.logical_device, &cmdbuf_ai, command_buffers.data()) != VK_SUCCESS)
+		if(vkEndCommandBuffer(cmdbuf) != VK_SUCCESS)
 		{
-			throw std::runtime_error("failed to allocate command buffers!");
+			throw std::runtime_error("failed to record fsquad command buffer!");
 		}
+		fsquad_command_buffers[image] = cmdbuf;
 
-		for(size_t i = 0; i < command_buffers.size(); i++)
-		{
-			VkCommandBufferBeginInfo cmdbuf_bi = vki::commandBufferBeginInfo();
+		COZ_END("fsquad_renderpass");
+	}
 
-			if(vkBeginCommandBuffer(command_buffers[i], &cmdbuf_bi) != VK_SUCCESS)
-			{
-				throw std::runtime_error("failed to begin recording command buffer!");
-			}
+	// The swapchain image's own command buffer, which begins each renderpass and runs what was recorded for it
+	void record_primary_command_buffer(uint32_t image, uint32_t worker)
+	{
+		VkCommandBufferAllocateInfo cmdbuf_ai = vki::commandBufferAllocateInfo(nullptr, worker_command_pools[worker], VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+		if(vkAllocateCommandBuffers(device.logical_device, &cmdbuf_ai, &command_buffers[image]) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to allocate command buffers!");
+		}
 
+		VkCommandBuffer cmdbuf			   = command_buffers[image];
+		VkCommandBufferBeginInfo cmdbuf_bi = vki::commandBufferBeginInfo();
+		if(vkBeginCommandBuffer(cmdbuf, &cmdbuf_bi) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
 
-			FirstRenderPassArgs renderpassargs = {offscreen_pass, swapchain, pipelines, command_buffers[i], descriptor_sets.model[i], vbo, ibo, pipeline_layouts, model};
-			int first_renderpass_thread		   = pthread_create(&vk_pthread_t.first_renderpass_thread, nullptr, DeviceRenderer::execute_first_renderpass, (void *) &renderpassargs);
+		VkClearValue clear_values[2];
+		clear_values[0].color		 = {0.0f, 0.0f, 0.0f, 1.0f};
+		clear_values[1].depthStencil = {1.0f, 0};
+
+		VkRenderPassBeginInfo offscreen_bi = vki::renderPassBeginInfo(offscreen_pass.renderpass,
+																	  offscreen_pass.framebuffer,
+																	  {0, 0},
+																	  swapchain.swapchain_extent,
+																	  2, clear_values);
+		vkCmdBeginRenderPass(cmdbuf, &offscreen_bi, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		vkCmdExecuteCommands(cmdbuf, 1, &offscreen_command_buffers[image]);
+		vkCmdEndRenderPass(cmdbuf);
+
+		VkRenderPassBeginInfo fsquad_bi = vki::renderPassBeginInfo(renderpass.renderpass,
+																   swapchain.framebuffers[image],
+																   {0, 0},
+																   swapchain.swapchain_extent,
+																   2, clear_values);
+		vkCmdBeginRenderPass(cmdbuf, &fsquad_bi, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		vkCmdExecuteCommands(cmdbuf, 1, &fsquad_command_buffers[image]);
+		vkCmdEndRenderPass(cmdbuf);
+
+		if(vkEndCommandBuffer(cmdbuf) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
 
-			// The pthread_join isn't actually waiting here
-			// Try joining before calling setup_command_buffers()
 
-			pthread_join(vk_pthread_t.first_renderpass_thread, nullptr);
+	// Records this frame's server frame copies into its transfer command buffer. Returns false if there aren't any
+	bool record_transfer_command_buffer()
+	{
+		if(shown_frames.empty())
+		{
+			return false;
+		}
 
-			if(i == 0)
-			{
-				pthread_join(vk_pthread_t.rec_image_thread, nullptr);
-			}
+		VkCommandBuffer cmdbuf = transfer_command_buffers[current_frame];
+		vkResetCommandBuffer(cmdbuf, 0);
 
-			// Copy the memory from the server into the local frame attachment
-			// This should be done before the 2nd renderpass, cause this local frame attachment
-			// will be used as an input
-
-			transition_image_layout(device, command_pool, command_buffers[i],
-									offscreen_pass.colour_attachment.image,
-									VK_ACCESS_MEMORY_READ_BIT,				  // src access_mask
-									VK_ACCESS_TRANSFER_WRITE_BIT,			  // dst access_mask
-									VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // current layout
-									VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	  // new layout to transfer to (destination)
-									VK_PIPELINE_STAGE_TRANSFER_BIT,			  // dst pipeline mask
-									VK_PIPELINE_STAGE_TRANSFER_BIT);		  // src pipeline mask
-
-			// Image subresource to be used in the vkbufferimagecopy
-			VkImageSubresourceLayers image_subresource = {
-				.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT,
-				.baseArrayLayer = 0,
-				.layerCount		= 1,
-			};
+		VkCommandBufferBeginInfo cmdbuf_bi = vki::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+		if(vkBeginCommandBuffer(cmdbuf, &cmdbuf_bi) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to begin recording transfer command buffer!");
+		}
 
-			int32_t start_col_pixel = (1920 / 2 - 512 / 2);
-			int32_t start_row_pixel = (1080 / 2 - 512 / 2);
-			VkOffset3D image_offset = {
-				.x = start_col_pixel,
-				.y = start_row_pixel,
-				.z = 0,
-			};
+		record_shown_frames(cmdbuf);
 
-			// Create the vkbufferimagecopy pregions
-			VkBufferImageCopy copy_region = {
-				.bufferOffset	   = 0,
-				.bufferRowLength   = 0,
-				.bufferImageHeight = 0,
-				.imageSubresource  = image_subresource,
-				.imageOffset	   = image_offset,
-				.imageExtent	   = {SERVERWIDTH, SERVERHEIGHT, 1},
-			};
+		if(vkEndCommandBuffer(cmdbuf) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to record transfer command buffer!");
+		}
+		return true;
+	}
 
+	/*
+		Copies the frames picked for this frame into the server images, in
+		order. Tiles only patch what came before them, so it starts from the
+		newest frame that isn't tiles, and only the newest frame's depth is
+		worth copying.
+	*/
+	void record_shown_frames(VkCommandBuffer cmdbuf)
+	{
+		if(shown_frames.empty())
+		{
+			return;
+		}
 
-			// Perform the copy
-			vkCmdCopyBufferToImage(command_buffers[i],
-								   image_buffer,
-								   offscreen_pass.colour_attachment.image,
-								   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-								   1, &copy_region);
+		size_t first = shown_frames.size() - 1;
+		while(first > 0 && shown_frames[first].header.format == FRAME_FORMAT_RGB8_TILES)
+		{
+			first--;
+		}
+		for(size_t i = first; i < shown_frames.size(); i++)
+		{
+			record_server_image_copy(cmdbuf, server_colour_attachment.image, slot_copy_regions[shown_frames[i].slot]);
+		}
+		record_server_image_copy(cmdbuf, server_depth_attachment.image, slot_depth_copy_regions[shown_frames.back().slot]);
+	}
 
-			// Transition swapchain image back
-			transition_image_layout(device, command_pool, command_buffers[i],
-									offscreen_pass.colour_attachment.image,
-									VK_ACCESS_TRANSFER_WRITE_BIT,			  // src access mask
-									VK_ACCESS_MEMORY_READ_BIT,				  // dst access mask
-									VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	  // current layout
-									VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // layout transitioning to
-									VK_PIPELINE_STAGE_TRANSFER_BIT,			  // pipeline flags
-									VK_PIPELINE_STAGE_TRANSFER_BIT);		  // pipeline flags
 
+	void record_server_image_copy(VkCommandBuffer cmdbuf, VkImage image, const std::vector<VkBufferImageCopy> &regions)
+	{
+		if(regions.empty())
+		{
+			return;
+		}
 
-			COZ_BEGIN("fsquad_renderpass")
-			// Second renderpass: Fullscreen quad draw
-			{
-				VkClearValue clear_values[2];
-				clear_values[0].color		 = {0.0f, 0.0f, 0.0f, 1.0f};
-				clear_values[1].depthStencil = {1.0f, 0};
-
-				VkRenderPassBeginInfo renderpass_bi = vki::renderPassBeginInfo(renderpass.renderpass,
-																			   swapchain.framebuffers[i],
-																			   {0, 0},
-																			   swapchain.swapchain_extent,
-																			   2, clear_values);
-
-				vkCmdBeginRenderPass(command_buffers[i], &renderpass_bi, VK_SUBPASS_CONTENTS_INLINE);
-
-				vkCmdBindPipeline(command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.fsquad);
-				vkCmdBindDescriptorSets(command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layouts.fsquad, 0, 1, &descriptor_sets.fsquad[i], 0, nullptr);
-				vkCmdDraw(command_buffers[i], 3, 1, 0, 0);
-				vkCmdEndRenderPass(command_buffers[i]);
-			}
-			COZ_END("fsquad_renderpass");
+		transition_image_layout(device, command_pool, cmdbuf,
+								image,
+								VK_ACCESS_SHADER_READ_BIT,				  // src access_mask
+								VK_ACCESS_TRANSFER_WRITE_BIT,			  // dst access_mask
+								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // current layout
+								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	  // new layout to transfer to (destination)
+								VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,	  // src pipeline mask
+								VK_PIPELINE_STAGE_TRANSFER_BIT);		  // dst pipeline mask
 
+		// Perform the copy, one region per tile the server sent
+		vkCmdCopyBufferToImage(cmdbuf, image_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.size(), regions.data());
 
-			if(vkEndCommandBuffer(command_buffers[i]) != VK_SUCCESS)
-			{
-				throw std::runtime_error("failed to record command buffer!");
-			}
-		}
+		// Transition back so the fullscreen quad can read it
+		transition_image_layout(device, command_pool, cmdbuf,
+								image,
+								VK_ACCESS_TRANSFER_WRITE_BIT,			  // src access mask
+								VK_ACCESS_SHADER_READ_BIT,				  // dst access mask
+								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	  // current layout
+								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // layout transitioning to
+								VK_PIPELINE_STAGE_TRANSFER_BIT,			  // pipeline flags
+								VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);	  // pipeline flags
 	}
 
 
@@ -1193,6 +1570,14 @@ struct DeviceRenderer
 		render_finished_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
 		in_flight_fences.resize(MAX_FRAMES_IN_FLIGHT);
 		images_in_flight.resize(swapchain.images.size(), VK_NULL_HANDLE);
+		slots_in_flight.resize(MAX_FRAMES_IN_FLIGHT);
+		transfer_command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+		VkCommandBufferAllocateInfo cmdbuf_ai = vki::commandBufferAllocateInfo(nullptr, command_pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, transfer_command_buffers.size());
+		if(vkAllocateCommandBuffers(device.logical_device, &cmdbuf_ai, transfer_command_buffers.data()) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to allocate transfer command buffers!");
+		}
 
 		VkSemaphoreCreateInfo semaphore_ci = vki::semaphoreCreateInfo();
 		VkFenceCreateInfo fence_ci		   = vki::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
@@ -1213,24 +1598,14 @@ struct DeviceRenderer
 	{
 		std::chrono::_V2::system_clock::time_point start = std::chrono::high_resolution_clock::now();
 
-		// Make a thread for the swapchain image
-		int receive_image_thread_create = pthread_create(&vk_pthread_t.rec_image_thread, nullptr, DeviceRenderer::receive_swapchain_image, this);
-
-
-		// Write camera data (position, front) to server
-		float camera_data[6] = {
-			camera.position.x,
-			camera.position.y,
-			camera.position.z,
-
-			camera.front.x,
-			camera.front.y,
-			camera.front.z,
-		};
-		//write(client.socket_fd, camera_data, 6 * sizeof(float));
-
 		vkWaitForFences(device.logical_device, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX);
 
+		// The last frame with this fence is done copying out of its slots, so they can be received into again
+		for(uint32_t slot : slots_in_flight[current_frame])
+		{
+			jitter_buffer.release_slot(slot);
+		}
+		slots_in_flight[current_frame].clear();
 
 
 		uint32_t image_index;
@@ -1243,17 +1618,21 @@ struct DeviceRenderer
 			return;
 		}
 
-		update_ubos(image_index);
-
-		setup_command_buffers();
-
-
+		// This image's UBOs can't change until the last frame that used them is done
 		if(images_in_flight[image_index] != VK_NULL_HANDLE)
 		{
 			vkWaitForFences(device.logical_device, 1, &images_in_flight[image_index], VK_TRUE, UINT64_MAX);
 		}
 		images_in_flight[image_index] = in_flight_fences[current_frame];
 
+		update_ubos(image_index);
+		pick_server_frames();
+		update_server_frame_ubo(image_index);
+
+		// The server frame copies go first, so the fullscreen quad samples what they copied
+		VkCommandBuffer submitted_command_buffers[] = {transfer_command_buffers[current_frame], command_buffers[image_index]};
+		bool transfer								= record_transfer_command_buffer();
+
 		VkSemaphore wait_semaphores[]	   = {image_available_semaphores[current_frame]};
 		VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
 		VkSemaphore signal_semaphores[]	   = {render_finished_semaphores[current_frame]};
@@ -1262,8 +1641,8 @@ struct DeviceRenderer
 		submit_info.waitSemaphoreCount	 = 1;
 		submit_info.pWaitSemaphores		 = wait_semaphores;
 		submit_info.pWaitDstStageMask	 = wait_stages;
-		submit_info.commandBufferCount	 = 1;
-		submit_info.pCommandBuffers		 = &command_buffers[image_index];
+		submit_info.commandBufferCount	 = transfer ? 2 : 1;
+		submit_info.pCommandBuffers		 = transfer ? submitted_command_buffers : &command_buffers[image_index];
 		submit_info.signalSemaphoreCount = 1;
 		submit_info.pSignalSemaphores	 = signal_semaphores;
 
@@ -1280,6 +1659,9 @@ struct DeviceRenderer
 
 		vkQueuePresentKHR(device.present_queue, &present_info);
 
+		// Copied in now, the next frame picks its own
+		shown_frames.clear();
+
 		current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
 
 		std::chrono::_V2::system_clock::time_point finish = std::chrono::high_resolution_clock::now();
@@ -1293,107 +1675,417 @@ struct DeviceRenderer
 		std::cout << "avg fps: " << avgfps << std::endl;
 	}
 
-	static void *receive_swapchain_image(void *devicerenderer)
+	void start_receiving()
 	{
-		COZ_BEGIN("network_receive");
-		DeviceRenderer *dr = (DeviceRenderer *) devicerenderer;
+		slot_copy_regions.resize(image_buffer_slots);
+		slot_depth_copy_regions.resize(image_buffer_slots);
+		jitter_buffer.start(jitter_depth, image_buffer_slots);
 
-		VkDeviceSize memcpy_offset = 0;
-		/*std::string filename	   = "tmpclient" + std::to_string(dr->numframes) + ".ppm";
+		if(pthread_create(&vk_pthread_t.rec_image_thread, nullptr, DeviceRenderer::receive_swapchain_image, this) != 0)
+		{
+			throw std::runtime_error("Could not create receive thread");
+		}
+	}
 
-		std::ofstream file(filename, std::ios::out | std::ios::binary);
-		file << "P6\n"
-			 << SERVERWIDTH << "\n"
-			 << SERVERHEIGHT << "\n"
-			 << 255 << "\n";*/
+	// The receive thread might be stuck in a TCP recv, which only shutting the socket down gets it out of
+	void stop_receiving()
+	{
+		jitter_buffer.stop();
+		shutdown(client.socket_fd, SHUT_RDWR);
+		pthread_join(vk_pthread_t.rec_image_thread, nullptr);
+	}
 
-		// Create buffer to read from tcp socket
-		VkDeviceSize num_bytes_network_read = SERVERWIDTH * SERVERHEIGHT * 3;
-		VkDeviceSize num_bytes_for_image	= SERVERWIDTH * SERVERHEIGHT * sizeof(uint32_t);
-		uint8_t servbuf[num_bytes_network_read];
+	// Render thread: takes the frames the pacer says are due, and points the fullscreen quad at the newest
+	void pick_server_frames()
+	{
+		uint32_t held = jitter_buffer.pick(timestamp_us(), shown_frames);
+		if(!shown_frames.empty())
+		{
+			const BufferedFrame &newest = shown_frames.back();
+			set_server_image(newest.header);
+			for(const BufferedFrame &frame : shown_frames)
+			{
+				slots_in_flight[current_frame].push_back(frame.slot);
+			}
+			if(frame_stats)
+			{
+				printf("Showing server frame %lu (%zu picked, %u held back), %f ms after it arrived, playout delay %f ms\n",
+					   newest.header.sequence, shown_frames.size(), held, (timestamp_us() - newest.arrived_us) / 1000.0, jitter_buffer.playout_delay_us.load() / 1000.0);
+			}
+		}
 
-		// Begin mapping the memory
-		vkMapMemory(dr->device.logical_device, dr->image_buffer_memory, 0, num_bytes_for_image, 0, (void **) &dr->server_image_data);
+		// Whether or not there's a new frame, it's shown from where the camera is now
+		server_image.reprojection = server_projection * camera_view * glm::inverse(server_projection * server_view);
+	}
 
-		int server_read = recv(dr->client.socket_fd, servbuf, num_bytes_network_read, MSG_WAITALL);
+	// Receive thread: runs until stop_receiving(), or until the server goes away
+	static void *receive_swapchain_image(void *devicerenderer)
+	{
+		DeviceRenderer *dr = (DeviceRenderer *) devicerenderer;
 
-		// Convert RGB network packets to RGBA
-		if(server_read != -1)
+		uint32_t slot;
+		while(dr->jitter_buffer.acquire_slot(slot))
 		{
-			rgb_to_rgba(servbuf, dr->server_image_data, num_bytes_for_image);
-		}
+			COZ_BEGIN("network_receive");
+
+			// The frame goes straight into its slot of the mapped staging buffer, the GPU deals with it from there
+			VkDeviceSize slot_offset = slot * dr->image_buffer_slot_size;
+			uint8_t *out			 = dr->server_image_data + slot_offset;
+			dr->slot_copy_regions[slot].clear();
+			dr->slot_depth_copy_regions[slot].clear();
+
+			FrameHeader header;
+			size_t frame_size;
+			bool received;
+			if(dr->udp)
+			{
+				received = dr->receive_udp_frame(header, out, dr->image_buffer_slot_size, frame_size);
+			}
+			else
+			{
+				if(!recv_frame_header(dr->client.socket_fd, header))
+				{
+					printf("Lost the connection to the server, no more frames\n");
+					COZ_END("network_receive");
+					break;
+				}
+				received = dr->receive_frame_payload(header, out, dr->image_buffer_slot_size, frame_size);
+			}
+			if(received)
+			{
+				dr->setup_server_copy_regions(header, slot, frame_size);
+				dr->setup_server_depth_copy_region(header, slot, slot_offset + frame_size);
+			}
+			COZ_END("network_receive");
 
-		vkUnmapMemory(dr->device.logical_device, dr->image_buffer_memory);
-		COZ_END("network_receive");
+			// Nothing gets copied unless a frame arrived
+			if(dr->slot_copy_regions[slot].empty())
+			{
+				dr->jitter_buffer.release_slot(slot);
+				continue;
+			}
 
-		COZ_BEGIN("copy_network_image");
-		// Now the VkBuffer should be filled with memory that we can copy to a swapchain image.
-		// Transition swapchain image to copyable layout
+			BufferedFrame frame = {
+				.header		= header,
+				.slot		= slot,
+				.frame_size = frame_size,
+				.arrived_us = timestamp_us(),
+				.due_us		= 0,
+			};
+			dr->jitter_buffer.push(frame);
+		}
 
-		/*
-		VkCommandBuffer copy_cmdbuf = begin_command_buffer(dr->device, dr->command_pool);
+		return nullptr;
+	}
 
-		// Transition current swapchain image to be transfer_dst_optimal. Need to note the src and dst access masks
-		transition_image_layout(dr->device, dr->command_pool, copy_cmdbuf,
-								dr->server_colour_attachment.image,
-								VK_ACCESS_MEMORY_READ_BIT,				  // src access_mask
-								VK_ACCESS_TRANSFER_WRITE_BIT,			  // dst access_mask
-								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // current layout
-								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	  // new layout to transfer to (destination)
-								VK_PIPELINE_STAGE_TRANSFER_BIT,			  // dst pipeline mask
-								VK_PIPELINE_STAGE_TRANSFER_BIT);		  // src pipeline mask
 
-		// Image subresource to be used in the vkbufferimagecopy
+	/*
+		Fills in slot_copy_regions for a frame that's been received into
+		image_buffer's slot. A full frame is one region, YCoCg frames
+		are one per plane, and tiled frames get one region per tile they
+		carry. A tiled payload whose size doesn't add up to its bitmap is
+		thrown away rather than half copied.
+	*/
+	void setup_server_copy_regions(const FrameHeader &header, uint32_t slot, size_t frame_size)
+	{
+		std::vector<VkBufferImageCopy> &copy_regions = slot_copy_regions[slot];
+		VkDeviceSize slot_offset					 = slot * image_buffer_slot_size;
+
 		VkImageSubresourceLayers image_subresource = {
 			.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT,
 			.baseArrayLayer = 0,
 			.layerCount		= 1,
 		};
 
-		// Create the vkbufferimagecopy pregions
+		uint32_t width	= header.width;
+		uint32_t height = header.height;
+
+		// Each RGB pixel is three R8 texels, so every width and x here is times 3
+		if(header.format == FRAME_FORMAT_RGB8)
+		{
+			VkBufferImageCopy copy_region = {
+				.bufferOffset	   = slot_offset,
+				.bufferRowLength   = 0,
+				.bufferImageHeight = 0,
+				.imageSubresource  = image_subresource,
+				.imageOffset	   = {0, 0, 0},
+				.imageExtent	   = {width * 3, height, 1},
+			};
+			copy_regions.push_back(copy_region);
+			return;
+		}
+
+		// The Y plane goes on the left, with Co above Cg to the right of it. The fullscreen quad shader puts them back together
+		if(header.format == FRAME_FORMAT_YCOCG420)
+		{
+			VkDeviceSize luma_size	 = (VkDeviceSize) width * height;
+			VkDeviceSize chroma_size = luma_size / 4;
+
+			VkBufferImageCopy planes[] = {
+				{slot_offset, 0, 0, image_subresource, {0, 0, 0}, {width, height, 1}},
+				{slot_offset + luma_size, 0, 0, image_subresource, {(int32_t) width, 0, 0}, {width / 2, height / 2, 1}},
+				{slot_offset + luma_size + chroma_size, 0, 0, image_subresource, {(int32_t) width, (int32_t) height / 2, 0}, {width / 2, height / 2, 1}},
+			};
+			copy_regions.assign(planes, planes + 3);
+			return;
+		}
+
+		const uint8_t *bitmap = server_image_data + slot_offset;
+		VkDeviceSize offset	  = server_tile_grid.bitmap_size();
+
+		for(uint32_t tile = 0; tile < server_tile_grid.num_tiles(); tile++)
+		{
+			if(!tile_bit(bitmap, tile))
+			{
+				continue;
+			}
+
+			uint32_t x, y, w, h;
+			server_tile_grid.tile_rect(tile, x, y, w, h);
+
+			VkBufferImageCopy copy_region = {
+				.bufferOffset	   = slot_offset + offset,
+				.bufferRowLength   = w * 3,
+				.bufferImageHeight = h,
+				.imageSubresource  = image_subresource,
+				.imageOffset	   = {(int32_t) x * 3, (int32_t) y, 0},
+				.imageExtent	   = {w * 3, h, 1},
+			};
+			copy_regions.push_back(copy_region);
+			offset += w * h * 3;
+		}
+
+		if(offset != frame_size)
+		{
+			printf("Frame %lu's tiles don't add up to its %zu bytes, skipping it\n", header.sequence, frame_size);
+			copy_regions.clear();
+		}
+	}
+
+	// A frame's depth is one region covering the depth image, if the frame has any and its colour is getting copied
+	void setup_server_depth_copy_region(const FrameHeader &header, uint32_t slot, VkDeviceSize depth_offset)
+	{
+		if(header.depth_size == 0 || slot_copy_regions[slot].empty())
+		{
+			return;
+		}
+
 		VkBufferImageCopy copy_region = {
-			.bufferOffset	   = 0,
-			.bufferRowLength   = SERVERWIDTH,
-			.bufferImageHeight = SERVERHEIGHT,
-			.imageSubresource  = image_subresource,
-			.imageExtent	   = {SERVERWIDTH, SERVERHEIGHT, 1},
+			.bufferOffset	   = depth_offset,
+			.bufferRowLength   = 0,
+			.bufferImageHeight = 0,
+			.imageSubresource  = vki::imageSubresourceLayers(VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1),
+			.imageOffset	   = {0, 0, 0},
+			.imageExtent	   = {header.width, header.height, 1},
 		};
+		slot_depth_copy_regions[slot].push_back(copy_region);
+	}
 
+	// Render thread: the server images are about to hold header's frame
+	void set_server_image(const FrameHeader &header)
+	{
+		// A server's first tiled frame has every tile, so nothing of an earlier format is left showing
+		server_image.format	   = header.format == FRAME_FORMAT_YCOCG420 ? FRAME_FORMAT_YCOCG420 : FRAME_FORMAT_RGB8;
+		server_image.foveated  = (header.flags & FRAME_FLAG_FOVEATED) != 0;
+		server_image.width	   = header.width;
+		server_image.reproject = header.depth_size != 0;
+		memcpy(&server_view, header.view, sizeof(server_view));
+		memcpy(&server_projection, header.projection, sizeof(server_projection));
+	}
 
-		// Perform the copy
-		vkCmdCopyBufferToImage(copy_cmdbuf,
-							   dr->image_buffer,
-							   dr->server_colour_attachment.image,
-							   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-							   1, &copy_region);
 
-		// Transition server image to be a src for transfer
-		transition_image_layout(dr->device, dr->command_pool, copy_cmdbuf,
-								dr->server_colour_attachment.image,
-								VK_ACCESS_TRANSFER_WRITE_BIT,			  // src access mask
-								VK_ACCESS_MEMORY_READ_BIT,				  // dst access mask
-								VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,	  // current layout
-								VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, // layout transitioning to
-								VK_PIPELINE_STAGE_TRANSFER_BIT,			  // pipeline flags
-								VK_PIPELINE_STAGE_TRANSFER_BIT);		  // pipeline flags
+	// Whether this client can show header's frame, given out_size bytes to decode it into
+	bool displayable_frame(const FrameHeader &header, size_t out_size)
+	{
+		bool foveated	 = (header.flags & FRAME_FLAG_FOVEATED) != 0;
+		bool displayable = header.width == (foveated ? server_max_width : SERVERWIDTH) && header.height == SERVERHEIGHT &&
+						   (header.format == FRAME_FORMAT_RGB8 || header.format == FRAME_FORMAT_RGB8_TILES || header.format == FRAME_FORMAT_YCOCG420) &&
+						   FrameCompressor::supported(header.codec) &&
+						   (header.depth_size == 0 || (!foveated && header.depth_size == depth16_size(header.width, header.height))) &&
+						   header.payload_size <= FrameCompressor::max_encoded_size(header.codec, out_size);
+
+		if(!displayable)
+		{
+			printf("Skipping frame %lu: %ux%u format %u codec %u, %lu bytes\n", header.sequence, header.width, header.height, header.format, header.codec, header.payload_size);
+		}
 
-		end_command_buffer(dr->device, dr->command_pool, copy_cmdbuf);
-		*/
-		
-		COZ_END("copy_network_image");
+		return displayable;
+	}
 
-		return nullptr;
+	/*
+		Reads the payload that follows header and decodes it into out, setting
+		frame_size to how much of out the frame takes up. Uncompressed payloads
+		are received straight into out. Frames this client can't display
+		(wrong size, format or codec) are read and thrown away, so the stream
+		stays in sync. Returns true if out holds a new frame.
+	*/
+	bool receive_frame_payload(const FrameHeader &header, uint8_t *out, size_t out_size, size_t &frame_size)
+	{
+		if(!displayable_frame(header, out_size))
+		{
+			return skip_frame_payload(header);
+		}
+
+		// The header only just arrived, so this is about when the frame's first bytes did
+		uint64_t start_us = timestamp_us();
+
+		bool compressed	 = header.codec != FRAME_CODEC_RAW;
+		uint8_t *payload = compressed ? compressed_payload.data() : out;
+		if(compressed && compressed_payload.size() < header.payload_size)
+		{
+			compressed_payload.resize(header.payload_size);
+			payload = compressed_payload.data();
+		}
+
+		if(!recv_all(client.socket_fd, payload, header.payload_size))
+		{
+			return false;
+		}
+		frame_receive_us = timestamp_us() - start_us;
+
+		return finish_frame(header, payload, out, out_size, frame_size);
+	}
+
+	/*
+		UDP version of the above. Packets are put back together straight into
+		out, or compressed_payload if the frame is compressed, and whatever
+		isn't whole by the deadline is dropped. Losing a frame loses its tiles
+		too, so that asks the server for a keyframe.
+	*/
+	bool receive_udp_frame(FrameHeader &header, uint8_t *out, size_t out_size, size_t &frame_size)
+	{
+		bool received	 = udp_receiver.receive_frame(header, out, out_size, compressed_payload.data(), compressed_payload.size(), deadline_ms);
+		frame_receive_us = udp_receiver.receive_us;
+
+		// Frames that never showed up at all only show up as a gap in the sequence numbers
+		uint64_t lost = udp_receiver.frames_lost - frames_lost;
+		if(received && received_first_frame && header.sequence > last_frame_header.sequence + 1)
+		{
+			lost += header.sequence - last_frame_header.sequence - 1;
+		}
+		frames_lost = udp_receiver.frames_lost;
+
+		bool shown = received && displayable_frame(header, out_size) &&
+					 finish_frame(header, header.codec != FRAME_CODEC_RAW ? compressed_payload.data() : out, out, out_size, frame_size);
+
+		if(received && !shown)
+		{
+			lost++;
+		}
+		if(lost > 0)
+		{
+			printf("Lost %lu frames over UDP, asking for a keyframe\n", lost);
+			send_client_message(client.socket_fd, CLIENT_MESSAGE_KEYFRAME, last_frame_header.sequence, 0);
+		}
+
+		return shown;
+	}
+
+	/*
+		Decodes a received payload into out if it's compressed, checks it
+		came out the size its format says, and keeps track of the stream.
+		Returns true if out holds a new frame.
+	*/
+	bool finish_frame(const FrameHeader &header, const uint8_t *payload, uint8_t *out, size_t out_size, size_t &frame_size)
+	{
+		if(server_tile_grid.width != header.width || server_tile_grid.height != header.height)
+		{
+			server_tile_grid = TileGrid(header.width, header.height);
+		}
+
+		// Depth is never compressed, only the colour before it is
+		size_t colour_size = header.payload_size - header.depth_size;
+		frame_size		   = colour_size;
+		if(header.codec != FRAME_CODEC_RAW)
+		{
+			COZ_BEGIN("frame_decompress");
+			frame_size = decompressor.decode(header.codec, payload, colour_size, header.format, server_tile_grid, out, out_size - header.depth_size);
+			COZ_END("frame_decompress");
+		}
+
+		bool full_frame = header.format == FRAME_FORMAT_RGB8 && frame_size == (size_t) header.width * header.height * 3;
+		bool tiles		= header.format == FRAME_FORMAT_RGB8_TILES && frame_size >= server_tile_grid.bitmap_size();
+		bool ycocg		= header.format == FRAME_FORMAT_YCOCG420 && frame_size == ycocg420_size(header.width, header.height);
+		if(!full_frame && !tiles && !ycocg)
+		{
+			printf("Frame %lu didn't decode (%s, %lu bytes) to a frame, skipping it\n", header.sequence, FrameCompressor::name(header.codec), header.payload_size);
+			return false;
+		}
+
+		// Uncompressed payloads were received with their depth already right after the colour
+		if(header.depth_size != 0 && payload != out)
+		{
+			memcpy(out + frame_size, payload + colour_size, header.depth_size);
+		}
+
+		if(received_first_frame && header.sequence != last_frame_header.sequence + 1)
+		{
+			printf("Server dropped %lu frames before frame %lu\n", header.sequence - last_frame_header.sequence - 1, header.sequence);
+		}
+
+		// Only meaningful if the server and client clocks are synced
+		if(frame_stats)
+		{
+			printf("frame %lu server to client latency: %f ms\n", header.sequence, (int64_t) (timestamp_us() - header.server_timestamp_us) / 1000.0);
+		}
+
+		// Same clock both ends, so this one always means something
+		if(header.pose_id != 0 && header.pose_id + POSE_HISTORY > last_pose_id.load())
+		{
+			uint64_t round_trip_us = timestamp_us() - pose_sent_us[header.pose_id % POSE_HISTORY].load();
+			pose_round_trip_us.store(round_trip_us);
+			if(frame_stats)
+			{
+				printf("frame %lu pose %lu round trip: %f ms\n", header.sequence, header.pose_id, round_trip_us / 1000.0);
+			}
+		}
+
+		last_frame_header	 = header;
+		received_first_frame = true;
+
+		// Lets the server see how long frames take to get here, and how fast they arrive
+		send_client_message(client.socket_fd, CLIENT_MESSAGE_ACK, header.sequence, frame_receive_us);
+		return true;
+	}
+
+
+	// Reads and throws away header's payload. Always returns false, as in no frame
+	bool skip_frame_payload(const FrameHeader &header)
+	{
+		uint8_t skip[4096];
+		for(uint64_t remaining = header.payload_size; remaining > 0;)
+		{
+			size_t num_bytes = std::min<uint64_t>(remaining, sizeof(skip));
+			if(!recv_all(client.socket_fd, skip, num_bytes))
+			{
+				return false;
+			}
+			remaining -= num_bytes;
+		}
+
+		return false;
 	}
 
 
 	void create_copy_image_buffer()
 	{
-		// Create a VkBuffer
-		VkDeviceSize image_buffer_size = SERVERWIDTH * SERVERHEIGHT * sizeof(uint32_t);
+		// Create a VkBuffer, with slots that each fit any payload exactly as it comes off the network
+		image_buffer_slots			   = jitter_depth + MAX_FRAMES_IN_FLIGHT + 2;
+		image_buffer_slot_size		   = TileGrid(server_max_width, SERVERHEIGHT).max_payload_size() + depth16_size(SERVERWIDTH, SERVERHEIGHT);
+		VkDeviceSize image_buffer_size = image_buffer_slot_size * image_buffer_slots;
 		create_buffer(device, image_buffer_size,
 					  VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 					  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 					  image_buffer, image_buffer_memory);
+
+		// Mapped for as long as the buffer lives, so receiving a frame doesn't need to map it again
+		if(vkMapMemory(device.logical_device, image_buffer_memory, 0, VK_WHOLE_SIZE, 0, (void **) &server_image_data) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not map server image buffer");
+		}
+
+		// Decodes whatever codec each frame says it uses, so the codec it's made with doesn't matter
+		decompressor = FrameCompressor(FRAME_CODEC_RAW, 0);
 	}
 
 
@@ -1409,6 +2101,7 @@ struct DeviceRenderer
 		setup_framebuffers();
 		initialize_ubos();
 		setup_descriptor_pool();
+		setup_descriptor_sets();
 		setup_command_buffers();
 	}
 };
@@ -1417,9 +2110,59 @@ struct DeviceRenderer
 
 
 
-int main()
+int main(int argc, char **argv)
 {
 	DeviceRenderer device_renderer;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--udp") == 0)
+		{
+			device_renderer.udp = true;
+		}
+		else if(strcmp(argv[i], "--deadline-ms") == 0 && i + 1 < argc)
+		{
+			device_renderer.deadline_ms = std::max(1, atoi(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+		{
+			device_renderer.port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pose-port") == 0 && i + 1 < argc)
+		{
+			device_renderer.pose_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+		{
+			device_renderer.workers = std::max(0, atoi(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--jitter-depth") == 0 && i + 1 < argc)
+		{
+			device_renderer.jitter_depth = std::min(std::max(0, atoi(argv[++i])), JITTER_MAX_DEPTH);
+		}
+		else if(strcmp(argv[i], "--server-rect") == 0 && i + 4 < argc)
+		{
+			for(uint32_t j = 0; j < 4; j++)
+			{
+				device_renderer.server_rect[j] = atoi(argv[++i]);
+			}
+		}
+		else if(strcmp(argv[i], "--no-prediction") == 0)
+		{
+			device_renderer.predict_poses = false;
+		}
+		else if(strcmp(argv[i], "--frame-stats") == 0)
+		{
+			device_renderer.frame_stats = true;
+		}
+		else
+		{
+			printf("Unknown argument %s\n", argv[i]);
+			printf("Usage: %s [--udp] [--deadline-ms n] [--jitter-depth n] [--workers n] [--server-rect x y width height] [--no-prediction] [--frame-stats] [--port n] [--pose-port n]\n", argv[0]);
+			return 1;
+		}
+	}
+
 	device_renderer.run();
 
 	return 0;
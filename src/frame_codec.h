@@ -0,0 +1,181 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+
+#include <cstdint>
+#include <cstring>
+#include <lz4.h>
+#include <stdexcept>
+#include <vector>
+#include <zstd.h>
+
+#include "image_codec.h"
+#include "protocol.h"
+
+
+/*
+	Lossless compression of whole frame payloads, after the format (e.g. the
+	tile delta) has been applied. The codec travels in each FrameHeader, so
+	the server can pick one per session and the client just follows along.
+	Everything encodes and decodes into buffers the caller owns; the only
+	state kept here is the compression contexts, so the encode and decode
+	sides each want their own FrameCompressor.
+	The general purpose codecs just see bytes. FRAME_CODEC_QOI is an image
+	codec (image_codec.h), so it also needs the payload's format and grid.
+*/
+struct FrameCompressor
+{
+	FrameCodec codec = FRAME_CODEC_RAW;
+	int zstd_level	 = 1;
+	ZSTD_CCtx *zstd_cctx = nullptr;
+	ZSTD_DCtx *zstd_dctx = nullptr;
+	std::vector<uint8_t> qoi_scratch;
+
+	FrameCompressor()
+	{
+	}
+
+	FrameCompressor(FrameCodec codec, int zstd_level)
+		: codec(codec), zstd_level(zstd_level)
+	{
+		zstd_cctx = ZSTD_createCCtx();
+		zstd_dctx = ZSTD_createDCtx();
+		if(zstd_cctx == nullptr || zstd_dctx == nullptr)
+		{
+			throw std::runtime_error("Could not create zstd contexts");
+		}
+	}
+
+	static bool supported(uint16_t codec)
+	{
+		return codec == FRAME_CODEC_RAW || codec == FRAME_CODEC_LZ4 || codec == FRAME_CODEC_ZSTD || codec == FRAME_CODEC_QOI;
+	}
+
+	static const char *name(uint16_t codec)
+	{
+		switch(codec)
+		{
+			case FRAME_CODEC_RAW:
+				return "raw";
+			case FRAME_CODEC_LZ4:
+				return "lz4";
+			case FRAME_CODEC_ZSTD:
+				return "zstd";
+			case FRAME_CODEC_QOI:
+				return "qoi";
+			default:
+				return "unknown";
+		}
+	}
+
+	// Returns false if there's no codec called name
+	static bool from_name(const char *name, FrameCodec &codec)
+	{
+		for(uint16_t i = FRAME_CODEC_RAW; i <= FRAME_CODEC_QOI; i++)
+		{
+			if(strcmp(name, FrameCompressor::name(i)) == 0)
+			{
+				codec = (FrameCodec) i;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Most bytes encoding num_bytes can take with codec, for sizing buffers
+	static size_t max_encoded_size(uint16_t codec, size_t num_bytes)
+	{
+		switch(codec)
+		{
+			case FRAME_CODEC_LZ4:
+				return LZ4_compressBound(num_bytes);
+			case FRAME_CODEC_ZSTD:
+				return ZSTD_compressBound(num_bytes);
+			case FRAME_CODEC_QOI:
+				return qoi_max_encoded_size(num_bytes);
+			default:
+				return num_bytes;
+		}
+	}
+
+	// in is a payload of format. Returns the encoded size, or 0 if it didn't fit in out_capacity
+	size_t encode(const uint8_t *in, size_t num_bytes, uint16_t format, const TileGrid &grid, uint8_t *out, size_t out_capacity)
+	{
+		switch(codec)
+		{
+			case FRAME_CODEC_LZ4:
+			{
+				return LZ4_compress_default((const char *) in, (char *) out, num_bytes, out_capacity);
+			}
+			case FRAME_CODEC_ZSTD:
+			{
+				size_t size = ZSTD_compressCCtx(zstd_cctx, out, out_capacity, in, num_bytes, zstd_level);
+				return ZSTD_isError(size) ? 0 : size;
+			}
+			case FRAME_CODEC_QOI:
+			{
+				return qoi_encode_payload(in, num_bytes, format, grid, out, out_capacity, qoi_scratch);
+			}
+			default:
+			{
+				if(num_bytes > out_capacity)
+				{
+					return 0;
+				}
+				memcpy(out, in, num_bytes);
+				return num_bytes;
+			}
+		}
+	}
+
+	/*
+		Decodes a payload of format that was encoded with payload_codec (not
+		necessarily this compressor's own). Returns the decoded size, or 0 if
+		the payload is corrupt or wouldn't fit in out_capacity.
+	*/
+	size_t decode(uint16_t payload_codec, const uint8_t *in, size_t num_bytes, uint16_t format, const TileGrid &grid, uint8_t *out, size_t out_capacity)
+	{
+		switch(payload_codec)
+		{
+			case FRAME_CODEC_LZ4:
+			{
+				int size = LZ4_decompress_safe((const char *) in, (char *) out, num_bytes, out_capacity);
+				return size < 0 ? 0 : size;
+			}
+			case FRAME_CODEC_ZSTD:
+			{
+				size_t size = ZSTD_decompressDCtx(zstd_dctx, out, out_capacity, in, num_bytes);
+				return ZSTD_isError(size) ? 0 : size;
+			}
+			case FRAME_CODEC_QOI:
+			{
+				return qoi_decode_payload(in, num_bytes, format, grid, out, out_capacity);
+			}
+			case FRAME_CODEC_RAW:
+			{
+				if(num_bytes > out_capacity)
+				{
+					return 0;
+				}
+				memcpy(out, in, num_bytes);
+				return num_bytes;
+			}
+			default:
+			{
+				return 0;
+			}
+		}
+	}
+
+	void destroy()
+	{
+		ZSTD_freeCCtx(zstd_cctx);
+		ZSTD_freeDCtx(zstd_dctx);
+		zstd_cctx = nullptr;
+		zstd_dctx = nullptr;
+	}
+};
+
+
+#endif
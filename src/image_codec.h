@@ -0,0 +1,422 @@
+#ifndef IMAGE_CODEC_H
+#define IMAGE_CODEC_H
+
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <vector>
+
+#include "protocol.h"
+
+
+/*
+	Lossless RGB8 image codec in the spirit of QOI, for FRAME_CODEC_QOI.
+	Each pixel is predicted from the one above it (or to its left on an
+	image's first row), and the residuals are what gets coded:
+	  - runs of zero residuals, which is what the black background and
+	    anything that's vertically flat turn into
+	  - a 64 entry cache of recently seen residuals
+	  - small residuals in one or two bytes, and anything else in four
+	A payload gets split into independent images (row bands of a full frame,
+	or the tiles of a tiled one, see payload_images()), so they can be coded
+	in any order or in parallel. The payload is encoded as
+	  [bytes before the first image, as-is] [u32 LE encoded size of each image] [each image]
+	The prediction and the zero run search are SIMD, since they touch every byte.
+*/
+#define QOI_OP_INDEX 0x00 // 00xxxxxx: residual is cache[x]
+#define QOI_OP_DIFF 0x40  // 01rrggbb: each residual in -2..1, biased by 2
+#define QOI_OP_LUMA 0x80  // 10gggggg rrrrbbbb: g in -32..31, r - g and b - g in -8..7
+#define QOI_OP_RUN 0xC0	  // 11xxxxxx: x + 1 zero residuals, x < 62
+#define QOI_OP_RGB 0xFE	  // then r, g, b residuals
+#define QOI_MASK 0xC0
+#define QOI_MAX_RUN 62
+
+
+// One image inside a payload: width x height tightly packed RGB8 pixels starting at offset
+struct PayloadImage
+{
+	size_t offset;
+	uint32_t width;
+	uint32_t height;
+};
+
+/*
+	Splits a payload of format into images. Full frames are cut into bands
+	of FRAME_TILE_SIZE rows, tiled frames are one image per tile in the
+	bitmap at the start of the payload. Returns how many bytes come before
+	the first image (the bitmap), which aren't part of any image.
+*/
+size_t payload_images(uint16_t format, const TileGrid &grid, const uint8_t *payload, std::vector<PayloadImage> &images)
+{
+	images.clear();
+
+	if(format == FRAME_FORMAT_RGB8_TILES)
+	{
+		size_t offset = grid.bitmap_size();
+		for(uint32_t tile = 0; tile < grid.num_tiles(); tile++)
+		{
+			if(tile_bit(payload, tile))
+			{
+				uint32_t x, y, w, h;
+				grid.tile_rect(tile, x, y, w, h);
+				images.push_back({offset, w, h});
+				offset += (size_t) w * h * 3;
+			}
+		}
+
+		return grid.bitmap_size();
+	}
+
+	for(uint32_t y = 0; y < grid.height; y += FRAME_TILE_SIZE)
+	{
+		uint32_t h = std::min<uint32_t>(FRAME_TILE_SIZE, grid.height - y);
+		images.push_back({(size_t) y * grid.width * 3, grid.width, h});
+	}
+
+	return 0;
+}
+
+
+/*
+	SIMD pieces. residuals() writes out = in - in[-distance] bytewise for n
+	bytes, unpredict() does out += in[-distance] with out already holding
+	the residuals, and zero_bytes() counts leading zero bytes, up to n.
+*/
+typedef void (*QoiPredictFn)(const uint8_t *in, uint8_t *out, size_t distance, size_t n);
+typedef size_t (*QoiZeroBytesFn)(const uint8_t *in, size_t n);
+
+void qoi_residuals_scalar(const uint8_t *in, uint8_t *out, size_t distance, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+	{
+		out[i] = in[i] - in[i - distance];
+	}
+}
+
+// Also fine for distance < n in place, since out[i - distance] is already reconstructed by then
+void qoi_unpredict_scalar(const uint8_t *in, uint8_t *out, size_t distance, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+	{
+		out[i] += in[i - distance];
+	}
+}
+
+size_t qoi_zero_bytes_scalar(const uint8_t *in, size_t n)
+{
+	size_t i = 0;
+	while(i < n && in[i] == 0)
+	{
+		i++;
+	}
+	return i;
+}
+
+__attribute__((target("avx2"))) void qoi_residuals_avx2(const uint8_t *in, uint8_t *out, size_t distance, size_t n)
+{
+	size_t i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i cur	 = _mm256_loadu_si256((const __m256i *) (in + i));
+		__m256i pred = _mm256_loadu_si256((const __m256i *) (in + i - distance));
+		_mm256_storeu_si256((__m256i *) (out + i), _mm256_sub_epi8(cur, pred));
+	}
+
+	qoi_residuals_scalar(in + i, out + i, distance, n - i);
+}
+
+// Only for rows above, i.e. distance >= 32 or in != out, since each vector needs its predictions finished
+__attribute__((target("avx2"))) void qoi_unpredict_avx2(const uint8_t *in, uint8_t *out, size_t distance, size_t n)
+{
+	size_t i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i res	 = _mm256_loadu_si256((const __m256i *) (out + i));
+		__m256i pred = _mm256_loadu_si256((const __m256i *) (in + i - distance));
+		_mm256_storeu_si256((__m256i *) (out + i), _mm256_add_epi8(res, pred));
+	}
+
+	qoi_unpredict_scalar(in + i, out + i, distance, n - i);
+}
+
+__attribute__((target("avx2,bmi"))) size_t qoi_zero_bytes_avx2(const uint8_t *in, size_t n)
+{
+	size_t i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i bytes  = _mm256_loadu_si256((const __m256i *) (in + i));
+		uint32_t zeros = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_setzero_si256()));
+		if(zeros != 0xFFFFFFFF)
+		{
+			return i + _tzcnt_u32(~zeros);
+		}
+	}
+
+	return i + qoi_zero_bytes_scalar(in + i, n - i);
+}
+
+
+struct QoiKernels
+{
+	QoiPredictFn residuals;
+	QoiPredictFn unpredict;
+	QoiZeroBytesFn zero_bytes;
+};
+
+const QoiKernels &qoi_kernels()
+{
+	static const QoiKernels kernels = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")
+										  ? QoiKernels{qoi_residuals_avx2, qoi_unpredict_avx2, qoi_zero_bytes_avx2}
+										  : QoiKernels{qoi_residuals_scalar, qoi_unpredict_scalar, qoi_zero_bytes_scalar};
+	return kernels;
+}
+
+
+uint32_t qoi_hash(const uint8_t *residual)
+{
+	return (residual[0] * 3 + residual[1] * 5 + residual[2] * 7) % 64;
+}
+
+/*
+	Encodes one width x height image from in into out. residuals needs
+	width * height * 3 bytes of scratch. Returns the encoded size, which is
+	at most 4 bytes per pixel.
+*/
+size_t qoi_encode_image(const uint8_t *in, uint32_t width, uint32_t height, uint8_t *residuals, uint8_t *out)
+{
+	const QoiKernels &kernels = qoi_kernels();
+	size_t row_size			  = (size_t) width * 3;
+	size_t num_bytes		  = row_size * height;
+
+	// First row predicts from the left, the rest from above
+	residuals[0] = in[0];
+	residuals[1] = in[1];
+	residuals[2] = in[2];
+	if(row_size > 3)
+	{
+		kernels.residuals(in + 3, residuals + 3, 3, row_size - 3);
+	}
+	if(height > 1)
+	{
+		kernels.residuals(in + row_size, residuals + row_size, row_size, num_bytes - row_size);
+	}
+
+	uint8_t cache[64][3] = {};
+	uint8_t *op			 = out;
+
+	for(size_t i = 0; i < num_bytes;)
+	{
+		const uint8_t *res = residuals + i;
+
+		size_t run = kernels.zero_bytes(res, num_bytes - i) / 3;
+		if(run > 0)
+		{
+			i += run * 3;
+			for(; run > QOI_MAX_RUN; run -= QOI_MAX_RUN)
+			{
+				*op++ = QOI_OP_RUN | (QOI_MAX_RUN - 1);
+			}
+			*op++ = QOI_OP_RUN | (run - 1);
+			continue;
+		}
+
+		uint32_t hash = qoi_hash(res);
+		if(memcmp(cache[hash], res, 3) == 0)
+		{
+			*op++ = QOI_OP_INDEX | hash;
+			i += 3;
+			continue;
+		}
+		memcpy(cache[hash], res, 3);
+
+		int8_t r	= res[0];
+		int8_t g	= res[1];
+		int8_t b	= res[2];
+		int32_t r_g = r - g;
+		int32_t b_g = b - g;
+
+		if(r >= -2 && r <= 1 && g >= -2 && g <= 1 && b >= -2 && b <= 1)
+		{
+			*op++ = QOI_OP_DIFF | (r + 2) << 4 | (g + 2) << 2 | (b + 2);
+		}
+		else if(g >= -32 && g <= 31 && r_g >= -8 && r_g <= 7 && b_g >= -8 && b_g <= 7)
+		{
+			*op++ = QOI_OP_LUMA | (g + 32);
+			*op++ = (r_g + 8) << 4 | (b_g + 8);
+		}
+		else
+		{
+			*op++ = QOI_OP_RGB;
+			*op++ = res[0];
+			*op++ = res[1];
+			*op++ = res[2];
+		}
+		i += 3;
+	}
+
+	return op - out;
+}
+
+// Decodes one image into out. Returns false if in doesn't hold exactly width x height pixels
+bool qoi_decode_image(const uint8_t *in, size_t in_size, uint32_t width, uint32_t height, uint8_t *out)
+{
+	const QoiKernels &kernels = qoi_kernels();
+	size_t row_size			  = (size_t) width * 3;
+	size_t num_bytes		  = row_size * height;
+	const uint8_t *end		  = in + in_size;
+
+	uint8_t cache[64][3] = {};
+
+	// Residuals first, straight into out
+	size_t i = 0;
+	while(i < num_bytes && in < end)
+	{
+		uint8_t tag = *in++;
+
+		if(tag == QOI_OP_RGB)
+		{
+			if(end - in < 3)
+			{
+				return false;
+			}
+			memcpy(out + i, in, 3);
+			in += 3;
+		}
+		else if((tag & QOI_MASK) == QOI_OP_RUN)
+		{
+			size_t run_bytes = ((tag & 0x3F) + 1) * 3;
+			if(run_bytes > num_bytes - i)
+			{
+				return false;
+			}
+			memset(out + i, 0, run_bytes);
+			i += run_bytes;
+			continue;
+		}
+		else if((tag & QOI_MASK) == QOI_OP_INDEX)
+		{
+			memcpy(out + i, cache[tag & 0x3F], 3);
+			i += 3;
+			continue;
+		}
+		else if((tag & QOI_MASK) == QOI_OP_DIFF)
+		{
+			out[i + 0] = ((tag >> 4) & 3) - 2;
+			out[i + 1] = ((tag >> 2) & 3) - 2;
+			out[i + 2] = (tag & 3) - 2;
+		}
+		else
+		{
+			if(in == end)
+			{
+				return false;
+			}
+			int32_t g  = (tag & 0x3F) - 32;
+			out[i + 0] = g + (*in >> 4) - 8;
+			out[i + 1] = g;
+			out[i + 2] = g + (*in & 0x0F) - 8;
+			in++;
+		}
+
+		memcpy(cache[qoi_hash(out + i)], out + i, 3);
+		i += 3;
+	}
+
+	if(i != num_bytes || in != end)
+	{
+		return false;
+	}
+
+	// Then undo the prediction: the first row from the left, one pixel at a time, the rest a row at a time from above
+	qoi_unpredict_scalar(out + 3, out + 3, 3, row_size - 3);
+	for(uint32_t y = 1; y < height; y++)
+	{
+		kernels.unpredict(out + y * row_size, out + y * row_size, row_size, row_size);
+	}
+
+	return true;
+}
+
+
+// Most bytes qoi_encode_payload can write for a num_bytes payload, size table included
+size_t qoi_max_encoded_size(size_t num_bytes)
+{
+	// 4 bytes per pixel, plus a 4 byte size for images as small as one pixel
+	return num_bytes / 3 * 8 + num_bytes % 3 + 4;
+}
+
+/*
+	Encodes a whole payload of format. scratch gets resized as needed.
+	Returns the encoded size, or 0 if it didn't fit in out_capacity.
+*/
+size_t qoi_encode_payload(const uint8_t *in, size_t num_bytes, uint16_t format, const TileGrid &grid, uint8_t *out, size_t out_capacity, std::vector<uint8_t> &scratch)
+{
+	if(out_capacity < qoi_max_encoded_size(num_bytes))
+	{
+		return 0;
+	}
+
+	std::vector<PayloadImage> images;
+	size_t prefix_size = payload_images(format, grid, in, images);
+	memcpy(out, in, prefix_size);
+
+	uint8_t *sizes = out + prefix_size;
+	uint8_t *data  = sizes + images.size() * 4;
+	for(uint32_t i = 0; i < images.size(); i++)
+	{
+		size_t image_size = (size_t) images[i].width * images[i].height * 3;
+		if(scratch.size() < image_size)
+		{
+			scratch.resize(image_size);
+		}
+
+		size_t encoded_size = qoi_encode_image(in + images[i].offset, images[i].width, images[i].height, scratch.data(), data);
+		write_le(sizes, encoded_size, 4);
+		data += encoded_size;
+	}
+
+	return data - out;
+}
+
+// Returns the decoded size, or 0 if the payload is corrupt or wouldn't fit in out_capacity
+size_t qoi_decode_payload(const uint8_t *in, size_t num_bytes, uint16_t format, const TileGrid &grid, uint8_t *out, size_t out_capacity)
+{
+	size_t prefix_size = format == FRAME_FORMAT_RGB8_TILES ? grid.bitmap_size() : 0;
+	if(num_bytes < prefix_size || out_capacity < prefix_size)
+	{
+		return 0;
+	}
+	memcpy(out, in, prefix_size);
+
+	std::vector<PayloadImage> images;
+	payload_images(format, grid, out, images);
+
+	const uint8_t *sizes = in + prefix_size;
+	const uint8_t *data	 = sizes + images.size() * 4;
+	const uint8_t *end	 = in + num_bytes;
+	if(data > end)
+	{
+		return 0;
+	}
+
+	size_t decoded_size = prefix_size;
+	for(uint32_t i = 0; i < images.size(); i++)
+	{
+		size_t encoded_size = read_le(sizes, 4);
+		size_t image_size	= (size_t) images[i].width * images[i].height * 3;
+		if(encoded_size > (size_t) (end - data) || images[i].offset + image_size > out_capacity ||
+		   !qoi_decode_image(data, encoded_size, images[i].width, images[i].height, out + images[i].offset))
+		{
+			return 0;
+		}
+
+		data += encoded_size;
+		decoded_size = images[i].offset + image_size;
+	}
+
+	return data == end ? decoded_size : 0;
+}
+
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "protocol.h"
+
+
+#define JITTER_MAX_DEPTH 16
+#define JITTER_TRANSIT_WINDOW 120 // frames the smallest transit time is taken over
+
+
+// A frame that's been received and decoded into one of image_buffer's slots
+struct BufferedFrame
+{
+	FrameHeader header;
+	uint32_t slot;
+	size_t frame_size; // decoded colour, any depth comes right after it
+	uint64_t arrived_us;
+	uint64_t due_us; // when the pacer wants it shown
+};
+
+
+/*
+	Client side. Keeps the frames coming off the network apart from the
+	frames being shown, so the display keeps a steady rate however unevenly
+	they arrive. The receive thread decodes each frame into a free slot and
+	pushes it, and every frame the render thread picks the ones due by now.
+
+	A frame is due a playout delay after it would have arrived with the
+	smallest transit time seen lately, which keeps the server's own frame
+	pacing: a frame that took the fast path waits the whole delay, and a
+	slower one less. The delay is the mean plus two standard deviations of
+	how much longer than that frames have been taking, so it covers all but
+	the worst jitter, and never more than depth frames' worth. Transit is
+	arrival minus the server's timestamp, so the clocks don't need to agree,
+	the offset between them is in the smallest transit too.
+
+	depth is also how many frames can be held back at once. 0 shows every
+	frame as soon as it's there. Frames are always picked in order and never
+	skipped, since tiles only make sense on top of the frames before them,
+	so several can be picked at once to catch up.
+*/
+struct JitterBuffer
+{
+	uint32_t depth = 0;
+
+	std::mutex lock;
+	std::condition_variable slot_freed;
+	std::vector<uint32_t> free_slots;
+	std::deque<BufferedFrame> frames; // received and not picked yet, oldest first
+	bool stopping = false;
+
+	int64_t window_min_transit_us = INT64_MAX;
+	int64_t last_min_transit_us	  = INT64_MAX;
+	uint32_t window_frames		  = 0;
+	double delay_mean_us		  = 0; // transit on top of the smallest
+	double delay_variance		  = 0;
+	double frame_interval_us	  = 16667; // between the server's timestamps
+	uint64_t last_server_us		  = 0;
+	std::atomic<uint64_t> playout_delay_us;
+
+	JitterBuffer()
+	{
+		playout_delay_us.store(0);
+	}
+
+	void start(uint32_t buffer_depth, uint32_t slot_count)
+	{
+		depth = std::min<uint32_t>(buffer_depth, JITTER_MAX_DEPTH);
+		for(uint32_t i = 0; i < slot_count; i++)
+		{
+			free_slots.push_back(i);
+		}
+	}
+
+	// Receive thread: waits for a slot to receive into. Returns false once stopping
+	bool acquire_slot(uint32_t &slot)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		slot_freed.wait(guard, [this] { return stopping || !free_slots.empty(); });
+		if(stopping)
+		{
+			return false;
+		}
+
+		slot = free_slots.back();
+		free_slots.pop_back();
+		return true;
+	}
+
+	// A slot with nothing in it any more, from a frame that didn't make it or one the GPU is done with
+	void release_slot(uint32_t slot)
+	{
+		lock.lock();
+		free_slots.push_back(slot);
+		lock.unlock();
+		slot_freed.notify_one();
+	}
+
+	// Receive thread: frame has been decoded into its slot
+	void push(BufferedFrame frame)
+	{
+		lock.lock();
+
+		int64_t transit		  = (int64_t) (frame.arrived_us - frame.header.server_timestamp_us);
+		window_min_transit_us = std::min(window_min_transit_us, transit);
+		if(++window_frames == JITTER_TRANSIT_WINDOW)
+		{
+			last_min_transit_us	  = window_min_transit_us;
+			window_min_transit_us = INT64_MAX;
+			window_frames		  = 0;
+		}
+		int64_t min_transit_us = std::min(std::min(window_min_transit_us, last_min_transit_us), transit);
+
+		double delay = (double) (transit - min_transit_us);
+		delay_mean_us += (delay - delay_mean_us) / 16;
+		delay_variance += ((delay - delay_mean_us) * (delay - delay_mean_us) - delay_variance) / 16;
+
+		if(last_server_us != 0 && frame.header.server_timestamp_us > last_server_us)
+		{
+			frame_interval_us += ((double) (frame.header.server_timestamp_us - last_server_us) - frame_interval_us) / 16;
+		}
+		last_server_us = frame.header.server_timestamp_us;
+
+		// Only moves once it's a quarter of a frame out, so frames don't keep landing either side of a vsync
+		double playout = depth == 0 ? 0 : std::min(delay_mean_us + 2 * std::sqrt(delay_variance), depth * frame_interval_us);
+		if(std::fabs(playout - playout_delay_us.load()) > frame_interval_us / 4)
+		{
+			playout_delay_us.store((uint64_t) playout);
+		}
+
+		frame.due_us = frame.header.server_timestamp_us + min_transit_us + playout_delay_us.load();
+		frames.push_back(frame);
+
+		lock.unlock();
+	}
+
+	/*
+		Render thread: appends the frames to show now to picked, oldest
+		first, and returns how many are still held back. Their slots stay
+		taken until they're released.
+	*/
+	uint32_t pick(uint64_t now_us, std::vector<BufferedFrame> &picked)
+	{
+		lock.lock();
+		while(!frames.empty() && (frames.front().due_us <= now_us || frames.size() > depth))
+		{
+			picked.push_back(frames.front());
+			frames.pop_front();
+		}
+		uint32_t held = frames.size();
+		lock.unlock();
+
+		return held;
+	}
+
+	// Wakes the receive thread up if it's waiting for a slot, so it can finish
+	void stop()
+	{
+		lock.lock();
+		stopping = true;
+		lock.unlock();
+		slot_freed.notify_all();
+	}
+};
+
+
+#endif
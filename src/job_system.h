@@ -0,0 +1,385 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+
+#define JOB_DEQUE_SIZE 1024 // jobs each deque can hold, a power of two
+#define JOB_MAX_DEPENDENTS 16
+#define JOB_SPINS 256 // times an idle worker looks for work before it sleeps
+
+
+/*
+	One piece of work. worker says which thread runs it, 0 to workers - 1
+	for the job system's own, and workers for the thread that started it,
+	so a job can use per thread things like command pools without locks.
+
+	Jobs that depend on others only run once they've all finished, so a
+	frame's work can be put down as a graph up front and left to run.
+	The graph has to be finished before any of it is submitted, and every
+	job in it waited on before it goes away: the job system only ever
+	points at them. Only the job system's threads, and jobs, can submit.
+*/
+struct Job
+{
+	void (*function)(void *data, uint32_t worker);
+	void *data;
+
+	std::atomic<int32_t> unfinished; // dependencies still to finish, and one more until it's submitted
+	std::atomic<bool> done;
+	Job *dependents[JOB_MAX_DEPENDENTS];
+	uint32_t num_dependents;
+
+	Job()
+	{
+		set(nullptr, nullptr);
+	}
+
+	void set(void (*job_function)(void *, uint32_t), void *job_data)
+	{
+		function = job_function;
+		data	 = job_data;
+		unfinished.store(1);
+		done.store(false);
+		num_dependents = 0;
+	}
+
+	// Before either of them is submitted
+	void depends_on(Job &dependency)
+	{
+		if(dependency.num_dependents == JOB_MAX_DEPENDENTS)
+		{
+			throw std::runtime_error("Job has too many dependents");
+		}
+		dependency.dependents[dependency.num_dependents++] = this;
+		unfinished.fetch_add(1);
+	}
+};
+
+
+/*
+	Chase-Lev work stealing deque, with the memory orderings from Lê et al.,
+	"Correct and Efficient Work-Stealing for Weak Memory Models". Only the
+	thread it belongs to pushes and pops, at the bottom, so that's nearly
+	free, and any other thread can steal from the top. Pop and steal only
+	fight over the last job, with a compare and swap on top.
+*/
+struct WorkStealingDeque
+{
+	std::atomic<int64_t> top;
+	std::atomic<int64_t> bottom;
+	std::atomic<Job *> jobs[JOB_DEQUE_SIZE];
+
+	WorkStealingDeque()
+	{
+		top.store(0);
+		bottom.store(0);
+		for(uint32_t i = 0; i < JOB_DEQUE_SIZE; i++)
+		{
+			jobs[i].store(nullptr);
+		}
+	}
+
+	// Owner only. Returns false if it's full
+	bool push(Job *job)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		if(b - t >= JOB_DEQUE_SIZE)
+		{
+			return false;
+		}
+
+		jobs[b & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Owner only, newest first
+	Job *pop()
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		if(t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		Job *job = jobs[b & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+		if(t == b)
+		{
+			// Last one, which a thief might be taking too
+			if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				job = nullptr;
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return job;
+	}
+
+	// Any thread, oldest first
+	Job *steal()
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+		if(t >= b)
+		{
+			return nullptr;
+		}
+
+		Job *job = jobs[t & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+		if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+		return job;
+	}
+};
+
+
+/*
+	Which of the job system's deques belongs to the calling thread, -1 if none
+	does. Behind an inline function so every file including this header shares
+	the one variable.
+*/
+inline int32_t &job_thread_index()
+{
+	thread_local int32_t index = -1;
+	return index;
+}
+
+/*
+	A fixed set of worker threads, each pinned to its own core and each with
+	its own deque. A worker runs its own jobs newest first, which keeps what
+	a job just made ready warm in its cache, and steals the oldest of
+	someone else's when it runs out. The thread that starts the job system
+	gets a deque too, and runs jobs itself while it waits for one, rather
+	than sitting there. Workers with nothing to do spin a little, then
+	sleep until something's pushed.
+*/
+struct JobSystem
+{
+	uint32_t workers = 0;
+	std::vector<pthread_t> threads;
+	std::vector<WorkStealingDeque *> deques; // workers', then the starting thread's
+
+	std::atomic<bool> running;
+	std::atomic<int32_t> queued; // jobs pushed and not taken yet
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+
+	struct WorkerArgs
+	{
+		JobSystem *job_system;
+		uint32_t index;
+	};
+	std::vector<WorkerArgs> worker_args;
+
+	JobSystem()
+	{
+		running.store(false);
+		queued.store(0);
+	}
+
+	// Pins worker i to core i + 1, leaving the first core to the thread calling this
+	void start(uint32_t num_workers)
+	{
+		workers = num_workers;
+		for(uint32_t i = 0; i <= workers; i++)
+		{
+			deques.push_back(new WorkStealingDeque());
+		}
+		job_thread_index() = workers;
+
+		running.store(true);
+		threads.resize(workers);
+		worker_args.resize(workers);
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		for(uint32_t i = 0; i < workers; i++)
+		{
+			worker_args[i] = {this, i};
+			if(pthread_create(&threads[i], nullptr, JobSystem::worker_loop, &worker_args[i]) != 0)
+			{
+				throw std::runtime_error("Could not create worker thread");
+			}
+
+			if(cores > 1)
+			{
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET((i + 1) % cores, &cpus);
+				pthread_setaffinity_np(threads[i], sizeof(cpus), &cpus);
+			}
+		}
+	}
+
+	// A job whose dependencies have all finished, on the calling thread's deque
+	void push(Job *job)
+	{
+		if(job_thread_index() < 0)
+		{
+			throw std::runtime_error("Jobs can only be submitted by the job system's threads");
+		}
+
+		// Not worth waiting for room
+		if(!deques[job_thread_index()]->push(job))
+		{
+			run(job);
+			return;
+		}
+
+		// Counted under the lock, so a worker can't check queued and then go to sleep past this push
+		{
+			std::lock_guard<std::mutex> guard(sleep_lock);
+			queued.fetch_add(1);
+		}
+		wake.notify_one();
+	}
+
+	// Lets the job run once its dependencies are done, which might be right away
+	void submit(Job &job)
+	{
+		if(job.unfinished.fetch_sub(1) == 1)
+		{
+			push(&job);
+		}
+	}
+
+	// Runs other jobs until job is done
+	void wait(Job &job)
+	{
+		while(!job.done.load(std::memory_order_acquire))
+		{
+			Job *next = find_job();
+			if(next != nullptr)
+			{
+				run(next);
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	Job *find_job()
+	{
+		if(job_thread_index() >= 0)
+		{
+			Job *job = deques[job_thread_index()]->pop();
+			if(job != nullptr)
+			{
+				queued.fetch_sub(1);
+				return job;
+			}
+		}
+
+		uint32_t start = job_thread_index() >= 0 ? job_thread_index() + 1 : 0;
+		for(uint32_t i = 0; i < deques.size(); i++)
+		{
+			uint32_t victim = (start + i) % deques.size();
+			if((int32_t) victim == job_thread_index())
+			{
+				continue;
+			}
+
+			Job *job = deques[victim]->steal();
+			if(job != nullptr)
+			{
+				queued.fetch_sub(1);
+				return job;
+			}
+		}
+
+		return nullptr;
+	}
+
+	// Marks the job done last, so once every job in a graph is done nothing touches any of them again
+	void run(Job *job)
+	{
+		job->function(job->data, job_thread_index());
+
+		for(uint32_t i = 0; i < job->num_dependents; i++)
+		{
+			submit(*job->dependents[i]);
+		}
+		job->done.store(true, std::memory_order_release);
+	}
+
+	static void *worker_loop(void *workerargs)
+	{
+		WorkerArgs *args = (WorkerArgs *) workerargs;
+		JobSystem *js	 = args->job_system;
+		job_thread_index() = args->index;
+
+		uint32_t spins = 0;
+		while(js->running.load())
+		{
+			Job *job = js->find_job();
+			if(job != nullptr)
+			{
+				js->run(job);
+				spins = 0;
+				continue;
+			}
+
+			if(++spins < JOB_SPINS)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			// push() and stop() change what this checks under sleep_lock, so neither can slip by unnoticed
+			std::unique_lock<std::mutex> guard(js->sleep_lock);
+			js->wake.wait(guard, [js] { return js->queued.load() > 0 || !js->running.load(); });
+			spins = 0;
+		}
+
+		return nullptr;
+	}
+
+	// Every job has to be done by now
+	void stop()
+	{
+		if(!running.load())
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(sleep_lock);
+			running.store(false);
+		}
+		wake.notify_all();
+		for(uint32_t i = 0; i < workers; i++)
+		{
+			pthread_join(threads[i], nullptr);
+		}
+		for(WorkStealingDeque *deque : deques)
+		{
+			delete deque;
+		}
+		deques.clear();
+		job_thread_index() = -1;
+	}
+};
+
+
+#endif
@@ -0,0 +1,692 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "protocol.h"
+#include "udp_transport.h"
+
+
+/*
+	Sits between rendertest and client on one machine and makes the
+	connection behave like a slower, laggier one, so codecs and pipeline
+	changes can be compared under exactly the same conditions:
+	  ./rendertest --port 1235 &
+	  ./linkproxy --listen-port 1234 --server-port 1235 --bandwidth 100 --latency 5 --jitter 2
+	  ./client
+	Frames going to the client are held to a bandwidth cap, then delayed by
+	the latency plus up to jitter_ms more. UDP packets (--udp) are dropped
+	with the loss probability, or when the link's backlog is over
+	--queue-ms. The TCP stream can't lose bytes, so instead the proxy stops
+	reading from the server when it's backed up, and the server's sends
+	block like they would on a real link. Client messages only get the
+	latency.
+	Conditions can change over time with --trace, a file of lines
+	  seconds bandwidth_mbit latency_ms jitter_ms loss
+	each taking effect that many seconds after the client connects, with
+	the last one holding from then on. A bandwidth of 0 means no cap.
+	Every frame that goes through is logged with its size and timings, and
+	also written to --csv if that's given.
+*/
+struct LinkConditions
+{
+	uint64_t start_us;
+	double bandwidth_mbit;
+	double latency_ms;
+	double jitter_ms;
+	double loss;
+};
+
+std::vector<LinkConditions> load_link_trace(const char *path)
+{
+	std::ifstream file(path);
+	if(!file.is_open())
+	{
+		throw std::runtime_error("Could not open link trace " + std::string(path));
+	}
+
+	std::vector<LinkConditions> trace;
+	std::string line;
+	while(std::getline(file, line))
+	{
+		line = line.substr(0, line.find('#'));
+		if(line.find_first_not_of(" \t\r") == std::string::npos)
+		{
+			continue;
+		}
+
+		double seconds;
+		LinkConditions conditions;
+		std::istringstream fields(line);
+		if(!(fields >> seconds >> conditions.bandwidth_mbit >> conditions.latency_ms >> conditions.jitter_ms >> conditions.loss))
+		{
+			throw std::runtime_error("Bad line in link trace: " + line);
+		}
+		conditions.start_us = seconds * 1000000;
+		trace.push_back(conditions);
+	}
+
+	if(trace.empty())
+	{
+		throw std::runtime_error("Link trace " + std::string(path) + " has no conditions in it");
+	}
+
+	std::stable_sort(trace.begin(), trace.end(), [](const LinkConditions &a, const LinkConditions &b) { return a.start_us < b.start_us; });
+	return trace;
+}
+
+
+// One frame's trip through the proxy
+struct FrameStats
+{
+	uint64_t sequence;
+	uint64_t bytes;
+	uint32_t packets;
+	uint32_t packets_dropped;
+	uint32_t packets_queued; // UDP packets still waiting to go out
+	uint32_t packets_expected;
+	uint64_t first_in_us; // when its first byte reached the proxy
+	uint64_t last_out_us; // when its last byte left it
+};
+
+// Bytes on their way through the link, due to be delivered at deliver_us
+struct DelayedChunk
+{
+	uint64_t deliver_us;
+	std::vector<uint8_t> bytes;
+	size_t sent;
+	bool ends_frame; // the last bytes of stats' frame
+	FrameStats stats;
+};
+
+
+/*
+	Splits the server's TCP stream back into frames, as it goes past, so
+	they can be timed. take() says how many of the bytes belong to the
+	current frame, stopping at its end.
+*/
+struct FrameStreamParser
+{
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	uint32_t header_received = 0;
+	uint64_t remaining		 = 0; // bytes of the frame left after its header
+	FrameStats stats;
+
+	size_t take(const uint8_t *data, size_t num_bytes, uint64_t now_us, bool &frame_done)
+	{
+		size_t used = 0;
+		frame_done	= false;
+
+		if(header_received == 0 && num_bytes > 0)
+		{
+			stats			  = {};
+			stats.first_in_us = now_us;
+		}
+
+		if(header_received < FRAME_HEADER_SIZE)
+		{
+			uint32_t num_header_bytes = std::min<size_t>(FRAME_HEADER_SIZE - header_received, num_bytes);
+			memcpy(header_bytes + header_received, data, num_header_bytes);
+			header_received += num_header_bytes;
+			used += num_header_bytes;
+
+			if(header_received < FRAME_HEADER_SIZE)
+			{
+				return used;
+			}
+
+			FrameHeader header;
+			if(!decode_frame_header(header_bytes, header))
+			{
+				throw std::runtime_error("The server sent something that isn't a frame");
+			}
+			stats.sequence = header.sequence;
+			stats.bytes	   = header.header_size + header.payload_size;
+			remaining	   = stats.bytes - FRAME_HEADER_SIZE;
+		}
+
+		size_t num_frame_bytes = std::min<uint64_t>(remaining, num_bytes - used);
+		remaining -= num_frame_bytes;
+		used += num_frame_bytes;
+
+		if(remaining == 0)
+		{
+			frame_done		= true;
+			header_received = 0;
+		}
+
+		return used;
+	}
+};
+
+
+struct LinkProxy
+{
+	int listen_port			= 1234;
+	int server_port			= 1235;
+	uint64_t queue_limit_us = 100000; // backlog the link holds before it drops packets or pushes back on the server
+	std::vector<LinkConditions> trace;
+
+	int server_fd;
+	int client_fd;
+	bool server_open = true;
+	int udp_fd = -1;
+	sockaddr_in client_udp_address;
+
+	uint64_t start_us;
+	uint64_t link_free_us		 = 0; // when the downlink is done sending everything scheduled so far
+	uint64_t last_tcp_deliver_us = 0;
+	std::mt19937 rng			 = std::mt19937(1234);
+
+	std::deque<DelayedChunk> downlink; // server to client, over TCP
+	std::deque<DelayedChunk> uplink;   // client to server
+	std::multimap<uint64_t, DelayedChunk> udp_packets;
+	size_t downlink_bytes = 0;
+	FrameStreamParser frame_parser;
+	std::map<uint64_t, FrameStats> udp_frames; // by frame id, until every packet has gone out
+	uint8_t client_message_bytes[CLIENT_MESSAGE_SIZE];
+	uint32_t client_message_received = 0;
+
+	FILE *csv			 = nullptr;
+	uint64_t num_frames	 = 0;
+	uint64_t total_bytes = 0;
+
+	void run()
+	{
+		connect_both_ends();
+		start_us = timestamp_us();
+
+		while(step())
+		{
+		}
+
+		printf("%lu frames, %lu bytes went through\n", num_frames, total_bytes);
+	}
+
+	const LinkConditions &conditions(uint64_t now_us)
+	{
+		uint32_t i = 0;
+		while(i + 1 < trace.size() && trace[i + 1].start_us <= now_us - start_us)
+		{
+			i++;
+		}
+
+		return trace[i];
+	}
+
+	// Waits for the client, then connects to the server on its behalf
+	void connect_both_ends()
+	{
+		int listen_fd		= socket(AF_INET, SOCK_STREAM, 0);
+		int reuse			= 1;
+		sockaddr_in address = {
+			.sin_family = AF_INET,
+			.sin_port	= htons(static_cast<in_port_t>(listen_port)),
+		};
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if(listen_fd == -1 || bind(listen_fd, (sockaddr *) &address, sizeof(address)) == -1 || listen(listen_fd, 1) == -1)
+		{
+			throw std::runtime_error("Could not listen for the client");
+		}
+
+		printf("Waiting for a client on port %d\n", listen_port);
+		client_fd = accept(listen_fd, nullptr, nullptr);
+		close(listen_fd);
+
+		server_fd				   = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in server_address = {
+			.sin_family = AF_INET,
+			.sin_port	= htons(static_cast<in_port_t>(server_port)),
+		};
+		server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if(client_fd == -1 || server_fd == -1 || connect(server_fd, (sockaddr *) &server_address, sizeof(server_address)) == -1)
+		{
+			throw std::runtime_error("Could not connect to the server");
+		}
+
+		// Everything here is already timed by hand, Nagle would only add to it
+		int one = 1;
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+		printf("Connected the client to the server on port %d\n", server_port);
+	}
+
+	/*
+		When bytes sent now get to the other end: they wait for the link to
+		be free, take their size over the bandwidth to send, then the
+		latency plus up to jitter_ms. in_order keeps them behind anything
+		delivered before, like TCP would.
+	*/
+	uint64_t schedule(size_t num_bytes, uint64_t now_us, bool in_order)
+	{
+		const LinkConditions &link = conditions(now_us);
+
+		uint64_t depart_us = std::max(now_us, link_free_us);
+		if(link.bandwidth_mbit > 0)
+		{
+			depart_us += num_bytes * 8 / link.bandwidth_mbit;
+		}
+		link_free_us = depart_us;
+
+		std::uniform_real_distribution<double> jitter(0.0, link.jitter_ms * 1000);
+		uint64_t deliver_us = depart_us + link.latency_ms * 1000 + jitter(rng);
+		if(in_order)
+		{
+			deliver_us			= std::max(deliver_us, last_tcp_deliver_us);
+			last_tcp_deliver_us = deliver_us;
+		}
+
+		return deliver_us;
+	}
+
+	// How long anything sent now would wait before the link got to it
+	uint64_t backlog_us(uint64_t now_us)
+	{
+		return link_free_us > now_us ? link_free_us - now_us : 0;
+	}
+
+	// One pass of the event loop. Returns false once either end hangs up
+	bool step()
+	{
+		uint64_t now_us = timestamp_us();
+
+		if(!server_open && downlink.empty() && uplink.empty() && udp_packets.empty())
+		{
+			flush_udp_frames(UINT64_MAX);
+			return false;
+		}
+
+		// Stop taking the server's frames while the link is backed up, so its sends block
+		bool read_server = server_open && backlog_us(now_us) < queue_limit_us && downlink_bytes < 64 * 1024 * 1024;
+
+		pollfd fds[3] = {
+			{server_open ? server_fd : -1, (short) (read_server ? POLLIN : 0), 0},
+			{client_fd, (short) (POLLIN | (downlink_due(now_us) ? POLLOUT : 0)), 0},
+			{udp_fd, POLLIN, 0},
+		};
+
+		// Sleep until something's due, or something arrives
+		uint64_t next_us = UINT64_MAX;
+		if(!downlink.empty() && !downlink_due(now_us))
+		{
+			next_us = std::min(next_us, downlink.front().deliver_us);
+		}
+		if(!uplink.empty())
+		{
+			next_us = std::min(next_us, uplink.front().deliver_us);
+		}
+		if(!udp_packets.empty())
+		{
+			next_us = std::min(next_us, udp_packets.begin()->first);
+		}
+		if(!read_server && next_us == UINT64_MAX)
+		{
+			next_us = now_us + 1000;
+		}
+
+		timespec timeout;
+		timespec *timeout_ptr = nullptr;
+		if(next_us != UINT64_MAX)
+		{
+			uint64_t wait_us = next_us > now_us ? next_us - now_us : 0;
+			timeout			 = {(time_t) (wait_us / 1000000), (long) (wait_us % 1000000) * 1000};
+			timeout_ptr		 = &timeout;
+		}
+
+		if(ppoll(fds, udp_fd == -1 ? 2 : 3, timeout_ptr, nullptr) == -1 && errno != EINTR)
+		{
+			return false;
+		}
+
+		now_us = timestamp_us();
+		if((fds[0].revents & (POLLIN | POLLHUP)) && !read_from_server(now_us))
+		{
+			return false;
+		}
+		if((fds[1].revents & (POLLIN | POLLHUP)) && !read_from_client(now_us))
+		{
+			return false;
+		}
+		if(udp_fd != -1 && (fds[2].revents & POLLIN))
+		{
+			read_udp(now_us);
+		}
+
+		return deliver(timestamp_us());
+	}
+
+	bool downlink_due(uint64_t now_us)
+	{
+		return !downlink.empty() && downlink.front().deliver_us <= now_us;
+	}
+
+	bool read_from_server(uint64_t now_us)
+	{
+		uint8_t data[16 * 1024];
+		ssize_t received = recv(server_fd, data, sizeof(data), MSG_DONTWAIT);
+		if(received == -1 && (errno == EAGAIN || errno == EINTR))
+		{
+			return true;
+		}
+		if(received <= 0)
+		{
+			printf("Server hung up, delivering what's still on the link\n");
+			server_open = false;
+			return true;
+		}
+
+		// Cut at frame ends, so the chunk with a frame's last byte can time it
+		for(size_t used = 0; used < (size_t) received;)
+		{
+			DelayedChunk chunk = {};
+			size_t num_bytes   = frame_parser.take(data + used, received - used, now_us, chunk.ends_frame);
+			chunk.bytes.assign(data + used, data + used + num_bytes);
+			chunk.stats		 = frame_parser.stats;
+			chunk.deliver_us = schedule(num_bytes, now_us, true);
+			downlink_bytes += num_bytes;
+			downlink.push_back(chunk);
+			used += num_bytes;
+		}
+
+		return true;
+	}
+
+	/*
+		Client messages are passed on after the latency. The client's UDP
+		port is swapped for the proxy's own, so frames come here first.
+	*/
+	bool read_from_client(uint64_t now_us)
+	{
+		uint8_t data[4096];
+		ssize_t received = recv(client_fd, data, sizeof(data), MSG_DONTWAIT);
+		if(received == -1 && (errno == EAGAIN || errno == EINTR))
+		{
+			return true;
+		}
+		if(received <= 0)
+		{
+			printf("Client hung up\n");
+			return false;
+		}
+
+		for(ssize_t i = 0; i < received; i++)
+		{
+			client_message_bytes[client_message_received++] = data[i];
+			if(client_message_received < CLIENT_MESSAGE_SIZE)
+			{
+				continue;
+			}
+			client_message_received = 0;
+
+			ClientMessage message;
+			decode_client_message(client_message_bytes, message);
+			if(message.type == CLIENT_MESSAGE_UDP_PORT)
+			{
+				message.value = setup_udp(message.value);
+			}
+
+			DelayedChunk chunk = {};
+			chunk.bytes.resize(CLIENT_MESSAGE_SIZE);
+			encode_client_message(message, chunk.bytes.data());
+			chunk.deliver_us = now_us + conditions(now_us).latency_ms * 1000;
+			uplink.push_back(chunk);
+		}
+
+		return true;
+	}
+
+	// Returns the port the server should send to instead of client_port
+	uint16_t setup_udp(uint16_t client_port)
+	{
+		socklen_t length = sizeof(client_udp_address);
+		getpeername(client_fd, (sockaddr *) &client_udp_address, &length);
+		client_udp_address.sin_port = htons(client_port);
+
+		udp_fd				= socket(AF_INET, SOCK_DGRAM, 0);
+		sockaddr_in address = {
+			.sin_family = AF_INET,
+			.sin_port	= 0,
+		};
+		if(udp_fd == -1 || bind(udp_fd, (sockaddr *) &address, sizeof(address)) == -1)
+		{
+			throw std::runtime_error("Could not bind the proxy's UDP socket");
+		}
+		set_udp_buffer_sizes(udp_fd);
+
+		length = sizeof(address);
+		getsockname(udp_fd, (sockaddr *) &address, &length);
+		uint16_t port = ntohs(address.sin_port);
+		printf("Forwarding UDP frames from port %u to the client's port %u\n", port, client_port);
+		return port;
+	}
+
+	void read_udp(uint64_t now_us)
+	{
+		uint8_t packet[UDP_PACKET_SIZE];
+		ssize_t packet_size;
+		while((packet_size = recv(udp_fd, packet, sizeof(packet), MSG_DONTWAIT)) >= UDP_PACKET_HEADER_SIZE)
+		{
+			UdpPacketHeader header;
+			decode_udp_packet_header(packet, header);
+
+			// Anything older that's all gone out is as done as it's going to get
+			flush_udp_frames(header.frame_id);
+
+			FrameStats &stats = udp_frames[header.frame_id];
+			if(stats.packets == 0)
+			{
+				stats.sequence		   = header.frame_id;
+				stats.bytes			   = header.frame_bytes;
+				stats.first_in_us	   = now_us;
+				stats.packets_expected = header.num_data + udp_num_groups(header.num_data, header.fec_group);
+			}
+			stats.packets++;
+
+			const LinkConditions &link = conditions(now_us);
+			std::bernoulli_distribution lost(link.loss);
+			if(lost(rng) || backlog_us(now_us) > queue_limit_us)
+			{
+				stats.packets_dropped++;
+				continue;
+			}
+
+			DelayedChunk chunk = {};
+			chunk.bytes.assign(packet, packet + packet_size);
+			chunk.deliver_us = schedule(packet_size, now_us, false);
+			chunk.stats		 = stats;
+			stats.packets_queued++;
+			udp_packets.insert(std::make_pair(chunk.deliver_us, chunk));
+		}
+	}
+
+	// Logs UDP frames before frame_id that have nothing left to send
+	void flush_udp_frames(uint64_t frame_id)
+	{
+		for(std::map<uint64_t, FrameStats>::iterator it = udp_frames.begin(); it != udp_frames.end() && it->first < frame_id;)
+		{
+			if(it->second.packets_queued != 0)
+			{
+				it++;
+				continue;
+			}
+
+			log_frame(it->second, "udp");
+			it = udp_frames.erase(it);
+		}
+	}
+
+	// Sends whatever is due. Returns false if an end hung up
+	bool deliver(uint64_t now_us)
+	{
+		while(downlink_due(now_us))
+		{
+			DelayedChunk &chunk = downlink.front();
+			ssize_t sent		= send(client_fd, chunk.bytes.data() + chunk.sent, chunk.bytes.size() - chunk.sent, MSG_NOSIGNAL);
+			if(sent == -1 && (errno == EAGAIN || errno == EINTR))
+			{
+				break;
+			}
+			if(sent <= 0)
+			{
+				return false;
+			}
+
+			chunk.sent += sent;
+			if(chunk.sent < chunk.bytes.size())
+			{
+				break;
+			}
+
+			if(chunk.ends_frame)
+			{
+				chunk.stats.last_out_us = timestamp_us();
+				chunk.stats.packets		= 1;
+				log_frame(chunk.stats, "tcp");
+			}
+			downlink_bytes -= chunk.bytes.size();
+			downlink.pop_front();
+		}
+
+		while(!uplink.empty() && uplink.front().deliver_us <= now_us)
+		{
+			if(!send_all(server_fd, uplink.front().bytes.data(), uplink.front().bytes.size()))
+			{
+				return false;
+			}
+			uplink.pop_front();
+		}
+
+		while(!udp_packets.empty() && udp_packets.begin()->first <= now_us)
+		{
+			DelayedChunk &chunk = udp_packets.begin()->second;
+			sendto(udp_fd, chunk.bytes.data(), chunk.bytes.size(), 0, (sockaddr *) &client_udp_address, sizeof(client_udp_address));
+
+			std::map<uint64_t, FrameStats>::iterator frame = udp_frames.find(chunk.stats.sequence);
+			if(frame != udp_frames.end())
+			{
+				frame->second.packets_queued--;
+				frame->second.last_out_us = timestamp_us();
+				if(frame->second.packets_queued == 0 && frame->second.packets == frame->second.packets_expected)
+				{
+					log_frame(frame->second, "udp");
+					udp_frames.erase(frame);
+				}
+			}
+			udp_packets.erase(udp_packets.begin());
+		}
+
+		return true;
+	}
+
+	void log_frame(const FrameStats &stats, const char *transport)
+	{
+		double through_ms = stats.last_out_us > stats.first_in_us ? (stats.last_out_us - stats.first_in_us) / 1000.0 : 0.0;
+		printf("frame %lu (%s): %lu bytes, %u/%u packets dropped, %.2f ms from first byte in to last byte out\n",
+			   stats.sequence, transport, stats.bytes, stats.packets_dropped, stats.packets, through_ms);
+
+		if(csv != nullptr)
+		{
+			fprintf(csv, "%lu,%s,%lu,%u,%u,%lu,%lu\n", stats.sequence, transport, stats.bytes, stats.packets, stats.packets_dropped,
+					stats.first_in_us - start_us, stats.last_out_us > 0 ? stats.last_out_us - start_us : 0);
+		}
+
+		num_frames++;
+		total_bytes += stats.bytes;
+	}
+};
+
+
+int main(int argc, char **argv)
+{
+	LinkProxy proxy;
+	LinkConditions link	   = {0, 0.0, 0.0, 0.0, 0.0};
+	const char *trace_path = nullptr;
+	const char *csv_path   = nullptr;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--listen-port") == 0 && i + 1 < argc)
+		{
+			proxy.listen_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--server-port") == 0 && i + 1 < argc)
+		{
+			proxy.server_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc)
+		{
+			link.bandwidth_mbit = std::max(0.0, atof(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+		{
+			link.latency_ms = std::max(0.0, atof(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--jitter") == 0 && i + 1 < argc)
+		{
+			link.jitter_ms = std::max(0.0, atof(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--loss") == 0 && i + 1 < argc)
+		{
+			link.loss = std::min(1.0, std::max(0.0, atof(argv[++i])));
+		}
+		else if(strcmp(argv[i], "--queue-ms") == 0 && i + 1 < argc)
+		{
+			proxy.queue_limit_us = std::max(1, atoi(argv[++i])) * 1000;
+		}
+		else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			trace_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+		{
+			csv_path = argv[++i];
+		}
+		else
+		{
+			printf("Unknown argument %s\n", argv[i]);
+			printf("Usage: %s [--listen-port n] [--server-port n] [--bandwidth mbit] [--latency ms] [--jitter ms] [--loss p] [--queue-ms ms] [--trace file] [--csv file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// A trace replaces the fixed conditions
+	proxy.trace = trace_path != nullptr ? load_link_trace(trace_path) : std::vector<LinkConditions>(1, link);
+
+	if(csv_path != nullptr)
+	{
+		proxy.csv = fopen(csv_path, "w");
+		if(proxy.csv == nullptr)
+		{
+			printf("Could not open %s\n", csv_path);
+			return 1;
+		}
+		fprintf(proxy.csv, "sequence,transport,bytes,packets,packets_dropped,first_byte_in_us,last_byte_out_us\n");
+	}
+
+	proxy.run();
+
+	if(proxy.csv != nullptr)
+	{
+		fclose(proxy.csv);
+	}
+
+	return 0;
+}
@@ -2,17 +2,25 @@
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <netinet/in.h>
 //#include <omp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <set>
 #include <stdexcept>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -29,13 +37,23 @@
 
 #include "camera.h"
 #include "defines.h"
+#include "frame_codec.h"
+#include "net_buffers.h"
+#include "pose_channel.h"
+#include "protocol.h"
+#include "rate_control.h"
+#include "spsc_queue.h"
+#include "tile_delta.h"
+#include "udp_transport.h"
 #include "utils.h"
 #include "vertex.h"
 #include "vk_debug_messenger.h"
 #include "vk_device.h"
+#include "vk_frame_packer.h"
 #include "vk_image.h"
 #include "vk_models.h"
 #include "vk_queuefamilies.h"
+#include "vk_readback.h"
 #include "vk_renderpass.h"
 #include "vk_shaders.h"
 #include "vk_swapchain.h"
@@ -45,14 +63,74 @@ std::string MODEL_PATH	 = "../models/laurenscan/Model.obj";
 std::string TEXTURE_PATH = "../models/laurenscan/Model.jpg";
 
 #define PORT 1234
+#define KEYFRAME_REQUEST_INTERVAL_US 500000 // how often a client that fell behind can have everyone sent a keyframe
 
 Camera camera = Camera(glm::vec3(0.0f, 2.0f, 6.0f));
 
 
+/*
+	One connected client. Its socket is non-blocking, so frames queue up
+	here as encode buffer indices and go out as the socket has room.
+*/
+struct ClientConnection
+{
+	int fd;
+	uint32_t id; // for logs
+
+	std::deque<uint32_t> queue;		// frames waiting to go out, oldest first
+	uint32_t sending = UINT32_MAX;	// frame partway out, if any
+	iovec iov[2];					// what's left of it
+	uint64_t send_started_us;
+	bool waiting_for_keyframe	   = true; // missed tiles, so frames that only carry some are no use yet
+	uint64_t keyframe_requested_us = 0;
+
+	bool zerocopy = false;
+	ZerocopyCompletions zerocopy_completions;
+	uint32_t zerocopy_id;	 // last MSG_ZEROCOPY send of the frame partway out
+	bool zerocopy_pending;	 // whether it has had one
+	struct ZerocopySend
+	{
+		uint32_t buffer;
+		uint32_t id; // the buffer can be reused once this completes
+	};
+	std::deque<ZerocopySend> zerocopy_in_flight;
+
+	// Over UDP, frames only go out once the client says which port to send them to
+	bool udp_ready = false;
+	UdpFrameSender udp_sender;
+
+	uint64_t pose_source = 0; // where its poses come from, see PoseReceiver, 0 if it doesn't send any
+
+	// Messages can arrive in pieces, so they get collected here
+	uint8_t message_bytes[CLIENT_MESSAGE_SIZE];
+	uint32_t message_received = 0;
+
+	ClientConnection()
+	{
+		// don't use this
+	}
+
+	ClientConnection(int fd, uint32_t id)
+		: fd(fd), id(id)
+	{
+	}
+};
+
+
+/*
+	Listens for any number of clients, up to max_clients, for as long as the
+	server runs. Everything is non-blocking and driven from one epoll set:
+	the listening socket, every client, and wake_fd, which the encode thread
+	pokes whenever it queues a frame.
+*/
 struct Server
 {
 	int socket_fd;
-	int client_fd;
+	int epoll_fd;
+	int wake_fd;
+	uint32_t max_clients	= 4;
+	uint32_t next_client_id = 0;
+	std::vector<ClientConnection> clients; // in the order they connected
 
 	Server()
 	{
@@ -64,7 +142,7 @@ struct Server
 		}
 	}
 
-	void connect_to_client(int port)
+	void listen_for_clients(int port)
 	{
 
 		// define the address struct to be for TCP using this port
@@ -80,25 +158,143 @@ struct Server
 			throw std::runtime_error("Bind to socket failed");
 		}
 
-		// Listen for a client to connect
-		listen(socket_fd, 1);
-		// Accept a connection from a client
-		client_fd = accept(socket_fd, nullptr, nullptr);
+		listen(socket_fd, SOMAXCONN);
+		fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+
+		epoll_fd = epoll_create1(0);
+		wake_fd	 = eventfd(0, EFD_NONBLOCK);
+		if(epoll_fd == -1 || wake_fd == -1)
+		{
+			throw std::runtime_error("Could not set up epoll");
+		}
+		watch(socket_fd, EPOLLIN);
+		watch(wake_fd, EPOLLIN);
+	}
+
+	void watch(int fd, uint32_t events)
+	{
+		epoll_event event = {};
+		event.events	  = events;
+		event.data.fd	  = fd;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+		{
+			throw std::runtime_error("Could not add socket to epoll");
+		}
+	}
+
+	// Blocks until at least one client is waiting to be accepted
+	void wait_for_connection()
+	{
+		pollfd listener = {
+			.fd		= socket_fd,
+			.events = POLLIN,
+		};
+		poll(&listener, 1, -1);
+	}
+
+	// Returns the newly connected client, or nullptr once there are no more waiting
+	ClientConnection *accept_client()
+	{
+		while(true)
+		{
+			int fd = accept4(socket_fd, nullptr, nullptr, SOCK_NONBLOCK);
+			if(fd == -1)
+			{
+				return nullptr;
+			}
+
+			if(clients.size() >= max_clients)
+			{
+				printf("Already serving %u clients, turning another one away\n", max_clients);
+				close(fd);
+				continue;
+			}
+
+			// Edge triggered, so each client is only woken for when it has something new
+			watch(fd, EPOLLIN | EPOLLOUT | EPOLLET);
+			clients.push_back(ClientConnection(fd, next_client_id++));
+			return &clients.back();
+		}
+	}
+
+	// Returns the index of the client on fd, or -1
+	int find_client(int fd)
+	{
+		for(uint32_t i = 0; i < clients.size(); i++)
+		{
+			if(clients[i].fd == fd)
+			{
+				return i;
+			}
+		}
+
+		return -1;
+	}
+
+	void wake()
+	{
+		uint64_t one = 1;
+		write(wake_fd, &one, sizeof(one));
+	}
+
+	void destroy()
+	{
+		for(uint32_t i = 0; i < clients.size(); i++)
+		{
+			close(clients[i].fd);
+			clients[i].udp_sender.destroy();
+		}
+		clients.clear();
+
+		close(wake_fd);
+		close(epoll_fd);
+		close(socket_fd);
 	}
 };
 
 
 
+/*
+	One frame's worth of encoded output, owned by exactly one of the encode
+	thread, the send queue or the send thread at a time. The send thread
+	shares it between every client it goes to, and only hands it back once
+	the last of them is done with it.
+*/
+struct EncodeBuffer
+{
+	FrameHeader header; // payload_size is how much of data this frame actually uses
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	uint8_t *data; // pinned, so it can be sent straight from here
+	size_t capacity;
+	bool keyframe;					  // whether this frame doesn't build on any before it
+	uint32_t references;			  // clients still sending it, send thread only
+	std::vector<uint8_t> tile_bitmap; // tiles in this frame, kept uncompressed in case it gets dropped
+};
+
+// An ack the send thread got from the client the rate controller follows
+struct ReceivedAck
+{
+	uint64_t sequence;
+	uint64_t receive_us;
+	uint64_t arrived_us;
+};
+
+
 struct HostRenderer
 {
 	void run()
 	{
-		initWindow();
+		if(!headless)
+		{
+			initWindow();
+		}
 		init_vulkan();
 		game_loop();
 		cleanup();
 	}
 
+	// Headless renders into offscreen images, with no window, surface or present
+	bool headless = false;
 	GLFWwindow *window;
 
 	VkInstance instance;
@@ -137,7 +333,118 @@ struct HostRenderer
 	uint32_t current_frame = 0;
 	uint64_t numframes	   = 0;
 
+	ReadbackRing readback_ring;
+	/*
+		Render -> encode -> send pipeline.
+		readback_queue carries readback slots from the render thread to the encode thread,
+		send_queue carries encoded buffers to the send thread, and free_queue brings them back.
+		send_queue holds pipeline_depth frames, and drops the oldest when the network falls behind.
+	*/
+	uint32_t pipeline_depth = 2;
+	std::vector<EncodeBuffer> encode_buffers;
+	SpscQueue<uint32_t> readback_queue;
+	SpscQueue<uint32_t> send_queue;
+	SpscQueue<uint32_t> free_queue;
+	uint32_t spare_buffer = UINT32_MAX; // a dropped buffer the encode thread can reuse straight away
+	Wakeup encode_wakeup; // signalled on every push to readback_queue or free_queue, and on stopping
+
+	// Only send the tiles that changed since the last frame, rather than every frame in full
+	bool delta = true;
+	TileDeltaEncoder tile_encoder;
+
+	/*
+		Frames are packed into their transport format by a compute pass, so
+		the readback is only the bytes that get sent. Packing RGB falls back
+		to a plain RGBA copy, converted on the CPU, if the swapchain images
+		can't be sampled. YCoCg 4:2:0 is never delta'd.
+	*/
+	bool gpu_pack	= true;
+	bool ycocg		= false;
+	bool rgb_packed = false; // whether readback slots hold packed RGB right now
+	bool readback_bgra = false; // whether RGBA readback slots are really BGRA
+	GpuFramePacker frame_packer;
+
+	// Compression on top of that. Compressed frames are encoded into encode_scratch first
+	FrameCodec codec = FRAME_CODEC_RAW;
+	int zstd_level	 = 1;
+	FrameCompressor compressor;
+	std::vector<uint8_t> encode_scratch;
+
+	/*
+		Render the fovea plus rings of half and quarter resolution around it,
+		side by side in one atlas frame (see foveated_layer() in protocol.h).
+		frame_extent is the size of what gets rendered and sent either way.
+	*/
+	bool foveated			= false;
+	VkExtent2D frame_extent = {SERVERWIDTH, SERVERHEIGHT};
+
+	/*
+		Send each frame's depth, as 16 bits per pixel, on the end of its
+		payload. The depth buffer is D16_UNORM so it can be copied out as
+		it is. The client uses it, with the camera in the frame's header,
+		to reproject the frame to wherever its camera has got to since.
+	*/
+	bool send_depth = false;
+
+	// Send straight out of the encode buffers with MSG_ZEROCOPY, instead of having the kernel copy them
+	bool zerocopy = false;
+
+	/*
+		Send frames over UDP (see udp_transport.h) with a parity packet every
+		fec_group packets, instead of over the TCP connection. TCP stays up
+		for the client's messages. loss_rate drops that fraction of packets
+		on purpose, for testing.
+	*/
+	bool udp			= false;
+	uint32_t fec_group	= 8;
+	double loss_rate	= 0.0;
+
+	/*
+		Pick the codec, chroma mode and frame rate as the link allows, to keep
+		frames from queueing up for longer than delay_budget_ms (see
+		rate_control.h). The encode thread decides, and the render thread
+		switches chroma modes and paces frames as it's told.
+	*/
+	bool rate_control		 = false;
+	uint64_t delay_budget_ms = 50;
+	RateController rate_controller;
+	std::atomic<bool> want_ycocg;
+	std::atomic<uint32_t> frame_interval_us; // 0 for no cap
+	uint64_t last_frame_us = 0;
+
+	/*
+		Every client gets the same frames: each one is encoded once, and its
+		buffer is queued for every client and sent from there. A client that
+		falls more than pipeline_depth frames behind loses its oldest ones
+		rather than holding the others back. The send thread owns the
+		clients, and hands keyframe requests and the acks of whichever client
+		has been connected longest (the one rate control follows) over to the
+		encode thread.
+	*/
+	std::atomic<bool> keyframe_requested;
+	std::mutex ack_lock;
+	std::vector<ReceivedAck> acks;
+
+	/*
+		The camera follows the poses of the same client rate control does.
+		They arrive over UDP on pose_port (port + 1 unless it's set), and the
+		render thread takes the newest one right before it submits a frame,
+		so the receiver thread is never in the way of rendering.
+	*/
+	PoseReceiver pose_receiver;
+
+	// Print per frame timings (--frame-stats). Off by default, they're a printf per frame on the render thread
+	bool frame_stats = false;
+	int pose_port = 0;
+
+	pthread_t encode_thread;
+	pthread_t send_thread;
+	std::atomic<bool> encode_running;
+	std::atomic<bool> send_running;
+	std::atomic<bool> client_connected; // false once the last client has gone
+
 	Server server;
+	int port = PORT;
 
 	void initWindow()
 	{
@@ -146,7 +453,7 @@ struct HostRenderer
 		glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 		glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
-		window = glfwCreateWindow(SERVERWIDTH, SERVERHEIGHT, "Vulkan", nullptr, nullptr);
+		window = glfwCreateWindow(frame_extent.width, frame_extent.height, "Vulkan", nullptr, nullptr);
 	}
 
 	void init_vulkan()
@@ -154,10 +461,18 @@ struct HostRenderer
 		setup_instance();
 		setupDebugMessenger(instance, &debug_messenger);
 		setup_surface();
-		device									  = VulkanDevice(instance, surface);
-		SwapChainSupportDetails swapchain_support = query_swapchain_support(device.physical_device, surface);
-		swapchain								  = VulkanSwapchain(swapchain_support, surface, device, window);
-		renderpass								  = VulkanRenderpass(device, swapchain);
+		device = VulkanDevice(instance, surface);
+		if(headless)
+		{
+			// One image per frame in flight, since nothing hands them out like vkAcquireNextImageKHR would
+			swapchain = VulkanSwapchain(device, frame_extent, MAX_FRAMES_IN_FLIGHT);
+		}
+		else
+		{
+			SwapChainSupportDetails swapchain_support = query_swapchain_support(device.physical_device, surface);
+			swapchain								  = VulkanSwapchain(swapchain_support, surface, device, window);
+		}
+		renderpass = VulkanRenderpass(device, swapchain, send_depth);
 		setup_descriptor_set_layout();
 		setup_graphics_pipeline();
 		setup_command_pool();
@@ -172,21 +487,41 @@ struct HostRenderer
 		initialize_ubos();
 		setup_descriptor_pool();
 		setup_descriptor_sets();
+		if(rate_control)
+		{
+			setup_rate_control();
+		}
+		setup_readback();
 		setup_command_buffers();
 		setup_vk_async();
+		encode_wakeup.create();
 
-		server = Server();
-		server.connect_to_client(PORT);
+		server.listen_for_clients(port);
+		pose_receiver.start(pose_port != 0 ? pose_port : port + 1);
+		keyframe_requested.store(false);
+		while(server.clients.empty())
+		{
+			server.wait_for_connection();
+			accept_clients();
+		}
+		client_connected.store(true);
+		setup_encode_buffers();
+		start_pipeline_threads();
 	}
 
 	void game_loop()
 	{
-		while(!glfwWindowShouldClose(window))
+		// Headless servers have no window to close, they just run until the client goes away
+		while(client_connected.load() && (headless || !glfwWindowShouldClose(window)))
 		{
-			glfwPollEvents();
+			if(!headless)
+			{
+				glfwPollEvents();
+			}
 			render_complete_frame();
 		}
 
+		stop_pipeline_threads();
 		vkDeviceWaitIdle(device.logical_device);
 	}
 
@@ -211,6 +546,11 @@ struct HostRenderer
 			vkDestroyFence(device.logical_device, in_flight_fences[i], nullptr);
 		}
 
+		destroy_readback();
+		destroy_encode_buffers();
+		encode_wakeup.destroy();
+		server.destroy();
+		pose_receiver.stop();
 		vkDestroyCommandPool(device.logical_device, command_pool, nullptr);
 
 		device.destroy();
@@ -220,13 +560,17 @@ struct HostRenderer
 			DestroyDebugUtilsMessengerEXT(instance, debug_messenger, nullptr);
 		}
 
-		vkDestroySurfaceKHR(instance, surface, nullptr);
+		if(!headless)
+		{
+			vkDestroySurfaceKHR(instance, surface, nullptr);
+		}
 		vkDestroyInstance(instance, nullptr);
 
-
-		glfwDestroyWindow(window);
-
-		glfwTerminate();
+		if(!headless)
+		{
+			glfwDestroyWindow(window);
+			glfwTerminate();
+		}
 	}
 
 	void cleanup_swapchain()
@@ -254,7 +598,7 @@ struct HostRenderer
 			vkDestroyImageView(device.logical_device, swapchain.image_views[i], nullptr);
 		}
 
-		vkDestroySwapchainKHR(device.logical_device, swapchain.swapchain, nullptr);
+		swapchain.destroy(device.logical_device);
 	}
 
 	void setup_instance()
@@ -269,7 +613,7 @@ struct HostRenderer
 
 		VkDebugUtilsMessengerCreateInfoEXT debug_setup_info;
 		populateDebugMessengerCreateInfo(debug_setup_info);
-		std::vector<const char *> extensions = find_required_extensions();
+		std::vector<const char *> extensions = find_required_extensions(headless);
 
 		VkInstanceCreateInfo instance_ci	= vki::instanceCreateInfo();
 		instance_ci.pApplicationInfo		= &app_info;
@@ -289,6 +633,12 @@ struct HostRenderer
 
 	void setup_surface()
 	{
+		if(headless)
+		{
+			surface = VK_NULL_HANDLE;
+			return;
+		}
+
 		if(glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS)
 		{
 			throw std::runtime_error("failed to create window surface!");
@@ -296,13 +646,193 @@ struct HostRenderer
 	}
 
 
-	void update_camera_data()
+	// Starts at the top of the ladder. YCoCg needs images it can sample, and a frame size it can pack
+	void setup_rate_control()
+	{
+		bool allow_ycocg = swapchain.sampleable() && frame_extent.width % 8 == 0 && frame_extent.height % 2 == 0;
+		rate_controller	 = RateController(delay_budget_ms * 1000, allow_ycocg);
+		ycocg			 = rate_controller.current().ycocg;
+		codec			 = rate_controller.current().codec;
+		want_ycocg.store(ycocg);
+		frame_interval_us.store(0);
+	}
+
+	/*
+		Encode thread only. Moves the rate controller on and applies its
+		codec and frame rate straight away. A chroma mode change needs new
+		readback slots, so the render thread does that between frames, and
+		until then a YCoCg frame can't be QOI coded.
+	*/
+	bool update_rate_control()
+	{
+		bool changed				 = rate_controller.update(timestamp_us());
+		const QualityLevel &quality = rate_controller.current();
+
+		codec = quality.codec;
+		if(ycocg && codec == FRAME_CODEC_QOI)
+		{
+			codec = FRAME_CODEC_ZSTD;
+		}
+		compressor.codec	  = codec;
+		compressor.zstd_level = quality.zstd_level;
+
+		want_ycocg.store(quality.ycocg);
+		frame_interval_us.store(quality.max_fps == 0 ? 0 : 1000000 / quality.max_fps);
+		return changed;
+	}
+
+	// Render thread only. Holds frames back to the rate controller's frame rate, and switches chroma modes when it says to
+	void apply_rate_control()
+	{
+		uint64_t interval_us = frame_interval_us.load();
+		uint64_t now_us		 = timestamp_us();
+		if(interval_us != 0 && now_us < last_frame_us + interval_us)
+		{
+			usleep(last_frame_us + interval_us - now_us);
+		}
+		last_frame_us = timestamp_us();
+
+		if(want_ycocg.load() != ycocg)
+		{
+			set_chroma_mode(want_ycocg.load());
+		}
+	}
+
+	// Same as a swapchain recreation, minus the swapchain
+	void set_chroma_mode(bool use_ycocg)
+	{
+		stop_pipeline_threads();
+		vkDeviceWaitIdle(device.logical_device);
+		destroy_readback();
+		vkFreeCommandBuffers(device.logical_device, command_pool, command_buffers.size(), command_buffers.data());
+
+		ycocg = use_ycocg;
+		setup_readback();
+		setup_command_buffers();
+
+		// The client's server image still holds YCoCg planes, so every tile has to go out again
+		if(!ycocg)
+		{
+			tile_encoder.force_keyframe();
+		}
+		start_pipeline_threads();
+	}
+
+
+	/*
+		Encode thread only. Picks up what the send thread heard from clients:
+		a lost frame means its tiles never made it, and a client that just
+		connected or fell behind has none, so either way the next frame has
+		to carry all of them.
+	*/
+	void handle_client_requests()
+	{
+		if(keyframe_requested.exchange(false))
+		{
+			tile_encoder.force_keyframe();
+		}
+
+		if(rate_control)
+		{
+			std::vector<ReceivedAck> received;
+			ack_lock.lock();
+			received.swap(acks);
+			ack_lock.unlock();
+
+			for(const ReceivedAck &ack : received)
+			{
+				rate_controller.frame_acked(ack.sequence, ack.receive_us, ack.arrived_us);
+			}
+		}
+	}
+
+	// Send thread only, apart from the first client, which is accepted before it starts
+	void accept_clients()
+	{
+		ClientConnection *client;
+		while((client = server.accept_client()) != nullptr)
+		{
+			client->zerocopy = zerocopy && client->zerocopy_completions.enable(client->fd);
+			if(zerocopy && !client->zerocopy)
+			{
+				printf("SO_ZEROCOPY isn't supported, sending to client %u with copies\n", client->id);
+			}
+
+			keyframe_requested.store(true);
+			printf("client %u connected, serving %zu clients\n", client->id, server.clients.size());
+		}
+	}
+
+	/*
+		Send thread only. Handles whatever the client has sent, without
+		blocking. Returns false once it has hung up, which over UDP is the
+		only sure sign it's gone.
+	*/
+	bool read_client_messages(ClientConnection &client, bool rate_client)
 	{
-		float camera_data[6];
-		int client_read = read(server.client_fd, camera_data, 6 * sizeof(float));
+		while(true)
+		{
+			ssize_t received = recv(client.fd, client.message_bytes + client.message_received, CLIENT_MESSAGE_SIZE - client.message_received, MSG_DONTWAIT);
+			if(received == 0)
+			{
+				return false;
+			}
+			if(received == -1)
+			{
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+
+			client.message_received += received;
+			if(client.message_received < CLIENT_MESSAGE_SIZE)
+			{
+				continue;
+			}
+			client.message_received = 0;
 
-		camera.position = glm::vec3(camera_data[0], camera_data[1], camera_data[2]);
-		camera.front	= glm::vec3(camera_data[3], camera_data[4], camera_data[5]);
+			ClientMessage message;
+			decode_client_message(client.message_bytes, message);
+			if(message.type == CLIENT_MESSAGE_UDP_PORT && udp)
+			{
+				// Frames go to that port, on the address it connected from
+				sockaddr_in address;
+				socklen_t length = sizeof(address);
+				getpeername(client.fd, (sockaddr *) &address, &length);
+				address.sin_port = htons(message.value);
+
+				// A client can change ports, so don't leak the socket to the old one
+				client.udp_sender.destroy();
+				client.udp_sender			= UdpFrameSender(address, fec_group, loss_rate);
+				client.udp_ready			= true;
+				client.waiting_for_keyframe = true;
+				keyframe_requested.store(true);
+				printf("Sending frames to client %u over UDP port %lu, parity every %u packets\n", client.id, message.value, fec_group);
+			}
+			else if(message.type == CLIENT_MESSAGE_POSE_PORT)
+			{
+				sockaddr_in address;
+				socklen_t length = sizeof(address);
+				getpeername(client.fd, (sockaddr *) &address, &length);
+				address.sin_port   = htons(message.value);
+				client.pose_source = PoseReceiver::source_of(address);
+			}
+			else if(message.type == CLIENT_MESSAGE_KEYFRAME)
+			{
+				// Throttled like any other keyframe request, or one lossy client could have every client sent a keyframe every frame
+				printf("client %u lost frame %lu, asking for a keyframe\n", client.id, message.sequence);
+				request_keyframe(client);
+			}
+			else if(message.type == CLIENT_MESSAGE_ACK && rate_control && rate_client)
+			{
+				ReceivedAck ack = {
+					.sequence	= message.sequence,
+					.receive_us = message.value,
+					.arrived_us = timestamp_us(),
+				};
+				ack_lock.lock();
+				acks.push_back(ack);
+				ack_lock.unlock();
+			}
+		}
 	}
 
 
@@ -373,11 +903,11 @@ struct HostRenderer
 
 	void setup_depth()
 	{
-		std::vector<VkFormat> formats = {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT};
-		VkFormat depth_format		  = device.find_format(formats, VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
-		VkExtent3D extent			  = {swapchain.swapchain_extent.width, swapchain.swapchain_extent.height, 1};
+		VkFormat depth_format	= find_depth_format(device, send_depth);
+		VkExtent3D extent		= {swapchain.swapchain_extent.width, swapchain.swapchain_extent.height, 1};
+		VkImageUsageFlags usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (send_depth ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : 0);
 
-		create_image(device, 0, VK_IMAGE_TYPE_2D, depth_format, extent, 1, 1, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_SHARING_MODE_EXCLUSIVE, VK_IMAGE_LAYOUT_UNDEFINED, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_attachment.image, depth_attachment.memory);
+		create_image(device, 0, VK_IMAGE_TYPE_2D, depth_format, extent, 1, 1, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL, usage, VK_SHARING_MODE_EXCLUSIVE, VK_IMAGE_LAYOUT_UNDEFINED, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_attachment.image, depth_attachment.memory);
 		depth_attachment.image_view = create_image_view(device.logical_device, depth_attachment.image, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT);
 	}
 
@@ -481,17 +1011,46 @@ struct HostRenderer
 	}
 
 
-	// Provide a new transformation every frame
-	void update_ubos(uint32_t current_image_index)
+	/*
+		Provide a new transformation every frame, seen from the newest client
+		pose if there is one. Like the client's own camera, it looks at the
+		origin from the pose's position. The pose's id (0 for none) and the
+		camera go in readback, to be sent along with the frame.
+	*/
+	void update_ubos(uint32_t current_image_index, ReadbackSlot &readback)
 	{
 		static std::chrono::_V2::system_clock::time_point start_time = std::chrono::high_resolution_clock::now();
 		std::chrono::_V2::system_clock::time_point current_time		 = std::chrono::high_resolution_clock::now();
 		float dt													 = std::chrono::duration<float, std::chrono::seconds::period>(current_time - start_time).count();
 
+		// The projection is the fovea's, the rings get theirs from it in record_layers()
+		VkExtent2D fovea_extent = swapchain.swapchain_extent;
+		if(foveated)
+		{
+			fovea_extent = {SERVERWIDTH, SERVERHEIGHT};
+		}
+
+		glm::vec3 eye = glm::vec3(2.0f, 2.0f, 8.0f);
+		Pose pose;
+		if(pose_receiver.mailbox.read(pose))
+		{
+			camera.position = glm::vec3(pose.position[0], pose.position[1], pose.position[2]);
+			camera.front	= glm::vec3(pose.front[0], pose.front[1], pose.front[2]);
+			eye				= camera.position;
+			if(frame_stats)
+			{
+				printf("pose %lu, %.2f ms since it arrived\n", pose.pose_id, (timestamp_us() - pose.received_us) / 1000.0);
+			}
+		}
+		else
+		{
+			pose.pose_id = 0;
+		}
+
 		UBO ubo = {
 			.model		= glm::rotate(glm::mat4(1.0f), dt * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f)),
-			.view		= glm::lookAt(glm::vec3(2.0f, 2.0f, 8.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
-			.projection = glm::perspective(glm::radians((float) CLIENTFOV * ((float) SERVERWIDTH / (float) CLIENTWIDTH)), swapchain.swapchain_extent.width / (float) swapchain.swapchain_extent.height, 0.1f, 10.0f),
+			.view		= glm::lookAt(eye, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+			.projection = glm::perspective(glm::radians((float) CLIENTFOV * ((float) SERVERWIDTH / (float) CLIENTWIDTH)), fovea_extent.width / (float) fovea_extent.height, 0.1f, 10.0f),
 		};
 		ubo.projection[1][1] *= -1; // flip y coordinate from opengl
 
@@ -501,6 +1060,10 @@ struct HostRenderer
 		vkMapMemory(device.logical_device, ubos_mem[current_image_index], 0, sizeof(ubo), 0, &data);
 		memcpy(data, &ubo, sizeof(ubo));
 		vkUnmapMemory(device.logical_device, ubos_mem[current_image_index]);
+
+		readback.pose_id	= pose.pose_id;
+		readback.view		= ubo.view;
+		readback.projection = ubo.projection;
 	}
 
 
@@ -524,9 +1087,10 @@ struct HostRenderer
 		VkPipelineVertexInputStateCreateInfo vertex_input_info = vki::pipelineVertexInputStateCreateInfo(1, &binding_desc, attribute_desc.size(), attribute_desc.data());
 		VkPipelineInputAssemblyStateCreateInfo input_assembly  = vki::pipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_FALSE);
 
-		VkViewport viewport								 = vki::viewport(0.0f, 0.0f, (float) swapchain.swapchain_extent.width, (float) swapchain.swapchain_extent.height, 0.0f, 1.0f);
-		VkRect2D scissor								 = vki::rect2D({0, 0}, swapchain.swapchain_extent);
-		VkPipelineViewportStateCreateInfo viewport_state = vki::pipelineViewportStateCreateInfo(1, &viewport, 1, &scissor);
+		// Set per layer when recording, see record_layers()
+		VkPipelineViewportStateCreateInfo viewport_state = vki::pipelineViewportStateCreateInfo(1, nullptr, 1, nullptr);
+		VkDynamicState dynamic_states[]					 = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+		VkPipelineDynamicStateCreateInfo dynamic_state	 = vki::pipelineDynamicStateCreateInfo(dynamic_states, 2);
 
 		VkPipelineRasterizationStateCreateInfo rasterizer			= vki::pipelineRasterizationStateCreateInfo(VK_POLYGON_MODE_FILL, VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE);
 		VkPipelineMultisampleStateCreateInfo multisampling			= vki::pipelineMultisampleStateCreateInfo(VK_FALSE, VK_SAMPLE_COUNT_1_BIT);
@@ -535,7 +1099,12 @@ struct HostRenderer
 		VkPipelineDepthStencilStateCreateInfo depth_stencil			= vki::pipelineDepthStencilStateCreateInfo(VK_TRUE, VK_TRUE, VK_COMPARE_OP_LESS, VK_FALSE, VK_FALSE, {}, {}, 0.0f, 1.0f);
 
 
-		VkPipelineLayoutCreateInfo pipeline_layout_info = vki::pipelineLayoutCreateInfo(1, &descriptor_set_layout, 0, nullptr);
+		VkPushConstantRange push_constant_range = {
+			.stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+			.offset		= 0,
+			.size		= sizeof(LayerPushConstants),
+		};
+		VkPipelineLayoutCreateInfo pipeline_layout_info = vki::pipelineLayoutCreateInfo(1, &descriptor_set_layout, 1, &push_constant_range);
 
 		if(vkCreatePipelineLayout(device.logical_device, &pipeline_layout_info, nullptr, &pipeline_layout) != VK_SUCCESS)
 		{
@@ -552,6 +1121,7 @@ struct HostRenderer
 		pipeline_ci.pMultisampleState			 = &multisampling;
 		pipeline_ci.pColorBlendState			 = &colour_blending;
 		pipeline_ci.pDepthStencilState			 = &depth_stencil;
+		pipeline_ci.pDynamicState				 = &dynamic_state;
 		pipeline_ci.layout						 = pipeline_layout;
 		pipeline_ci.renderPass					 = renderpass.renderpass;
 		pipeline_ci.subpass						 = 0;
@@ -631,10 +1201,24 @@ struct HostRenderer
 
 			vkCmdBindDescriptorSets(command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &descriptor_sets[i], 0, nullptr);
 
-			vkCmdDrawIndexed(command_buffers[i], model.indices.size(), 1, 0, 0, 0);
+			record_layers(command_buffers[i]);
 
 			vkCmdEndRenderPass(command_buffers[i]);
 
+			// Read the frame back in the same submission, instead of a separate blocking one after present
+			if(ycocg || rgb_packed)
+			{
+				frame_packer.record(device, command_pool, command_buffers[i], i, swapchain.images[i], swapchain.final_layout(), swapchain.swapchain_extent, readback_ring);
+			}
+			else
+			{
+				readback_ring.record_copy(device, command_pool, command_buffers[i], i, swapchain.images[i], swapchain.final_layout(), swapchain.swapchain_extent);
+			}
+			if(send_depth)
+			{
+				readback_ring.record_depth_copy(command_buffers[i], i, depth_attachment.image, swapchain.swapchain_extent);
+			}
+
 			if(vkEndCommandBuffer(command_buffers[i]) != VK_SUCCESS)
 			{
 				throw std::runtime_error("failed to record command buffer!");
@@ -667,28 +1251,31 @@ struct HostRenderer
 
 	void render_complete_frame()
 	{
+		if(rate_control)
+		{
+			apply_rate_control();
+		}
+
 		timeval timer_start;
 		timeval timer_end;
 		gettimeofday(&timer_start, nullptr);
 
-		// Read from server
-		//update_camera_data();
-
-
 		vkWaitForFences(device.logical_device, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX);
 
 
-		uint32_t image_index;
-		VkResult result = vkAcquireNextImageKHR(device.logical_device, swapchain.swapchain, UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
-
-		// Check that the swapchain is incompatible with the surface (window resizing)
-		if(result == VK_ERROR_OUT_OF_DATE_KHR)
+		// Offscreen images line up with frames in flight, so the in flight fence already guards reuse
+		uint32_t image_index = current_frame;
+		if(!headless)
 		{
-			swapchain_recreation();
-			return;
-		}
+			VkResult result = vkAcquireNextImageKHR(device.logical_device, swapchain.swapchain, UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
 
-		update_ubos(image_index);
+			// Check that the swapchain is incompatible with the surface (window resizing)
+			if(result == VK_ERROR_OUT_OF_DATE_KHR)
+			{
+				swapchain_recreation();
+				return;
+			}
+		}
 
 		if(images_in_flight[image_index] != VK_NULL_HANDLE)
 		{
@@ -696,17 +1283,36 @@ struct HostRenderer
 		}
 		images_in_flight[image_index] = in_flight_fences[current_frame];
 
+		// Wait for the encode thread to be done with this image's readback slot from last time around
+		uint64_t readback_value = numframes + 1;
+		readback_ring.acquire(image_index, readback_value);
+		readback_ring.slots[image_index].timestamp_us = timestamp_us();
+
+		// As late as possible, so the frame is rendered with the newest pose there is
+		update_ubos(image_index, readback_ring.slots[image_index]);
+
 		VkSemaphore wait_semaphores[]	   = {image_available_semaphores[current_frame]};
 		VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-		VkSemaphore signal_semaphores[]	   = {render_finished_semaphores[current_frame]};
+		VkSemaphore signal_semaphores[]	   = {readback_ring.timeline, render_finished_semaphores[current_frame]};
+		uint64_t signal_values[]		   = {readback_value, 0}; // the binary semaphore's value is ignored
+
+		// Headless has no acquire to wait on and no present to signal
+		uint32_t num_binary_semaphores = headless ? 0 : 1;
+
+		VkTimelineSemaphoreSubmitInfo timeline_submit_info = {
+			.sType					   = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+			.signalSemaphoreValueCount = 1 + num_binary_semaphores,
+			.pSignalSemaphoreValues	   = signal_values,
+		};
 
 		VkSubmitInfo submit_info		 = vki::submitInfo();
-		submit_info.waitSemaphoreCount	 = 1;
+		submit_info.pNext				 = &timeline_submit_info;
+		submit_info.waitSemaphoreCount	 = num_binary_semaphores;
 		submit_info.pWaitSemaphores		 = wait_semaphores;
 		submit_info.pWaitDstStageMask	 = wait_stages;
 		submit_info.commandBufferCount	 = 1;
 		submit_info.pCommandBuffers		 = &command_buffers[image_index];
-		submit_info.signalSemaphoreCount = 1;
+		submit_info.signalSemaphoreCount = 1 + num_binary_semaphores;
 		submit_info.pSignalSemaphores	 = signal_semaphores;
 
 		vkResetFences(device.logical_device, 1, &in_flight_fences[current_frame]);
@@ -716,40 +1322,21 @@ struct HostRenderer
 			throw std::runtime_error("failed to submit draw command buffer!");
 		}
 
-		VkSwapchainKHR swapchains_to_present_to[] = {swapchain.swapchain};
-		VkPresentInfoKHR present_info			  = vki::presentInfoKHR(1, signal_semaphores, 1, swapchains_to_present_to, &image_index);
-
-		vkQueuePresentKHR(device.present_queue, &present_info);
-
-		ImagePacket image_packet = copy_image_to_packet(device, command_pool, swapchain.images[current_frame]);
-
-		timeval start_of_stream;
-		timeval end_of_stream;
-		gettimeofday(&start_of_stream, nullptr);
-
-		// Write to PPM
-		std::string filename = "tmpserver" + std::to_string(numframes) + ".ppm";
-		/*std::ofstream file(filename, std::ios::out | std::ios::binary);
-		file << "P6\n"
-			 << SERVERWIDTH << "\n"
-			 << SERVERHEIGHT << "\n"
-			 << 255 << "\n";*/
-
-		COZ_BEGIN("network_send");
+		if(!headless)
+		{
+			VkSwapchainKHR swapchains_to_present_to[] = {swapchain.swapchain};
+			VkPresentInfoKHR present_info			  = vki::presentInfoKHR(1, &render_finished_semaphores[current_frame], 1, swapchains_to_present_to, &image_index);
 
-		send_image_to_client(image_packet);
+			vkQueuePresentKHR(device.present_queue, &present_info);
+		}
 
-		COZ_END("network_send");
+		// The encode thread waits on the timeline for this frame while we go on to the next one
+		readback_queue.push(image_index);
+		encode_wakeup.signal();
 
 		printf("framenum server: %lu\n", numframes);
 		numframes++;
 
-
-		gettimeofday(&end_of_stream, nullptr);
-		double stream_dt = end_of_stream.tv_sec - start_of_stream.tv_sec + (end_of_stream.tv_usec - start_of_stream.tv_usec);
-
-		image_packet.destroy(device);
-
 		current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
 
 		gettimeofday(&timer_end, nullptr);
@@ -759,43 +1346,754 @@ struct HostRenderer
 
 
 	/*
-		Function that sends the image to the client.
-		It will also take out the alpha value of the swapchain's image that was
-		mapped to some char* or void* as uint8_t's.
-
-		The receiving buffer on the client needs to be able to receive
-		the same number of packets.
+		Draws the model once per layer, each into its own viewport of the
+		frame. A ring covers scale times the fovea's field of view with the
+		same projection, so its clip space x and y just shrink by scale.
+		Unfoveated frames are the one layer, filling the frame.
 	*/
-	void send_image_to_client(ImagePacket image_packet)
+	void record_layers(VkCommandBuffer cmdbuf)
 	{
-		size_t output_framesize_bytes = SERVERWIDTH * SERVERHEIGHT * 3;
-		size_t input_framesize_bytes  = SERVERWIDTH * SERVERHEIGHT * sizeof(uint32_t);
+		uint32_t num_layers = foveated ? FOVEATED_LAYERS : 1;
+
+		for(uint32_t layer = 0; layer < num_layers; layer++)
+		{
+			FoveatedLayer rect = {0, 0, swapchain.swapchain_extent.width, swapchain.swapchain_extent.height, 1};
+			if(foveated)
+			{
+				rect = foveated_layer(layer, SERVERWIDTH, SERVERHEIGHT);
+			}
+
+			VkViewport viewport = vki::viewport((float) rect.x, (float) rect.y, (float) rect.width, (float) rect.height, 0.0f, 1.0f);
+			VkRect2D scissor	= vki::rect2D({(int32_t) rect.x, (int32_t) rect.y}, {rect.width, rect.height});
+			vkCmdSetViewport(cmdbuf, 0, 1, &viewport);
+			vkCmdSetScissor(cmdbuf, 0, 1, &scissor);
+
+			LayerPushConstants push_constants = {
+				.clip_scale	 = glm::vec2(1.0f / rect.scale),
+				.clip_offset = glm::vec2(0.0f),
+			};
+			vkCmdPushConstants(cmdbuf, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(push_constants), &push_constants);
 
-		uint8_t sendpacket[output_framesize_bytes];
-		rgba_to_rgb((uint8_t *) image_packet.data, sendpacket, input_framesize_bytes);
-		send(server.client_fd, sendpacket, output_framesize_bytes, 0);
+			vkCmdDrawIndexed(cmdbuf, model.indices.size(), 1, 0, 0, 0);
+		}
 	}
 
 
-	void swapchain_recreation()
+	// One readback slot per swapchain image. Packed formats get written straight into them by the frame packer
+	void setup_readback()
 	{
-		vkDeviceWaitIdle(device.logical_device);
+		VkExtent2D extent = swapchain.swapchain_extent;
+		if(ycocg && !swapchain.sampleable())
+		{
+			throw std::runtime_error("--ycocg needs swapchain images that can be sampled");
+		}
 
-		SwapChainSupportDetails swapchain_support = query_swapchain_support(device.physical_device, surface);
-		swapchain.setup_swapchain(swapchain_support, surface, device, window);
-		swapchain.setup_image_views(device.logical_device);
-		renderpass.setup_renderpass(device, swapchain);
-		setup_graphics_pipeline();
-		setup_framebuffers();
-		initialize_ubos();
-		setup_descriptor_pool();
-		setup_command_buffers();
-	}
-};
+		// The RGB packer writes 4 pixels, 3 whole words, at a time
+		rgb_packed = gpu_pack && !ycocg && swapchain.sampleable() && extent.width % 4 == 0;
+		readback_bgra = swapchain.bgr();
+
+		if(ycocg)
+		{
+			readback_ring = ReadbackRing(device, swapchain.images.size(), extent, 1, ycocg420_size(extent.width, extent.height), send_depth);
+			frame_packer  = GpuFramePacker(device, "shaders/computeycocgserver.spv", 8, 2, swapchain.image_views, readback_ring);
+		}
+		else if(rgb_packed)
+		{
+			// The sampler hands back RGB whatever the swapchain format, the same order the CPU conversion writes
+			readback_ring = ReadbackRing(device, swapchain.images.size(), extent, 3, 0, send_depth);
+			frame_packer  = GpuFramePacker(device, "shaders/computergbserver.spv", 4, 1, swapchain.image_views, readback_ring);
+		}
+		else
+		{
+			if(gpu_pack && !ycocg)
+			{
+				printf("Swapchain images can't be packed on the GPU, converting frames on the CPU\n");
+			}
+			readback_ring = ReadbackRing(device, swapchain.images.size(), extent, 4, 0, send_depth);
+		}
+
+		readback_queue.resize(swapchain.images.size());
+	}
+
+	void destroy_readback()
+	{
+		if(ycocg || rgb_packed)
+		{
+			frame_packer.destroy(device.logical_device);
+		}
+		readback_ring.destroy(device);
+	}
+
+	FrameFormat transport_format()
+	{
+		if(ycocg)
+		{
+			return FRAME_FORMAT_YCOCG420;
+		}
+
+		return delta ? FRAME_FORMAT_RGB8_TILES : FRAME_FORMAT_RGB8;
+	}
+
+
+	void setup_encode_buffers()
+	{
+		// Enough for a full send queue and the one being encoded, plus a full queue and the one being sent for each client
+		encode_buffers.resize(pipeline_depth + 1 + server.max_clients * (pipeline_depth + 1));
+		send_queue.resize(pipeline_depth);
+		free_queue.resize(encode_buffers.size());
+		tile_encoder = TileDeltaEncoder(frame_extent.width, frame_extent.height);
+		compressor	 = FrameCompressor(codec, zstd_level);
+		encode_scratch.resize(tile_encoder.grid.max_payload_size());
+
+		// The rate controller can switch to any codec. Depth goes on the end, as it is
+		size_t capacity = FrameCompressor::max_encoded_size(codec, tile_encoder.grid.max_payload_size());
+		for(uint16_t other = FRAME_CODEC_RAW; rate_control && other <= FRAME_CODEC_QOI; other++)
+		{
+			capacity = std::max(capacity, FrameCompressor::max_encoded_size(other, tile_encoder.grid.max_payload_size()));
+		}
+		capacity += send_depth ? depth16_size(frame_extent.width, frame_extent.height) : 0;
+
+		for(uint32_t i = 0; i < encode_buffers.size(); i++)
+		{
+			encode_buffers[i].capacity	  = capacity;
+			encode_buffers[i].data		  = allocate_pinned_buffer(encode_buffers[i].capacity);
+			encode_buffers[i].header	  = make_frame_header(0, 0, 0, frame_extent.width, frame_extent.height, FRAME_FORMAT_RGB8, FRAME_CODEC_RAW, 0);
+			encode_buffers[i].keyframe	  = false;
+			encode_buffers[i].references  = 0;
+			encode_buffers[i].tile_bitmap.assign(tile_encoder.grid.bitmap_size(), 0);
+			free_queue.push(i);
+		}
+	}
+
+	void destroy_encode_buffers()
+	{
+		for(uint32_t i = 0; i < encode_buffers.size(); i++)
+		{
+			free_pinned_buffer(encode_buffers[i].data, encode_buffers[i].capacity);
+		}
+
+		encode_buffers.clear();
+		compressor.destroy();
+	}
+
+	void start_pipeline_threads()
+	{
+		encode_running.store(true);
+		send_running.store(true);
+
+		if(pthread_create(&encode_thread, nullptr, HostRenderer::encode_loop, this) != 0 ||
+		   pthread_create(&send_thread, nullptr, HostRenderer::send_loop, this) != 0)
+		{
+			throw std::runtime_error("Could not create pipeline threads");
+		}
+	}
+
+	// Lets each stage finish whatever is still queued for it, then joins them in order
+	void stop_pipeline_threads()
+	{
+		encode_running.store(false);
+		encode_wakeup.signal();
+		pthread_join(encode_thread, nullptr);
+
+		send_running.store(false);
+		server.wake();
+		pthread_join(send_thread, nullptr);
+	}
+
+	// Encode thread only
+	uint32_t next_free_buffer()
+	{
+		uint32_t buffer = spare_buffer;
+		if(buffer != UINT32_MAX)
+		{
+			spare_buffer = UINT32_MAX;
+			return buffer;
+		}
+
+		// One is always on its way back, short of zerocopy sends the kernel hasn't finished yet
+		while(!free_queue.pop(buffer))
+		{
+			encode_wakeup.wait(-1);
+		}
+
+		return buffer;
+	}
+
+	/*
+		Encode thread. Takes readback slots in the order they were submitted,
+		waits on the timeline semaphore for that frame's copy, encodes it into
+		a free buffer and hands the slot straight back to the render thread.
+	*/
+	static void *encode_loop(void *hostrenderer)
+	{
+		HostRenderer *hr = (HostRenderer *) hostrenderer;
+
+		uint32_t slot;
+		while(true)
+		{
+			if(!hr->readback_queue.pop(slot))
+			{
+				if(!hr->encode_running.load())
+				{
+					break;
+				}
+
+				// Sleeps until the render thread queues a frame, or stop_pipeline_threads() wants it gone
+				hr->encode_wakeup.wait(-1);
+				continue;
+			}
+
+			uint32_t buffer_index = hr->next_free_buffer();
+			EncodeBuffer &buffer  = hr->encode_buffers[buffer_index];
+			hr->handle_client_requests();
+			bool rate_changed = hr->rate_control && hr->update_rate_control();
+
+			COZ_BEGIN("swapchain_image_copy");
+			uint8_t *frame_data = hr->readback_ring.wait(hr->device, slot);
+			COZ_END("swapchain_image_copy");
+
+			COZ_BEGIN("frame_encode");
+			ReadbackSlot &readback = hr->readback_ring.slots[slot];
+			FrameFormat format	   = hr->transport_format();
+			size_t payload_size	   = hr->encode_payload(frame_data, format, buffer);
+			size_t depth_size	   = hr->readback_ring.depth_size;
+			if(depth_size != 0)
+			{
+				memcpy(buffer.data + payload_size, readback.depth_data, depth_size);
+				payload_size += depth_size;
+			}
+			buffer.keyframe = format != FRAME_FORMAT_RGB8_TILES || hr->tile_encoder.keyframe;
+			buffer.header	= make_frame_header(readback.timeline_value - 1, readback.timestamp_us, readback.pose_id, hr->frame_extent.width, hr->frame_extent.height, format, hr->codec, payload_size,
+												hr->foveated ? FRAME_FLAG_FOVEATED : 0);
+			buffer.header.depth_size = depth_size;
+			memcpy(buffer.header.view, &readback.view, sizeof(buffer.header.view));
+			memcpy(buffer.header.projection, &readback.projection, sizeof(buffer.header.projection));
+			encode_frame_header(buffer.header, buffer.header_bytes);
+			hr->readback_ring.release(slot);
+			COZ_END("frame_encode");
+
+			if(hr->rate_control)
+			{
+				uint64_t now_us = timestamp_us();
+				hr->rate_controller.frame_encoded(buffer.header.sequence, FRAME_HEADER_SIZE + payload_size, now_us);
+				hr->rate_controller.log(buffer.header.sequence, rate_changed, now_us);
+			}
+
+			uint32_t dropped;
+			if(hr->send_queue.push_drop_oldest(buffer_index, dropped))
+			{
+				EncodeBuffer &dropped_buffer = hr->encode_buffers[dropped];
+				printf("network behind, dropped frame %lu\n", dropped_buffer.header.sequence);
+
+				// The client never sees the dropped frame's tiles, so they have to go out again
+				if(dropped_buffer.header.format == FRAME_FORMAT_RGB8_TILES)
+				{
+					hr->tile_encoder.resend_tiles(dropped_buffer.tile_bitmap.data());
+				}
+				hr->spare_buffer = dropped;
+			}
+			hr->server.wake();
+		}
+
+		return nullptr;
+	}
+
+	/*
+		Send thread. Hands each encoded buffer out to every client, and keeps
+		their sockets going from one epoll loop, accepting new clients and
+		reading what they send as it goes. Frames still queued for a client
+		when the thread stops wait there for it to start again.
+	*/
+	static void *send_loop(void *hostrenderer)
+	{
+		HostRenderer *hr = (HostRenderer *) hostrenderer;
+
+		epoll_event events[16];
+		while(true)
+		{
+			// Read before draining the queue, since the encode thread has stopped queueing by the time this is false
+			bool running = hr->send_running.load();
+
+			uint32_t buffer;
+			while(hr->send_queue.pop(buffer))
+			{
+				hr->fan_out_frame(buffer);
+			}
+			if(!running)
+			{
+				break;
+			}
+
+			int num_events = epoll_wait(hr->server.epoll_fd, events, 16, 100);
+			for(int i = 0; i < num_events; i++)
+			{
+				int fd = events[i].data.fd;
+				if(fd == hr->server.socket_fd)
+				{
+					hr->accept_clients();
+				}
+				else if(fd == hr->server.wake_fd)
+				{
+					uint64_t count;
+					read(hr->server.wake_fd, &count, sizeof(count));
+				}
+				else
+				{
+					hr->service_client(fd, events[i].events);
+				}
+			}
+
+			hr->client_connected.store(!hr->server.clients.empty());
+			hr->pose_receiver.source.store(hr->server.clients.empty() ? 0 : hr->server.clients.front().pose_source);
+		}
+
+		return nullptr;
+	}
+
+	/*
+		Send thread only. Queues buffer for every client that can use it and
+		starts sending it, then recycles it once no client needs it anymore.
+		Over UDP a frame goes out whole straight away, so it's never queued.
+	*/
+	void fan_out_frame(uint32_t buffer_index)
+	{
+		EncodeBuffer &buffer = encode_buffers[buffer_index];
+		buffer.references	 = 1; // so it can't go back to the encode thread before every client has it
+
+		for(uint32_t i = 0; i < server.clients.size();)
+		{
+			ClientConnection &client = server.clients[i];
+			if(udp && !client.udp_ready)
+			{
+				i++;
+				continue;
+			}
+			if(client.waiting_for_keyframe && !buffer.keyframe)
+			{
+				request_keyframe(client);
+				i++;
+				continue;
+			}
+			client.waiting_for_keyframe = false;
+
+			bool sent;
+			if(udp)
+			{
+				COZ_BEGIN("network_send");
+				uint64_t send_start_us = timestamp_us();
+				sent				   = client.udp_sender.send_frame(buffer.header.sequence, buffer.header_bytes, buffer.data, buffer.header.payload_size, buffer.header.codec);
+				if(rate_control && i == 0)
+				{
+					rate_controller.frame_sent(buffer.header.sequence, timestamp_us() - send_start_us);
+				}
+				COZ_END("network_send");
+			}
+			else
+			{
+				buffer.references++;
+				client.queue.push_back(buffer_index);
+				if(client.queue.size() > pipeline_depth)
+				{
+					drop_oldest_frame(client);
+				}
+				sent = send_to_client(client, i == 0);
+			}
+
+			if(sent)
+			{
+				i++;
+			}
+			else
+			{
+				disconnect_client(i);
+			}
+		}
+
+		release_buffer(buffer_index);
+	}
+
+	/*
+		Send thread only. The client has fallen a full queue behind, so its
+		oldest frame goes. Any tile frames queued after it build on tiles
+		it carried, so those go too, until a keyframe brings the client back.
+	*/
+	void drop_oldest_frame(ClientConnection &client)
+	{
+		uint32_t dropped = client.queue.front();
+		client.queue.pop_front();
+		printf("client %u behind, dropped frame %lu\n", client.id, encode_buffers[dropped].header.sequence);
+
+		if(encode_buffers[dropped].header.format == FRAME_FORMAT_RGB8_TILES)
+		{
+			while(!client.queue.empty() && !encode_buffers[client.queue.front()].keyframe)
+			{
+				release_buffer(client.queue.front());
+				client.queue.pop_front();
+			}
+			if(client.queue.empty())
+			{
+				client.waiting_for_keyframe = true;
+				request_keyframe(client);
+			}
+		}
+		release_buffer(dropped);
+	}
+
+	// Send thread only. Keyframes go to every client, so one that keeps falling behind only gets to ask every so often
+	void request_keyframe(ClientConnection &client)
+	{
+		uint64_t now_us = timestamp_us();
+		if(now_us - client.keyframe_requested_us >= KEYFRAME_REQUEST_INTERVAL_US)
+		{
+			keyframe_requested.store(true);
+			client.keyframe_requested_us = now_us;
+		}
+	}
+
+	// Send thread only. Gives the buffer back to the encode thread once the last client is done with it
+	void release_buffer(uint32_t buffer_index)
+	{
+		if(--encode_buffers[buffer_index].references == 0)
+		{
+			free_queue.push(buffer_index);
+			encode_wakeup.signal();
+		}
+	}
+
+	// Send thread only. Whatever epoll says happened on a client's socket
+	void service_client(int fd, uint32_t events)
+	{
+		int index = server.find_client(fd);
+		if(index == -1)
+		{
+			return;
+		}
+
+		ClientConnection &client = server.clients[index];
+		bool connected			 = read_client_messages(client, index == 0);
+		if(connected && !udp)
+		{
+			connected = send_to_client(client, index == 0);
+		}
+
+		if(!connected || (events & EPOLLHUP))
+		{
+			disconnect_client(index);
+		}
+	}
+
+	/*
+		Send thread only. Sends as much of the client's queue as its socket
+		has room for, header and payload together. With zerocopy, a buffer
+		is only released once the kernel says it's done reading from it.
+		Returns false once the client is gone.
+	*/
+	bool send_to_client(ClientConnection &client, bool rate_client)
+	{
+		recycle_zerocopy_buffers(client);
+
+		while(true)
+		{
+			if(client.sending == UINT32_MAX)
+			{
+				if(client.queue.empty())
+				{
+					return true;
+				}
+
+				client.sending = client.queue.front();
+				client.queue.pop_front();
+
+				EncodeBuffer &buffer	= encode_buffers[client.sending];
+				client.iov[0]			= {buffer.header_bytes, FRAME_HEADER_SIZE};
+				client.iov[1]			= {buffer.data, buffer.header.payload_size};
+				client.send_started_us	= timestamp_us();
+				client.zerocopy_pending = false;
+			}
+
+			COZ_BEGIN("network_send");
+			uint32_t num_zerocopy_sends;
+			bool sent = sendmsg_some(client.fd, client.iov, 2, client.zerocopy ? MSG_ZEROCOPY : 0, num_zerocopy_sends);
+			COZ_END("network_send");
+			if(!sent)
+			{
+				return false;
+			}
+
+			// The buffer's last send is the one that has to complete before it can be reused
+			for(uint32_t i = 0; i < num_zerocopy_sends; i++)
+			{
+				client.zerocopy_id		= client.zerocopy_completions.sent();
+				client.zerocopy_pending = true;
+			}
+
+			// Out of room, so epoll says when to carry on
+			if(client.iov[1].iov_len != 0)
+			{
+				return true;
+			}
+
+			EncodeBuffer &buffer = encode_buffers[client.sending];
+			if(rate_control && rate_client)
+			{
+				rate_controller.frame_sent(buffer.header.sequence, timestamp_us() - client.send_started_us);
+			}
+
+			if(client.zerocopy_pending)
+			{
+				client.zerocopy_in_flight.push_back({client.sending, client.zerocopy_id});
+			}
+			else
+			{
+				release_buffer(client.sending);
+			}
+			client.sending = UINT32_MAX;
+		}
+	}
+
+	// Send thread only. Releases buffers whose zerocopy sends to client have completed, oldest first
+	void recycle_zerocopy_buffers(ClientConnection &client)
+	{
+		if(client.zerocopy_in_flight.empty())
+		{
+			return;
+		}
+
+		client.zerocopy_completions.poll(client.fd);
+		while(!client.zerocopy_in_flight.empty() && client.zerocopy_completions.done(client.zerocopy_in_flight.front().id))
+		{
+			release_buffer(client.zerocopy_in_flight.front().buffer);
+			client.zerocopy_in_flight.pop_front();
+		}
+	}
+
+	// Send thread only. Nothing more is coming from a dead socket, and nothing will read what's left in its buffers
+	void disconnect_client(uint32_t index)
+	{
+		ClientConnection &client = server.clients[index];
+		close(client.fd);
+		client.udp_sender.destroy();
+
+		for(uint32_t buffer : client.queue)
+		{
+			release_buffer(buffer);
+		}
+		if(client.sending != UINT32_MAX)
+		{
+			release_buffer(client.sending);
+		}
+		for(const ClientConnection::ZerocopySend &send : client.zerocopy_in_flight)
+		{
+			release_buffer(send.buffer);
+		}
+
+		printf("client %u disconnected, serving %zu clients\n", client.id, server.clients.size() - 1);
+		server.clients.erase(server.clients.begin() + index);
+	}
+
+
+	/*
+		Encodes a frame in format into buffer, compressed with codec.
+		Uncompressed frames are encoded straight into the buffer, compressed
+		ones go through encode_scratch. Full frames the GPU already packed
+		are used as they are. Returns the payload size.
+	*/
+	size_t encode_payload(const uint8_t *frame_data, FrameFormat format, EncodeBuffer &buffer)
+	{
+		const uint8_t *frame = frame_data;
+		size_t frame_size	 = readback_ring.slot_size;
+
+		bool packed = format == FRAME_FORMAT_YCOCG420 || (format == FRAME_FORMAT_RGB8 && rgb_packed);
+		if(!packed)
+		{
+			uint8_t *out = codec == FRAME_CODEC_RAW ? buffer.data : encode_scratch.data();
+			frame_size	 = encode_frame(frame_data, format, out);
+			frame		 = out;
+		}
+
+		if(format == FRAME_FORMAT_RGB8_TILES)
+		{
+			memcpy(buffer.tile_bitmap.data(), frame, buffer.tile_bitmap.size());
+		}
+
+		if(codec == FRAME_CODEC_RAW)
+		{
+			// The slot goes back to the render thread, so packed frames still need copying out
+			if(frame != buffer.data)
+			{
+				memcpy(buffer.data, frame, frame_size);
+			}
+			return frame_size;
+		}
+
+		COZ_BEGIN("frame_compress");
+		size_t payload_size = compressor.encode(frame, frame_size, format, tile_encoder.grid, buffer.data, buffer.capacity);
+		COZ_END("frame_compress");
+		if(payload_size == 0)
+		{
+			throw std::runtime_error("Could not compress frame");
+		}
+
+		return payload_size;
+	}
+
+	/*
+		Takes out the alpha value of an RGBA readback image, since it doesn't
+		need to go over the network, swapping BGRA images around to RGB, and for FRAME_FORMAT_RGB8_TILES also
+		leaves out the tiles that didn't change. Returns the number of bytes
+		written to out.
+	*/
+	size_t encode_frame(const uint8_t *frame_data, FrameFormat format, uint8_t *out)
+	{
+		if(format == FRAME_FORMAT_RGB8_TILES)
+		{
+			return tile_encoder.encode(frame_data, readback_ring.row_pitch, rgb_packed ? 3 : 4, readback_bgra, out);
+		}
+
+		rgba_to_rgb_strided(frame_data, readback_ring.row_pitch, out, frame_extent.width * 3, frame_extent.width, frame_extent.height, readback_bgra);
+		return frame_extent.width * frame_extent.height * 3;
+	}
+
+	void swapchain_recreation()
+	{
+		// Everything queued has to be encoded before the ring can go away
+		stop_pipeline_threads();
+		vkDeviceWaitIdle(device.logical_device);
+		destroy_readback();
+
+		SwapChainSupportDetails swapchain_support = query_swapchain_support(device.physical_device, surface);
+		swapchain.setup_swapchain(swapchain_support, surface, device, window);
+		swapchain.setup_image_views(device.logical_device);
+		renderpass.setup_renderpass(device, swapchain, send_depth);
+		setup_graphics_pipeline();
+		setup_framebuffers();
+		initialize_ubos();
+		setup_descriptor_pool();
+		setup_readback();
+		setup_command_buffers();
+		start_pipeline_threads();
+	}
+};
+
+int main(int argc, char **argv)
+{
+	HostRenderer host_renderer;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--headless") == 0)
+		{
+			host_renderer.headless = true;
+		}
+		else if(strcmp(argv[i], "--pipeline-depth") == 0 && i + 1 < argc)
+		{
+			host_renderer.pipeline_depth = std::max(1, atoi(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--zerocopy") == 0)
+		{
+			host_renderer.zerocopy = true;
+		}
+		else if(strcmp(argv[i], "--no-delta") == 0)
+		{
+			host_renderer.delta = false;
+		}
+		else if(strcmp(argv[i], "--codec") == 0 && i + 1 < argc && FrameCompressor::from_name(argv[i + 1], host_renderer.codec))
+		{
+			i++;
+		}
+		else if(strcmp(argv[i], "--zstd-level") == 0 && i + 1 < argc)
+		{
+			host_renderer.zstd_level = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--ycocg") == 0)
+		{
+			host_renderer.ycocg = true;
+		}
+		else if(strcmp(argv[i], "--cpu-pack") == 0)
+		{
+			host_renderer.gpu_pack = false;
+		}
+		else if(strcmp(argv[i], "--foveated") == 0)
+		{
+			host_renderer.foveated	   = true;
+			host_renderer.frame_extent = {foveated_atlas_width(SERVERWIDTH), SERVERHEIGHT};
+		}
+		else if(strcmp(argv[i], "--depth") == 0)
+		{
+			host_renderer.send_depth = true;
+		}
+		else if(strcmp(argv[i], "--udp") == 0)
+		{
+			host_renderer.udp = true;
+		}
+		else if(strcmp(argv[i], "--fec") == 0 && i + 1 < argc)
+		{
+			host_renderer.fec_group = std::min(255, std::max(0, atoi(argv[++i])));
+		}
+		else if(strcmp(argv[i], "--loss-rate") == 0 && i + 1 < argc)
+		{
+			host_renderer.loss_rate = std::min(1.0, std::max(0.0, atof(argv[++i])));
+		}
+		else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+		{
+			host_renderer.port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pose-port") == 0 && i + 1 < argc)
+		{
+			host_renderer.pose_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc)
+		{
+			host_renderer.server.max_clients = std::max(1, atoi(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--abr") == 0)
+		{
+			host_renderer.rate_control = true;
+		}
+		else if(strcmp(argv[i], "--delay-budget") == 0 && i + 1 < argc)
+		{
+			host_renderer.delay_budget_ms = std::max(1, atoi(argv[++i]));
+		}
+		else if(strcmp(argv[i], "--frame-stats") == 0)
+		{
+			host_renderer.frame_stats = true;
+		}
+		else
+		{
+			printf("Unknown argument %s\n", argv[i]);
+			printf("Usage: %s [--headless] [--pipeline-depth n] [--zerocopy] [--no-delta] [--codec raw|lz4|zstd|qoi] [--zstd-level n] [--ycocg] [--cpu-pack] [--foveated] [--depth] [--udp] [--fec n] [--loss-rate p] [--abr] [--delay-budget ms] [--port n] [--pose-port n] [--max-clients n] [--frame-stats]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// The QOI codec codes RGB pixels, and YCoCg's subsampled planes aren't those
+	if(host_renderer.ycocg && host_renderer.codec == FRAME_CODEC_QOI)
+	{
+		printf("--codec qoi only works on RGB frames, not --ycocg\n");
+		return 1;
+	}
+	if(host_renderer.ycocg && (host_renderer.frame_extent.width % 8 != 0 || host_renderer.frame_extent.height % 2 != 0))
+	{
+		printf("--ycocg needs the frame width to be a multiple of 8 and its height a multiple of 2\n");
+		return 1;
+	}
+	// Each layer of a foveated atlas has its own projection, which one camera in the header can't describe
+	if(host_renderer.send_depth && host_renderer.foveated)
+	{
+		printf("--depth doesn't work with --foveated frames\n");
+		return 1;
+	}
+	if(host_renderer.rate_control && (host_renderer.ycocg || host_renderer.codec != FRAME_CODEC_RAW))
+	{
+		printf("--abr picks the codec and chroma mode itself, ignoring --codec and --ycocg\n");
+	}
+	// Every UDP frame is built packet by packet in the sender's own buffers anyway
+	if(host_renderer.udp && host_renderer.zerocopy)
+	{
+		printf("--zerocopy only applies to TCP, sending UDP frames with copies\n");
+		host_renderer.zerocopy = false;
+	}
 
-int main()
-{
-	HostRenderer host_renderer;
 	host_renderer.run();
 
 	return 0;
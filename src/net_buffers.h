@@ -0,0 +1,116 @@
+#ifndef NET_BUFFERS_H
+#define NET_BUFFERS_H
+
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime> // linux/errqueue.h uses struct timespec without including it
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+
+/*
+	Page aligned buffer that's locked into RAM, so the kernel never has to
+	fault it back in halfway through a send, and MSG_ZEROCOPY can pin whole
+	pages of it.
+*/
+uint8_t *allocate_pinned_buffer(size_t num_bytes)
+{
+	void *data = mmap(nullptr, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(data == MAP_FAILED)
+	{
+		throw std::runtime_error("Could not allocate network buffer");
+	}
+
+	// Not fatal, it just means RLIMIT_MEMLOCK is too low and the buffer can be paged out
+	if(mlock(data, num_bytes) != 0)
+	{
+		printf("Could not lock %zu byte network buffer into memory\n", num_bytes);
+	}
+
+	return (uint8_t *) data;
+}
+
+void free_pinned_buffer(uint8_t *data, size_t num_bytes)
+{
+	munlock(data, num_bytes);
+	munmap(data, num_bytes);
+}
+
+
+/*
+	Tracks which MSG_ZEROCOPY sends the kernel is done with.
+	Every sendmsg() with MSG_ZEROCOPY that sends anything gets the next id, in
+	order, and the kernel reports finished ranges of ids on the socket's error
+	queue. Until a send's id has completed, the kernel may still be reading
+	from its buffer, so the buffer can't be written to again.
+*/
+struct ZerocopyCompletions
+{
+	uint32_t next_id   = 0; // id the next MSG_ZEROCOPY sendmsg will get
+	uint32_t completed = 0; // every id before this one has completed
+
+	// Returns false if the kernel doesn't support SO_ZEROCOPY
+	bool enable(int fd)
+	{
+		int one = 1;
+		return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+	}
+
+	// Counts a sendmsg(MSG_ZEROCOPY) that sent something, returning its id
+	uint32_t sent()
+	{
+		return next_id++;
+	}
+
+	bool done(uint32_t id)
+	{
+		// Signed difference, so this keeps working once the ids wrap around
+		return (int32_t) (completed - id) > 0;
+	}
+
+	// Drains whatever completions are on the error queue right now, without blocking
+	void poll(int fd)
+	{
+		while(true)
+		{
+			uint8_t control[128];
+			msghdr msg = {};
+			msg.msg_control	   = control;
+			msg.msg_controllen = sizeof(control);
+
+			if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			{
+				return;
+			}
+
+			for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			{
+				bool is_recverr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+								  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+				if(!is_recverr)
+				{
+					continue;
+				}
+
+				sock_extended_err *error = (sock_extended_err *) CMSG_DATA(cmsg);
+				if(error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				{
+					continue;
+				}
+
+				// ids ee_info through ee_data (inclusive) are done. TCP completes them in order
+				if((int32_t) (error->ee_data + 1 - completed) > 0)
+				{
+					completed = error->ee_data + 1;
+				}
+			}
+		}
+	}
+};
+
+
+#endif
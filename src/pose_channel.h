@@ -0,0 +1,369 @@
+#ifndef POSE_CHANNEL_H
+#define POSE_CHANNEL_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+
+/*
+	Camera poses from the client to the server, over UDP, so a late or lost
+	pose never holds up a newer one the way it would behind it on the TCP
+	connection. The client sends one every frame it renders, and the server
+	only ever wants the newest.
+	Every pose is one POSE_MESSAGE_SIZE byte little endian datagram:
+	  u64 pose id, counting up from 1
+	  u64 when the client took it, from timestamp_us()
+	  f32 position x, y, z
+	  f32 front x, y, z
+	The client says which port its poses come from with
+	CLIENT_MESSAGE_POSE_PORT, so the server knows whose they are.
+*/
+#define POSE_MESSAGE_SIZE 40
+#define POSE_MAILBOX_WORDS 6 // the encoded pose, then when it arrived
+
+
+struct Pose
+{
+	uint64_t pose_id; // 0 for no pose
+	uint64_t timestamp_us;
+	float position[3];
+	float front[3];
+	uint64_t received_us; // server side only, not sent
+};
+
+// out needs POSE_MESSAGE_SIZE bytes
+void encode_pose(const Pose &pose, uint8_t *out)
+{
+	write_le(out, pose.pose_id, 8);
+	write_le(out, pose.timestamp_us, 8);
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		write_le_float(out, pose.position[i]);
+	}
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		write_le_float(out, pose.front[i]);
+	}
+}
+
+void decode_pose(const uint8_t *in, Pose &pose)
+{
+	pose.pose_id	  = read_le(in, 8);
+	pose.timestamp_us = read_le(in, 8);
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		pose.position[i] = read_le_float(in);
+	}
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		pose.front[i] = read_le_float(in);
+	}
+}
+
+
+/*
+	Lock-free "latest pose" mailbox: a seqlock with one writer and any
+	number of readers. The writer makes sequence odd while it writes and
+	even again once it's done, and a reader that saw it odd, or saw it
+	change while it was reading, just reads again. The writer never waits
+	on a reader, and a reader never sees half of one pose and half of
+	another. The pose is kept as atomic words so reading one mid-write is
+	still well defined.
+*/
+struct PoseMailbox
+{
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint64_t> words[POSE_MAILBOX_WORDS];
+
+	PoseMailbox()
+	{
+		sequence.store(0);
+		for(uint32_t i = 0; i < POSE_MAILBOX_WORDS; i++)
+		{
+			words[i].store(0);
+		}
+	}
+
+	// Writer only
+	void write(const Pose &pose)
+	{
+		uint64_t packed[POSE_MAILBOX_WORDS];
+		encode_pose(pose, (uint8_t *) packed);
+		packed[POSE_MAILBOX_WORDS - 1] = pose.received_us;
+
+		uint64_t s = sequence.load(std::memory_order_relaxed);
+		sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for(uint32_t i = 0; i < POSE_MAILBOX_WORDS; i++)
+		{
+			words[i].store(packed[i], std::memory_order_relaxed);
+		}
+		sequence.store(s + 2, std::memory_order_release);
+	}
+
+	// Returns false if nothing has been written yet
+	bool read(Pose &pose)
+	{
+		uint64_t packed[POSE_MAILBOX_WORDS];
+		while(true)
+		{
+			uint64_t before = sequence.load(std::memory_order_acquire);
+			if(before == 0)
+			{
+				return false;
+			}
+			if(before % 2 == 1)
+			{
+				continue;
+			}
+
+			for(uint32_t i = 0; i < POSE_MAILBOX_WORDS; i++)
+			{
+				packed[i] = words[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(sequence.load(std::memory_order_relaxed) == before)
+			{
+				break;
+			}
+		}
+
+		decode_pose((const uint8_t *) packed, pose);
+		pose.received_us = packed[POSE_MAILBOX_WORDS - 1];
+		return true;
+	}
+};
+
+
+/*
+	Client side. Sends poses to the server's pose port, without ever
+	blocking: one the socket has no room for is just dropped, since the
+	next one will be newer anyway.
+*/
+struct PoseSender
+{
+	int socket_fd		  = -1;
+	uint64_t next_pose_id = 1;
+
+	PoseSender()
+	{
+		// don't use this
+	}
+
+	PoseSender(sockaddr_in address)
+	{
+		socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(socket_fd == -1)
+		{
+			throw std::runtime_error("Could not create pose socket");
+		}
+		if(connect(socket_fd, (sockaddr *) &address, sizeof(address)) == -1)
+		{
+			throw std::runtime_error("Could not connect pose socket to server");
+		}
+	}
+
+	// The port poses are sent from, once connected
+	uint16_t port()
+	{
+		sockaddr_in address;
+		socklen_t length = sizeof(address);
+		getsockname(socket_fd, (sockaddr *) &address, &length);
+		return ntohs(address.sin_port);
+	}
+
+	// Returns the id the pose went out with
+	uint64_t send_pose(const float position[3], const float front[3], uint64_t now_us)
+	{
+		Pose pose = {
+			.pose_id	  = next_pose_id++,
+			.timestamp_us = now_us,
+			.position	  = {position[0], position[1], position[2]},
+			.front		  = {front[0], front[1], front[2]},
+		};
+
+		uint8_t message[POSE_MESSAGE_SIZE];
+		encode_pose(pose, message);
+		send(socket_fd, message, POSE_MESSAGE_SIZE, MSG_DONTWAIT);
+		return pose.pose_id;
+	}
+
+	void destroy()
+	{
+		if(socket_fd != -1)
+		{
+			close(socket_fd);
+			socket_fd = -1;
+		}
+	}
+};
+
+
+/*
+	Client side. Guesses where the camera will be by the time a frame
+	rendered with a pose gets back, by carrying on at the speed it's been
+	moving, so the server renders about where the camera is when the frame
+	is shown rather than where it was one round trip ago. The speed is
+	smoothed over a few frames so one jumpy frame doesn't throw it off,
+	and it never guesses more than POSE_MAX_LEAD_US ahead.
+*/
+#define POSE_MAX_LEAD_US 200000
+
+struct PosePredictor
+{
+	float last_position[3] = {0.0f, 0.0f, 0.0f};
+	float velocity[3]	   = {0.0f, 0.0f, 0.0f}; // per microsecond
+	uint64_t last_us	   = 0;
+
+	// out can be position
+	void predict(const float position[3], uint64_t now_us, uint64_t lead_us, float out[3])
+	{
+		if(last_us != 0 && now_us > last_us)
+		{
+			float dt = (float) (now_us - last_us);
+			for(uint32_t i = 0; i < 3; i++)
+			{
+				velocity[i] = 0.5f * velocity[i] + 0.5f * (position[i] - last_position[i]) / dt;
+			}
+		}
+		last_us = now_us;
+
+		float lead = (float) std::min<uint64_t>(lead_us, POSE_MAX_LEAD_US);
+		for(uint32_t i = 0; i < 3; i++)
+		{
+			last_position[i] = position[i];
+			out[i]			 = position[i] + velocity[i] * lead;
+		}
+	}
+};
+
+
+/*
+	Server side. A thread that does nothing but wait for poses, and puts
+	the newest one from source in the mailbox for the render thread to
+	pick up whenever it likes. Poses from anywhere else, and ones that
+	arrive after a newer one did, are ignored.
+*/
+struct PoseReceiver
+{
+	int socket_fd = -1;
+	PoseMailbox mailbox;
+	std::atomic<uint64_t> source; // (IPv4 address << 16) | port of the client to take poses from, 0 for none
+	std::atomic<bool> running;
+	pthread_t thread;
+
+	PoseReceiver()
+	{
+		source.store(0);
+		running.store(false);
+	}
+
+	void start(int port)
+	{
+		socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(socket_fd == -1)
+		{
+			throw std::runtime_error("Could not create pose socket");
+		}
+
+		sockaddr_in address = {
+			.sin_family = AF_INET,
+			.sin_port	= htons(static_cast<in_port_t>(port)),
+		};
+		if(bind(socket_fd, (sockaddr *) &address, sizeof(address)) == -1)
+		{
+			throw std::runtime_error("Could not bind pose socket");
+		}
+
+		// Wakes up every so often to see if it should stop
+		timeval timeout = {
+			.tv_sec	 = 0,
+			.tv_usec = 100000,
+		};
+		setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		running.store(true);
+		if(pthread_create(&thread, nullptr, PoseReceiver::receive_loop, this) != 0)
+		{
+			throw std::runtime_error("Could not create pose thread");
+		}
+	}
+
+	static uint64_t source_of(const sockaddr_in &address)
+	{
+		return (uint64_t) ntohl(address.sin_addr.s_addr) << 16 | ntohs(address.sin_port);
+	}
+
+	static void *receive_loop(void *posereceiver)
+	{
+		PoseReceiver *pr = (PoseReceiver *) posereceiver;
+
+		uint64_t newest_source = 0;
+		uint64_t newest_id	   = 0;
+		while(pr->running.load())
+		{
+			uint8_t message[POSE_MESSAGE_SIZE];
+			sockaddr_in address;
+			socklen_t length = sizeof(address);
+			ssize_t received = recvfrom(pr->socket_fd, message, POSE_MESSAGE_SIZE, 0, (sockaddr *) &address, &length);
+			if(received != POSE_MESSAGE_SIZE)
+			{
+				continue;
+			}
+
+			uint64_t from = source_of(address);
+			if(from != pr->source.load())
+			{
+				continue;
+			}
+
+			Pose pose;
+			decode_pose(message, pose);
+
+			// A new client starts counting from 1 again
+			if(from != newest_source)
+			{
+				newest_source = from;
+				newest_id	  = 0;
+			}
+			if(pose.pose_id <= newest_id)
+			{
+				continue;
+			}
+			newest_id = pose.pose_id;
+
+			pose.received_us = timestamp_us();
+			pr->mailbox.write(pose);
+		}
+
+		return nullptr;
+	}
+
+	void stop()
+	{
+		if(!running.load())
+		{
+			return;
+		}
+
+		running.store(false);
+		pthread_join(thread, nullptr);
+		close(socket_fd);
+	}
+};
+
+
+#endif
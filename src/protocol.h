@@ -0,0 +1,600 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/*
+	Wire format for frames going from the server to the client.
+	Every frame is a FrameHeader followed by payload_size bytes of payload,
+	the last depth_size of which are the frame's depth, if it has any.
+	Headers are written field by field in little endian, so the layout doesn't
+	depend on either side's struct padding. Within a version, a header can
+	grow by adding optional fields at the end, and readers skip anything past
+	what they know about using header_size. Fields a reader can't do without
+	need a new version instead, so an older header is turned away as the
+	wrong version rather than as a short one. Version 2 added the depth size
+	and the camera's matrices, taking the header from 56 bytes to 192.
+*/
+#define FRAME_MAGIC 0x4D52464F // "OFRM"
+#define FRAME_PROTOCOL_VERSION 2
+#define FRAME_HEADER_SIZE 192 // bytes of header this version knows about
+#define FRAME_HEADER_PREFIX_SIZE 8 // magic, version and header_size, laid out the same in every version
+
+
+enum FrameFormat
+{
+	FRAME_FORMAT_RGB8		= 0, // 3 bytes per pixel, red, green, blue, whatever the server renders in
+	FRAME_FORMAT_RGB8_TILES = 1, // only the tiles that changed, as RGB8. See TileGrid
+	FRAME_FORMAT_YCOCG420	= 2, // width x height bytes of Y, then width/2 x height/2 bytes each of Co and Cg (biased by 128)
+};
+
+// How the payload is compressed, on top of its format. See frame_codec.h
+enum FrameCodec
+{
+	FRAME_CODEC_RAW	 = 0,
+	FRAME_CODEC_LZ4	 = 1, // one LZ4 block
+	FRAME_CODEC_ZSTD = 2, // one zstd frame
+	FRAME_CODEC_QOI	 = 3, // predictive image codec, see image_codec.h
+};
+
+
+struct FrameHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint64_t sequence;			  // server frame number, gaps mean dropped frames
+	uint64_t server_timestamp_us; // when the server rendered the frame, from timestamp_us()
+	uint64_t pose_id;			  // camera pose the frame was rendered with, 0 if none
+	uint32_t width;
+	uint32_t height;
+	uint16_t format;
+	uint16_t codec;
+	uint32_t flags; // FRAME_FLAG_*
+	uint64_t payload_size;
+	uint64_t depth_size;   // bytes at the end of the payload that are depth, see depth16_size()
+	float view[16];		   // the camera the frame was rendered with, column major
+	float projection[16];
+};
+
+
+/*
+	Layout of FRAME_FORMAT_RGB8_TILES payloads. The frame is cut into
+	FRAME_TILE_SIZE square tiles (smaller along the right and bottom edges),
+	numbered row by row. The payload starts with a bitmap of which tiles it
+	carries (tile i is bit i % 8 of byte i / 8), followed by each of those
+	tiles in order, as tightly packed rows of RGB8.
+	Tiles that aren't in a frame haven't changed since the last one.
+*/
+#define FRAME_TILE_SIZE 32
+
+struct TileGrid
+{
+	uint32_t width	 = 0;
+	uint32_t height	 = 0;
+	uint32_t tiles_x = 0;
+	uint32_t tiles_y = 0;
+
+	TileGrid()
+	{
+	}
+
+	TileGrid(uint32_t width, uint32_t height)
+		: width(width), height(height),
+		  tiles_x((width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE),
+		  tiles_y((height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE)
+	{
+	}
+
+	uint32_t num_tiles() const
+	{
+		return tiles_x * tiles_y;
+	}
+
+	size_t bitmap_size() const
+	{
+		return (num_tiles() + 7) / 8;
+	}
+
+	// Biggest payload a frame can have, with every tile in it
+	size_t max_payload_size() const
+	{
+		return bitmap_size() + (size_t) width * height * 3;
+	}
+
+	// Pixel rectangle that tile covers
+	void tile_rect(uint32_t tile, uint32_t &x, uint32_t &y, uint32_t &w, uint32_t &h) const
+	{
+		x = (tile % tiles_x) * FRAME_TILE_SIZE;
+		y = (tile / tiles_x) * FRAME_TILE_SIZE;
+		w = std::min<uint32_t>(FRAME_TILE_SIZE, width - x);
+		h = std::min<uint32_t>(FRAME_TILE_SIZE, height - y);
+	}
+};
+
+bool tile_bit(const uint8_t *bitmap, uint32_t tile)
+{
+	return (bitmap[tile / 8] >> (tile % 8)) & 1;
+}
+
+void set_tile_bit(uint8_t *bitmap, uint32_t tile)
+{
+	bitmap[tile / 8] |= 1 << (tile % 8);
+}
+
+
+/*
+	Foveated frames (FRAME_FLAG_FOVEATED) are an atlas of FOVEATED_LAYERS
+	layers, all centred on the same point. The fovea is at full resolution,
+	and each ring around it covers twice the width and height of the layer
+	inside it at the same pixel count, so half the resolution. Each ring
+	contains the layers inside it too, which is a little redundant but lets
+	every layer be a plain rectangle.
+	The fovea goes on the left and the rings are stacked to the right of
+	it, so the atlas is 1.5 times the width of the fovea:
+	  +--------+----+
+	  |        | 1  |
+	  |   0    +--+-+
+	  |        |2 |
+	  +--------+--+
+	Whatever the layers don't cover is black.
+*/
+#define FRAME_FLAG_FOVEATED 1
+#define FOVEATED_LAYERS 3
+
+struct FoveatedLayer
+{
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+	uint32_t scale; // how many fovea pixels wide each of its pixels is
+};
+
+// Fovea width and height should be multiples of 4
+FoveatedLayer foveated_layer(uint32_t layer, uint32_t fovea_width, uint32_t fovea_height)
+{
+	uint32_t scale = 1 << layer;
+	uint32_t x	   = layer == 0 ? 0 : fovea_width;
+	uint32_t y	   = layer <= 1 ? 0 : fovea_height / 2;
+
+	FoveatedLayer rect = {x, y, fovea_width / scale, fovea_height / scale, scale};
+	return rect;
+}
+
+uint32_t foveated_atlas_width(uint32_t fovea_width)
+{
+	return fovea_width + fovea_width / 2;
+}
+
+
+// Payload size of a FRAME_FORMAT_YCOCG420 frame. Width has to be a multiple of 8 and height of 2
+size_t ycocg420_size(uint32_t width, uint32_t height)
+{
+	return (size_t) width * height * 3 / 2;
+}
+
+
+/*
+	A frame's depth is one little endian u16 per pixel, straight out of a
+	16 bit depth buffer, in rows of width. It's never compressed or delta'd,
+	whatever the colour is, and foveated frames don't have any.
+*/
+size_t depth16_size(uint32_t width, uint32_t height)
+{
+	return (size_t) width * height * 2;
+}
+
+
+// Wall clock in microseconds, so it's comparable between the server and the client (given synced clocks)
+uint64_t timestamp_us()
+{
+	timeval now;
+	gettimeofday(&now, nullptr);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+
+FrameHeader make_frame_header(uint64_t sequence, uint64_t server_timestamp_us, uint64_t pose_id, uint32_t width, uint32_t height, FrameFormat format, FrameCodec codec, uint64_t payload_size, uint32_t flags = 0)
+{
+	FrameHeader header = {
+		.magic				 = FRAME_MAGIC,
+		.version			 = FRAME_PROTOCOL_VERSION,
+		.header_size		 = FRAME_HEADER_SIZE,
+		.sequence			 = sequence,
+		.server_timestamp_us = server_timestamp_us,
+		.pose_id			 = pose_id,
+		.width				 = width,
+		.height				 = height,
+		.format				 = (uint16_t) format,
+		.codec				 = (uint16_t) codec,
+		.flags				 = flags,
+		.payload_size		 = payload_size,
+	};
+
+	return header;
+}
+
+
+// Little endian field writers/readers, each advances the pointer past the field
+void write_le(uint8_t *&out, uint64_t value, uint32_t num_bytes)
+{
+	for(uint32_t i = 0; i < num_bytes; i++)
+	{
+		*out++ = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+uint64_t read_le(const uint8_t *&in, uint32_t num_bytes)
+{
+	uint64_t value = 0;
+	for(uint32_t i = 0; i < num_bytes; i++)
+	{
+		value |= (uint64_t) *in++ << (8 * i);
+	}
+
+	return value;
+}
+
+void write_le_float(uint8_t *&out, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	write_le(out, bits, 4);
+}
+
+float read_le_float(const uint8_t *&in)
+{
+	uint32_t bits = read_le(in, 4);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+
+// out needs FRAME_HEADER_SIZE bytes
+void encode_frame_header(const FrameHeader &header, uint8_t *out)
+{
+	write_le(out, header.magic, 4);
+	write_le(out, header.version, 2);
+	write_le(out, header.header_size, 2);
+	write_le(out, header.sequence, 8);
+	write_le(out, header.server_timestamp_us, 8);
+	write_le(out, header.pose_id, 8);
+	write_le(out, header.width, 4);
+	write_le(out, header.height, 4);
+	write_le(out, header.format, 2);
+	write_le(out, header.codec, 2);
+	write_le(out, header.flags, 4);
+	write_le(out, header.payload_size, 8);
+	write_le(out, header.depth_size, 8);
+	for(uint32_t i = 0; i < 16; i++)
+	{
+		write_le_float(out, header.view[i]);
+	}
+	for(uint32_t i = 0; i < 16; i++)
+	{
+		write_le_float(out, header.projection[i]);
+	}
+}
+
+// Reads FRAME_HEADER_SIZE bytes. Returns false if it isn't a header this version can read
+bool decode_frame_header(const uint8_t *in, FrameHeader &header)
+{
+	header.magic			   = read_le(in, 4);
+	header.version			   = read_le(in, 2);
+	header.header_size		   = read_le(in, 2);
+	header.sequence			   = read_le(in, 8);
+	header.server_timestamp_us = read_le(in, 8);
+	header.pose_id			   = read_le(in, 8);
+	header.width			   = read_le(in, 4);
+	header.height			   = read_le(in, 4);
+	header.format			   = read_le(in, 2);
+	header.codec			   = read_le(in, 2);
+	header.flags			   = read_le(in, 4);
+	header.payload_size		   = read_le(in, 8);
+	header.depth_size		   = read_le(in, 8);
+	for(uint32_t i = 0; i < 16; i++)
+	{
+		header.view[i] = read_le_float(in);
+	}
+	for(uint32_t i = 0; i < 16; i++)
+	{
+		header.projection[i] = read_le_float(in);
+	}
+
+	return header.magic == FRAME_MAGIC && header.version == FRAME_PROTOCOL_VERSION && header.header_size >= FRAME_HEADER_SIZE &&
+		   header.depth_size <= header.payload_size;
+}
+
+
+/*
+	send() and recv() can both move fewer bytes than asked for, so these loop
+	until everything went through. They return false if the socket errored or
+	the other end hung up.
+*/
+bool send_all(int fd, const void *data, size_t num_bytes)
+{
+	const uint8_t *bytes = (const uint8_t *) data;
+
+	while(num_bytes > 0)
+	{
+		// MSG_NOSIGNAL so the other end hanging up doesn't SIGPIPE us
+		ssize_t sent = send(fd, bytes, num_bytes, MSG_NOSIGNAL);
+		if(sent == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(sent <= 0)
+		{
+			return false;
+		}
+
+		bytes += sent;
+		num_bytes -= sent;
+	}
+
+	return true;
+}
+
+bool recv_all(int fd, void *data, size_t num_bytes)
+{
+	uint8_t *bytes = (uint8_t *) data;
+
+	while(num_bytes > 0)
+	{
+		ssize_t received = recv(fd, bytes, num_bytes, MSG_WAITALL);
+		if(received == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(received <= 0)
+		{
+			return false;
+		}
+
+		bytes += received;
+		num_bytes -= received;
+	}
+
+	return true;
+}
+
+
+// Moves iov past sent bytes, which may end partway through one of them
+void advance_iov(iovec *iov, int num_iov, size_t sent)
+{
+	for(size_t remaining = sent; remaining > 0 && num_iov > 0; iov++, num_iov--)
+	{
+		if(remaining < iov->iov_len)
+		{
+			iov->iov_base = (uint8_t *) iov->iov_base + remaining;
+			iov->iov_len -= remaining;
+			return;
+		}
+
+		remaining -= iov->iov_len;
+		iov->iov_len = 0;
+	}
+}
+
+/*
+	Vectored send_all, so a header and its payload go out together without
+	being copied into one buffer first. iov gets advanced as bytes go out.
+	Every sendmsg() with MSG_ZEROCOPY that sends something uses up a
+	zerocopy id, so those get counted in num_zerocopy_sends.
+*/
+bool sendmsg_all(int fd, iovec *iov, int num_iov, int flags, uint32_t &num_zerocopy_sends)
+{
+	num_zerocopy_sends = 0;
+
+	while(true)
+	{
+		// Skip past whatever has been fully sent
+		while(num_iov > 0 && iov->iov_len == 0)
+		{
+			iov++;
+			num_iov--;
+		}
+		if(num_iov == 0)
+		{
+			return true;
+		}
+
+		msghdr msg		= {};
+		msg.msg_iov		= iov;
+		msg.msg_iovlen	= num_iov;
+		ssize_t sent	= sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+		if(sent == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		// Out of lockable memory for zerocopy pages, so fall back to copying this time
+		if(sent == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+		{
+			flags &= ~MSG_ZEROCOPY;
+			continue;
+		}
+		if(sent <= 0)
+		{
+			return false;
+		}
+
+		if(flags & MSG_ZEROCOPY)
+		{
+			num_zerocopy_sends++;
+		}
+
+		advance_iov(iov, num_iov, sent);
+	}
+}
+
+/*
+	sendmsg_all for non-blocking sockets. Sends as much as the socket has room
+	for right now and returns, leaving iov at whatever is still to go, which
+	is nothing once every iov_len is 0. Returns false if the socket errored
+	or the other end hung up.
+*/
+bool sendmsg_some(int fd, iovec *iov, int num_iov, int flags, uint32_t &num_zerocopy_sends)
+{
+	num_zerocopy_sends = 0;
+
+	while(true)
+	{
+		while(num_iov > 0 && iov->iov_len == 0)
+		{
+			iov++;
+			num_iov--;
+		}
+		if(num_iov == 0)
+		{
+			return true;
+		}
+
+		msghdr msg		= {};
+		msg.msg_iov		= iov;
+		msg.msg_iovlen	= num_iov;
+		ssize_t sent	= sendmsg(fd, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return true;
+		}
+		if(sent == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+		{
+			flags &= ~MSG_ZEROCOPY;
+			continue;
+		}
+		if(sent <= 0)
+		{
+			return false;
+		}
+
+		if(flags & MSG_ZEROCOPY)
+		{
+			num_zerocopy_sends++;
+		}
+
+		advance_iov(iov, num_iov, sent);
+	}
+}
+
+
+bool send_frame_header(int fd, const FrameHeader &header)
+{
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	encode_frame_header(header, header_bytes);
+	return send_all(fd, header_bytes, FRAME_HEADER_SIZE);
+}
+
+/*
+	Also skips whatever a newer server put past the fields we know about.
+	The prefix comes in first, so a server on another version is reported
+	as that, before this waits on bytes its shorter header never sends.
+*/
+bool recv_frame_header(int fd, FrameHeader &header)
+{
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	if(!recv_all(fd, header_bytes, FRAME_HEADER_PREFIX_SIZE))
+	{
+		return false;
+	}
+
+	const uint8_t *prefix = header_bytes;
+	uint32_t magic		  = read_le(prefix, 4);
+	uint16_t version	  = read_le(prefix, 2);
+	if(magic == FRAME_MAGIC && version != FRAME_PROTOCOL_VERSION)
+	{
+		printf("Server sends frame protocol version %u, this side only speaks version %u\n", version, FRAME_PROTOCOL_VERSION);
+		return false;
+	}
+
+	if(!recv_all(fd, header_bytes + FRAME_HEADER_PREFIX_SIZE, FRAME_HEADER_SIZE - FRAME_HEADER_PREFIX_SIZE) || !decode_frame_header(header_bytes, header))
+	{
+		return false;
+	}
+
+	uint8_t skip[64];
+	for(uint32_t remaining = header.header_size - FRAME_HEADER_SIZE; remaining > 0;)
+	{
+		uint32_t num_bytes = remaining < sizeof(skip) ? remaining : sizeof(skip);
+		if(!recv_all(fd, skip, num_bytes))
+		{
+			return false;
+		}
+		remaining -= num_bytes;
+	}
+
+	return true;
+}
+
+
+/*
+	Messages going the other way, from the client to the server, on the same
+	TCP connection. Each is CLIENT_MESSAGE_SIZE bytes, little endian:
+	  u32 type (ClientMessageType)
+	  u32 reserved, 0
+	  u64 sequence of the frame it's about, if any
+	  u64 value, depending on the type
+*/
+#define CLIENT_MESSAGE_SIZE 24
+
+enum ClientMessageType
+{
+	CLIENT_MESSAGE_UDP_PORT	 = 0, // value is the UDP port frames should be sent to, see udp_transport.h
+	CLIENT_MESSAGE_KEYFRAME	 = 1, // a frame after sequence was lost, so send every tile next time
+	CLIENT_MESSAGE_ACK		 = 2, // sequence arrived, value is the microseconds from its first byte arriving to its last
+	CLIENT_MESSAGE_POSE_PORT = 3, // value is the UDP port the client's poses come from, see pose_channel.h
+};
+
+struct ClientMessage
+{
+	uint32_t type;
+	uint64_t sequence;
+	uint64_t value;
+};
+
+void encode_client_message(const ClientMessage &message, uint8_t *out)
+{
+	write_le(out, message.type, 4);
+	write_le(out, 0, 4);
+	write_le(out, message.sequence, 8);
+	write_le(out, message.value, 8);
+}
+
+void decode_client_message(const uint8_t *in, ClientMessage &message)
+{
+	message.type = read_le(in, 4);
+	read_le(in, 4);
+	message.sequence = read_le(in, 8);
+	message.value	 = read_le(in, 8);
+}
+
+bool send_client_message(int fd, uint32_t type, uint64_t sequence, uint64_t value)
+{
+	ClientMessage message = {
+		.type	  = type,
+		.sequence = sequence,
+		.value	  = value,
+	};
+
+	uint8_t message_bytes[CLIENT_MESSAGE_SIZE];
+	encode_client_message(message, message_bytes);
+	return send_all(fd, message_bytes, CLIENT_MESSAGE_SIZE);
+}
+
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef RATE_CONTROL_H
+#define RATE_CONTROL_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <vector>
+
+#include "protocol.h"
+
+
+/*
+	One rung of the quality ladder. Going down the ladder trades picture
+	quality or frame rate for fewer bytes a second. relative_size is a
+	rough guess at the frame size next to the top rung, used until a rung
+	has actually been tried.
+*/
+struct QualityLevel
+{
+	const char *name;
+	bool ycocg;
+	FrameCodec codec;
+	int zstd_level;
+	uint32_t max_fps; // 0 for as fast as the server renders
+	float relative_size;
+};
+
+const QualityLevel QUALITY_LADDER[] = {
+	{"rgb lz4", false, FRAME_CODEC_LZ4, 1, 0, 1.0f},
+	{"rgb zstd", false, FRAME_CODEC_ZSTD, 1, 0, 0.8f},
+	{"rgb qoi", false, FRAME_CODEC_QOI, 1, 0, 0.5f},
+	{"ycocg zstd", true, FRAME_CODEC_ZSTD, 1, 0, 0.3f},
+	{"ycocg zstd 30fps", true, FRAME_CODEC_ZSTD, 3, 30, 0.28f},
+	{"ycocg zstd 15fps", true, FRAME_CODEC_ZSTD, 3, 15, 0.28f},
+};
+
+#define RATE_SEND_HISTORY 256 // frames the send thread's timings are kept for
+
+
+/*
+	Picks the quality level of each frame so it gets to the client without
+	queueing up anywhere along the way, from how long frames take to be
+	acked (CLIENT_MESSAGE_ACK) and how fast they go out.
+
+	The round trip is timed from when a frame is encoded to when its ack
+	arrives, so it counts time spent in the send queue, the socket buffers
+	and the network alike. Whatever it is on top of the smallest one seen
+	lately is queueing delay. Bandwidth is estimated from how fast whole
+	frames arrived at the client, and from sends that blocked on a full
+	socket, since both are the link running flat out.
+	Too much queueing delay, or a frame rate the bandwidth can't keep up
+	with, moves a level down the ladder. Little queueing delay, and room in
+	the bandwidth for the level above, moves back up, more slowly.
+
+	Everything but frame_sent() is called from the encode thread.
+*/
+struct RateController
+{
+	std::vector<QualityLevel> levels;
+	uint32_t level			= 0;
+	uint64_t delay_budget_us = 50000;
+	uint64_t last_change_us	= 0;
+
+	// Encoded frames that haven't been acked yet
+	struct FrameRecord
+	{
+		uint64_t sequence;
+		uint64_t bytes;
+		uint64_t encoded_us;
+	};
+	std::deque<FrameRecord> in_flight;
+
+	std::vector<double> frame_bytes; // average encoded size at each level, 0 until it's been used
+	double frame_interval_us = 16667; // between frames when the frame rate isn't capped
+	uint64_t last_encoded_us = 0;
+
+	double bandwidth	   = 0; // bytes a second, 0 until there's a sample
+	double smoothed_rtt_us = 0;
+	uint64_t min_rtt_us	   = UINT64_MAX;
+	uint64_t min_rtt_stamp = 0;
+	uint64_t frames_lost   = 0;
+
+	// How long each frame's send took, written by the send thread
+	std::vector<std::atomic<uint64_t>> send_duration_us;
+
+	RateController()
+	{
+		// don't use this
+	}
+
+	// Levels that need YCoCg fall back to RGB where they can if allow_ycocg is false
+	RateController(uint64_t delay_budget_us, bool allow_ycocg)
+		: delay_budget_us(delay_budget_us)
+	{
+		for(const QualityLevel &quality : QUALITY_LADDER)
+		{
+			QualityLevel rung = quality;
+			if(rung.ycocg && !allow_ycocg)
+			{
+				// Frame rate caps still work without it
+				if(rung.max_fps == 0)
+				{
+					continue;
+				}
+				rung.ycocg		   = false;
+				rung.codec		   = FRAME_CODEC_QOI;
+				rung.relative_size = 0.5f;
+			}
+			levels.push_back(rung);
+		}
+
+		frame_bytes.assign(levels.size(), 0.0);
+		send_duration_us = std::vector<std::atomic<uint64_t>>(RATE_SEND_HISTORY);
+		for(uint32_t i = 0; i < send_duration_us.size(); i++)
+		{
+			send_duration_us[i].store(0);
+		}
+	}
+
+	const QualityLevel &current() const
+	{
+		return levels[level];
+	}
+
+	// A frame at the current level has been encoded to bytes bytes, header and all
+	void frame_encoded(uint64_t sequence, uint64_t bytes, uint64_t now_us)
+	{
+		in_flight.push_back({sequence, bytes, now_us});
+		if(in_flight.size() > RATE_SEND_HISTORY)
+		{
+			in_flight.pop_front();
+		}
+
+		double &average = frame_bytes[level];
+		average			= average == 0 ? bytes : average * 0.9 + bytes * 0.1;
+
+		// Capped frame rates say nothing about how fast the server renders
+		if(last_encoded_us != 0 && current().max_fps == 0)
+		{
+			frame_interval_us = frame_interval_us * 0.9 + (now_us - last_encoded_us) * 0.1;
+		}
+		last_encoded_us = now_us;
+	}
+
+	// Send thread. sequence took duration_us to hand to the kernel
+	void frame_sent(uint64_t sequence, uint64_t duration_us)
+	{
+		send_duration_us[sequence % RATE_SEND_HISTORY].store(duration_us, std::memory_order_relaxed);
+	}
+
+	// The client got sequence, its bytes arriving over receive_us
+	void frame_acked(uint64_t sequence, uint64_t receive_us, uint64_t now_us)
+	{
+		// Acks come in order, so anything before sequence that's still here never made it
+		while(!in_flight.empty() && in_flight.front().sequence < sequence)
+		{
+			frames_lost++;
+			in_flight.pop_front();
+		}
+		if(in_flight.empty() || in_flight.front().sequence != sequence)
+		{
+			return;
+		}
+		FrameRecord frame = in_flight.front();
+		in_flight.pop_front();
+
+		uint64_t rtt_us = now_us - frame.encoded_us;
+		smoothed_rtt_us = smoothed_rtt_us == 0 ? rtt_us : smoothed_rtt_us * 0.875 + rtt_us * 0.125;
+
+		// The smallest round trip of the last 10 seconds, so a route change doesn't stick forever
+		if(rtt_us <= min_rtt_us || now_us - min_rtt_stamp > 10000000)
+		{
+			min_rtt_us	  = rtt_us;
+			min_rtt_stamp = now_us;
+		}
+
+		/*
+			Small frames, or ones that were already sitting in the client's
+			socket buffer, arrive too fast to say anything about the link.
+			Sends only say something when they had to wait for room.
+		*/
+		if(frame.bytes >= 32 * 1024 && receive_us >= 500)
+		{
+			add_bandwidth_sample(frame.bytes * 1000000.0 / receive_us);
+		}
+		uint64_t send_us = send_duration_us[sequence % RATE_SEND_HISTORY].load(std::memory_order_relaxed);
+		if(frame.bytes >= 32 * 1024 && send_us >= 2000)
+		{
+			add_bandwidth_sample(frame.bytes * 1000000.0 / send_us);
+		}
+	}
+
+	void add_bandwidth_sample(double bytes_per_second)
+	{
+		bandwidth = bandwidth == 0 ? bytes_per_second : bandwidth * 0.9 + bytes_per_second * 0.1;
+	}
+
+	/*
+		How long frames are waiting on top of the smallest round trip. A frame
+		that still hasn't been acked counts for as long as it's been waiting,
+		so a stalled link shows up before any ack does.
+	*/
+	uint64_t queue_delay_us(uint64_t now_us) const
+	{
+		if(min_rtt_us == UINT64_MAX)
+		{
+			return 0;
+		}
+
+		uint64_t rtt_us = smoothed_rtt_us;
+		if(!in_flight.empty())
+		{
+			rtt_us = std::max(rtt_us, now_us - in_flight.front().encoded_us);
+		}
+
+		return rtt_us > min_rtt_us ? rtt_us - min_rtt_us : 0;
+	}
+
+	// Expected bytes a second at level i, from its own frames if it's been used, or scaled from the current level's
+	double level_rate(uint32_t i) const
+	{
+		double bytes = frame_bytes[i];
+		if(bytes == 0)
+		{
+			bytes = frame_bytes[level] * levels[i].relative_size / levels[level].relative_size;
+		}
+
+		double interval_us = frame_interval_us;
+		if(levels[i].max_fps != 0)
+		{
+			interval_us = std::max(interval_us, 1000000.0 / levels[i].max_fps);
+		}
+
+		return bytes * 1000000.0 / interval_us;
+	}
+
+	/*
+		Steps down as far as the bandwidth says it has to (at least one
+		level) when frames are queueing, but only ever one level back up.
+		Returns true if the level changed.
+	*/
+	bool update(uint64_t now_us)
+	{
+		uint64_t queue_us	= queue_delay_us(now_us);
+		uint64_t since_us	= now_us - last_change_us;
+		bool over_bandwidth = bandwidth > 0 && level_rate(level) > 0.9 * bandwidth;
+
+		// Give a change a couple of round trips to show up before reacting again, but not so long that a backlog feeds itself
+		uint64_t settle_us = std::min<uint64_t>(250000, std::max<uint64_t>(100000, 2 * smoothed_rtt_us));
+
+		if(level + 1 < levels.size() && (queue_us > delay_budget_us || over_bandwidth) && since_us > settle_us)
+		{
+			uint32_t target = level + 1;
+			while(bandwidth > 0 && target + 1 < levels.size() && level_rate(target) > 0.8 * bandwidth)
+			{
+				target++;
+			}
+
+			level		   = target;
+			last_change_us = now_us;
+			return true;
+		}
+
+		bool room_above = level > 0 && (bandwidth == 0 || level_rate(level - 1) < 0.7 * bandwidth);
+		if(room_above && queue_us < delay_budget_us / 2 && since_us > 1000000)
+		{
+			level--;
+			last_change_us = now_us;
+			return true;
+		}
+
+		return false;
+	}
+
+	void log(uint64_t sequence, bool changed, uint64_t now_us) const
+	{
+		printf("rate control frame %lu: %s%s, %.0f bytes, %.1f Mbit/s estimated, rtt %.1f ms, queue delay %.1f ms, %lu frames never acked\n",
+			   sequence, current().name, changed ? " (changed)" : "", frame_bytes[level], bandwidth * 8 / 1000000.0,
+			   smoothed_rtt_us / 1000.0, queue_delay_us(now_us) / 1000.0, frames_lost);
+	}
+};
+
+
+#endif
@@ -5,4 +5,6 @@ glslc defaultfsquadclient.vert -o vertexfsquadclient.spv
 glslc defaultfsquadclient.frag -o fragmentfsquadclient.spv
 
 glslc defaultserver.vert -o vertexdefaultserver.spv
-glslc defaultserver.frag -o fragmentdefaultserver.spv
\ No newline at end of file
+glslc defaultserver.frag -o fragmentdefaultserver.spv
+glslc rgbpackserver.comp -o computergbserver.spv
+glslc ycocg420server.comp -o computeycocgserver.spv
@@ -2,7 +2,6 @@
 #extension GL_ARB_separate_shader_objects : enable
 
 layout(location = 0) in vec2 quad_uv;
-layout(location = 1) in vec2 server_quad_uv;
 
 layout(location = 0) out vec4 out_colour;
 
@@ -11,29 +10,158 @@ layout(binding = 0) uniform UBO
 	mat4 model;
 	mat4 view;
 	mat4 projection;
-
-	float x;
-	float y;
-	float width;
-	float height;
 } ubo;
 layout(binding = 1) uniform sampler2D server_frame_sampler;
 layout(binding = 2) uniform sampler2D local_frame_sampler;
+layout(binding = 3) uniform sampler2D server_depth_sampler;
+
+// What's in server_frame_sampler, see ServerFrameUBO
+layout(binding = 4) uniform ServerFrame
+{
+	int format;
+	int foveated;
+	int width;
+	int reproject;
+	ivec4 rect; // where the fovea goes on screen, (x, y, width, height)
+	mat4 reprojection;
+} server_frame;
+
+const int FRAME_FORMAT_YCOCG420 = 2;
+const int FOVEATED_LAYERS = 3;
+const int REPROJECTION_STEPS = 3;
 
-float CLIENTFOV = 45.0;
-float SERVERWIDTH = 512.0;
-float CLIENTWIDTH = 1920.0;
+
+// The server frame is raw sRGB bytes in an R8_UNORM image, so the hardware won't decode it for us
+vec3 srgb_to_linear(vec3 c)
+{
+	return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), greaterThan(c, vec3(0.04045)));
+}
+
+// Each server pixel is three consecutive R8 texels
+vec3 fetch_server_pixel(ivec2 pixel)
+{
+	int x = pixel.x * 3;
+	vec3 c = vec3(texelFetch(server_frame_sampler, ivec2(x, pixel.y), 0).r,
+				  texelFetch(server_frame_sampler, ivec2(x + 1, pixel.y), 0).r,
+				  texelFetch(server_frame_sampler, ivec2(x + 2, pixel.y), 0).r);
+	return srgb_to_linear(c);
+}
+
+/*
+	YCoCg 4:2:0 frames are a full size Y plane at (0, 0), with the half size
+	Co and Cg planes beside it at (width, 0) and (width, height / 2).
+*/
+vec3 fetch_server_pixel_ycocg(ivec2 pixel)
+{
+	int width = server_frame.width;
+	int height = textureSize(server_frame_sampler, 0).y;
+	ivec2 chroma = pixel / 2;
+
+	float y = texelFetch(server_frame_sampler, pixel, 0).r;
+	float co = texelFetch(server_frame_sampler, ivec2(width + chroma.x, chroma.y), 0).r - 128.0 / 255.0;
+	float cg = texelFetch(server_frame_sampler, ivec2(width + chroma.x, height / 2 + chroma.y), 0).r - 128.0 / 255.0;
+
+	float tmp = y - cg;
+	vec3 c = vec3(tmp + co, y + cg, tmp - co);
+	return srgb_to_linear(clamp(c, 0.0, 1.0));
+}
+
+
+// Size of the full resolution part of the frame, all of it unless it's a foveated atlas. Same as foveated_atlas_width() in protocol.h
+ivec2 fovea_size()
+{
+	int width = server_frame.foveated != 0 ? server_frame.width * 2 / 3 : server_frame.width;
+	return ivec2(width, textureSize(server_frame_sampler, 0).y);
+}
+
+// Where a layer sits in a foveated atlas, as (x, y, width, height). Same as foveated_layer() in protocol.h
+ivec4 foveated_layer(int layer, ivec2 fovea)
+{
+	int scale = 1 << layer;
+	ivec2 corner = ivec2(layer == 0 ? 0 : fovea.x, layer <= 1 ? 0 : fovea.y / 2);
+	return ivec4(corner, fovea / scale);
+}
+
+/*
+	Finds the server pixel that covers frag, trying the sharpest layer
+	first. The fovea fills server_frame.rect, and the other layers are
+	centred on it, each ring's pixels covering scale x scale of the
+	fovea's. A rect that isn't the fovea's size just stretches all of them.
+*/
+bool find_server_pixel(vec2 frag, out ivec2 pixel)
+{
+	ivec2 fovea = fovea_size();
+	vec2 centre = vec2(server_frame.rect.xy) + vec2(server_frame.rect.zw) / 2.0;
+	vec2 from_centre = (frag - centre) * vec2(fovea) / vec2(server_frame.rect.zw); // in fovea pixels
+	int num_layers = server_frame.foveated != 0 ? FOVEATED_LAYERS : 1;
+
+	for(int layer = 0; layer < num_layers; layer++)
+	{
+		int scale = 1 << layer;
+		ivec4 rect = foveated_layer(layer, fovea);
+
+		// Fovea pixels from the layer's top left corner
+		ivec2 p = ivec2(floor(from_centre + vec2(rect.zw * scale) / 2.0));
+		if(all(greaterThanEqual(p, ivec2(0))) && all(lessThan(p, rect.zw * scale)))
+		{
+			pixel = rect.xy + p / scale;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// Where server pixel p lands once it's moved to the camera as it is now, going by the server's depth there
+vec2 reprojected(vec2 p)
+{
+	vec2 size	= vec2(textureSize(server_depth_sampler, 0));
+	float depth = texelFetch(server_depth_sampler, ivec2(clamp(p, vec2(0.0), size - 1.0)), 0).r;
+	vec4 clip	= server_frame.reprojection * vec4((p + 0.5) / size * 2.0 - 1.0, depth, 1.0);
+	return (clip.xy / clip.w + 1.0) / 2.0 * size - 0.5;
+}
+
+/*
+	Finds the server pixel that lands on pixel once the frame is
+	reprojected. There's only depth for where pixels came from, not where
+	they go, so this starts from pixel itself and moves by however far off
+	each guess landed. That settles in a few steps wherever the depth is
+	smooth. Returns false if it came from outside the frame, which the
+	client's own render has to fill in.
+*/
+bool reproject_server_pixel(ivec2 pixel, out ivec2 source)
+{
+	vec2 target = vec2(pixel);
+	vec2 guess	= target;
+	for(int i = 0; i < REPROJECTION_STEPS; i++)
+	{
+		guess += target - reprojected(guess);
+	}
+
+	source = ivec2(round(guess));
+	return all(greaterThanEqual(source, ivec2(0))) && all(lessThan(source, textureSize(server_depth_sampler, 0)));
+}
 
 
 void main()
 {
-	//vec2 server_quaduv = quad_uv * (CLIENTFOV * (SERVERWIDTH / CLIENTWIDTH));
-	int xmax = (1920 / 2 + (512 / 2));
-	int xmin = (1920 / 2 - (512 / 2));
-	int ymax = (1080 / 2 + (512 / 2));
-	int ymin = (1080 / 2 - (512 / 2));
+	ivec2 pixel;
+
+	// The rings cover the client's own render wherever they reach
+	bool covered = server_frame.rect.z > 0 && server_frame.rect.w > 0 && find_server_pixel(gl_FragCoord.xy, pixel);
+	if(covered && server_frame.reproject != 0)
+	{
+		covered = reproject_server_pixel(pixel, pixel);
+	}
 
-	bool valid_server_pixel = 	gl_FragCoord.x <= xmax && gl_FragCoord.x >= xmin &&
-								gl_FragCoord.y <= ymax && gl_FragCoord.y >= ymin;
-	out_colour = texture(server_frame_sampler, quad_uv) + texture(local_frame_sampler, quad_uv);
-}
\ No newline at end of file
+	if(covered)
+	{
+		vec3 c = server_frame.format == FRAME_FORMAT_YCOCG420 ? fetch_server_pixel_ycocg(pixel) : fetch_server_pixel(pixel);
+		out_colour = vec4(c, 1.0);
+	}
+	else
+	{
+		out_colour = texture(local_frame_sampler, quad_uv);
+	}
+}
@@ -9,6 +9,13 @@ layout(binding = 0) uniform UBO
 	mat4 projection;
 } ubo;
 
+// Which part of the field of view this draw covers, see LayerPushConstants
+layout(push_constant) uniform Layer
+{
+	vec2 clip_scale;
+	vec2 clip_offset;
+} layer;
+
 
 layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec3 in_colour;
@@ -20,6 +27,7 @@ layout(location = 1) out vec2 frag_texcoord;
 void main()
 {
 	gl_Position = ubo.projection * ubo.view * ubo.model * vec4(in_position, 1.0);
+	gl_Position.xy = gl_Position.xy * layer.clip_scale + layer.clip_offset * gl_Position.w;
 	frag_colour = in_colour;
 	frag_texcoord = in_texcoord;
 }
\ No newline at end of file
@@ -0,0 +1,157 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+
+/*
+	Bounded lock-free single producer, single consumer queue.
+	Only meant for small trivially copyable things like slot indices, which
+	is what gets passed between the server's threads.
+	The producer may also steal the oldest item with push_drop_oldest(), so
+	the consumer claims items with a CAS on tail rather than a plain store.
+*/
+template<typename T>
+struct SpscQueue
+{
+	std::vector<std::atomic<T>> items;
+	uint64_t capacity = 0;
+
+	// Kept on separate cache lines, since each one is written by a different thread
+	alignas(64) std::atomic<uint64_t> head; // next index the producer writes
+	alignas(64) std::atomic<uint64_t> tail; // next index the consumer reads
+
+	SpscQueue()
+	{
+		head.store(0);
+		tail.store(0);
+	}
+
+	// Not thread safe, call before either thread starts using the queue
+	void resize(uint32_t num_items)
+	{
+		items	 = std::vector<std::atomic<T>>(num_items);
+		capacity = num_items;
+		head.store(0);
+		tail.store(0);
+	}
+
+	// Producer only. Returns false if the queue is full
+	bool push(T item)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if(h - tail.load(std::memory_order_acquire) == capacity)
+		{
+			return false;
+		}
+
+		items[h % capacity].store(item, std::memory_order_relaxed);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*
+		Producer only. Never fails: if the queue is full, the oldest item is
+		taken off the front to make room and handed back through dropped so
+		the caller can recycle it. Returns true if something was dropped.
+	*/
+	bool push_drop_oldest(T item, T &dropped)
+	{
+		bool was_dropped = false;
+
+		while(!push(item))
+		{
+			// Full, so race the consumer for the oldest item
+			uint64_t t = tail.load(std::memory_order_acquire);
+			T oldest   = items[t % capacity].load(std::memory_order_relaxed);
+			if(tail.compare_exchange_strong(t, t + 1, std::memory_order_acq_rel))
+			{
+				dropped		= oldest;
+				was_dropped = true;
+			}
+		}
+
+		return was_dropped;
+	}
+
+	// Consumer only. Returns false if the queue is empty
+	bool pop(T &item)
+	{
+		uint64_t t = tail.load(std::memory_order_acquire);
+		while(t != head.load(std::memory_order_acquire))
+		{
+			item = items[t % capacity].load(std::memory_order_relaxed);
+
+			// Fails if the producer dropped this item first, in which case t now holds the new tail
+			if(tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	uint64_t size()
+	{
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+};
+
+
+/*
+	Lets a thread sleep until another one has something for it, instead of
+	spinning on an empty queue. The producer calls signal() after it pushes;
+	the consumer checks its queue first and only wait()s if it came up empty.
+	The eventfd counts signals, so one that lands between the check and the
+	wait isn't lost, it just makes the wait return straight away.
+*/
+struct Wakeup
+{
+	int fd = -1;
+
+	void create()
+	{
+		fd = eventfd(0, EFD_NONBLOCK);
+		if(fd == -1)
+		{
+			throw std::runtime_error("Could not create eventfd");
+		}
+	}
+
+	void signal()
+	{
+		uint64_t one = 1;
+		write(fd, &one, sizeof(one));
+	}
+
+	// Returns after a signal, or timeout_ms (-1 for never), whichever comes first
+	void wait(int timeout_ms)
+	{
+		pollfd pfd = {fd, POLLIN, 0};
+		if(poll(&pfd, 1, timeout_ms) > 0)
+		{
+			uint64_t count;
+			read(fd, &count, sizeof(count));
+		}
+	}
+
+	void destroy()
+	{
+		if(fd != -1)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+};
+
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef TILE_DELTA_H
+#define TILE_DELTA_H
+
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <vector>
+
+#include "protocol.h"
+#include "utils.h"
+
+
+/*
+	Tile hashes, for telling whether a tile changed since the last frame.
+	Hashing reads every pixel once, where comparing against a copy of the
+	last frame would read two frames and have to keep one around.
+	row_bytes is how many bytes of each row belong to the tile.
+*/
+typedef uint64_t (*TileHashFn)(const uint8_t *pixels, size_t row_pitch, size_t row_bytes, uint32_t height);
+
+
+// FNV-1a over 8 bytes at a time, for CPUs without SSE4.2
+uint64_t hash_tile_scalar(const uint8_t *pixels, size_t row_pitch, size_t row_bytes, uint32_t height)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+
+	for(uint32_t y = 0; y < height; y++)
+	{
+		const uint8_t *row = pixels + y * row_pitch;
+
+		size_t i = 0;
+		for(; i + 8 <= row_bytes; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, row + i, 8);
+			hash = (hash ^ word) * 0x100000001B3ull;
+		}
+		for(; i < row_bytes; i++)
+		{
+			hash = (hash ^ row[i]) * 0x100000001B3ull;
+		}
+	}
+
+	return hash;
+}
+
+/*
+	Two CRC32C chains over alternating 8 byte words, put together into 64 bits.
+	Besides halving the odds of a collision, two independent chains keep the
+	crc32 unit busy, since each crc32 has to wait on the last one in its chain.
+*/
+__attribute__((target("sse4.2"))) uint64_t hash_tile_crc32c(const uint8_t *pixels, size_t row_pitch, size_t row_bytes, uint32_t height)
+{
+	uint64_t a = 0xFFFFFFFF;
+	uint64_t b = 0x9E3779B9;
+
+	for(uint32_t y = 0; y < height; y++)
+	{
+		const uint8_t *row = pixels + y * row_pitch;
+		size_t num_bytes   = row_bytes;
+
+		size_t i = 0;
+		for(; i + 16 <= num_bytes; i += 16)
+		{
+			uint64_t word_a, word_b;
+			memcpy(&word_a, row + i, 8);
+			memcpy(&word_b, row + i + 8, 8);
+			a = _mm_crc32_u64(a, word_a);
+			b = _mm_crc32_u64(b, word_b);
+		}
+		for(; i + 4 <= num_bytes; i += 4)
+		{
+			uint32_t word;
+			memcpy(&word, row + i, 4);
+			a = _mm_crc32_u32((uint32_t) a, word);
+		}
+		// RGB rows can end partway through a word
+		for(; i < num_bytes; i++)
+		{
+			a = _mm_crc32_u8((uint32_t) a, row[i]);
+		}
+	}
+
+	return (a << 32) | (uint32_t) b;
+}
+
+TileHashFn best_tile_hash()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2") ? hash_tile_crc32c : hash_tile_scalar;
+}
+
+
+/*
+	Turns readback frames into FRAME_FORMAT_RGB8_TILES payloads, with only
+	the tiles whose hash changed since the last frame. Frames are either
+	RGBA, or already RGB if they were packed on the GPU.
+	A frame that gets encoded but never sent takes its tiles with it, so those
+	are handed back with resend_tiles() and go out with the next frame no
+	matter what their hash says. Same for every tile of the first frame.
+*/
+struct TileDeltaEncoder
+{
+	TileGrid grid;
+	std::vector<uint64_t> hashes; // of each tile as of the last encoded frame
+	std::vector<uint8_t> resend;  // bitmap of tiles the next frame has to carry
+	TileHashFn hash_tile;
+	bool keyframe = false; // whether the last frame encoded carried every tile
+
+	TileDeltaEncoder()
+	{
+		// don't use this
+	}
+
+	TileDeltaEncoder(uint32_t width, uint32_t height)
+	{
+		grid	  = TileGrid(width, height);
+		hash_tile = best_tile_hash();
+		hashes.assign(grid.num_tiles(), 0);
+		force_keyframe();
+	}
+
+	// Next frame carries every tile
+	void force_keyframe()
+	{
+		resend.assign(grid.bitmap_size(), 0xFF);
+	}
+
+	// bitmap is from a payload that was dropped before it was sent
+	void resend_tiles(const uint8_t *bitmap)
+	{
+		for(size_t i = 0; i < resend.size(); i++)
+		{
+			resend[i] |= bitmap[i];
+		}
+	}
+
+	/*
+		pixels is RGBA if bytes_per_pixel is 4, or RGB if it's 3. bgra is passed
+		on to rgba_to_rgb_strided for 4 byte pixels. out needs grid.max_payload_size() bytes. Returns the payload size
+	*/
+	size_t encode(const uint8_t *pixels, size_t row_pitch, uint32_t bytes_per_pixel, bool bgra, uint8_t *out)
+	{
+		uint8_t *bitmap = out;
+		uint8_t *tiles	= out + grid.bitmap_size();
+		memset(bitmap, 0, grid.bitmap_size());
+		uint32_t num_sent = 0;
+
+		for(uint32_t tile = 0; tile < grid.num_tiles(); tile++)
+		{
+			uint32_t x, y, w, h;
+			grid.tile_rect(tile, x, y, w, h);
+
+			const uint8_t *tile_pixels = pixels + y * row_pitch + x * bytes_per_pixel;
+			uint64_t hash			   = hash_tile(tile_pixels, row_pitch, (size_t) w * bytes_per_pixel, h);
+			if(hash == hashes[tile] && !tile_bit(resend.data(), tile))
+			{
+				continue;
+			}
+
+			hashes[tile] = hash;
+			set_tile_bit(bitmap, tile);
+			num_sent++;
+			if(bytes_per_pixel == 4)
+			{
+				rgba_to_rgb_strided(tile_pixels, row_pitch, tiles, w * 3, w, h, bgra);
+			}
+			else
+			{
+				for(uint32_t row = 0; row < h; row++)
+				{
+					memcpy(tiles + row * w * 3, tile_pixels + row * row_pitch, w * 3);
+				}
+			}
+			tiles += w * h * 3;
+		}
+
+		std::fill(resend.begin(), resend.end(), 0);
+		keyframe = num_sent == grid.num_tiles();
+		return tiles - out;
+	}
+};
+
+
+#endif
@@ -0,0 +1,179 @@
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <vector>
+
+#include "protocol.h"
+#include "udp_transport.h"
+
+
+/*
+	Sends frames through UdpFrameSender and UdpFrameReceiver over loopback,
+	with the sender's --loss-rate dropping packets, and checks that every
+	frame that comes out is byte for byte the one that went in. Also feeds
+	the receiver hand made packets to check that bad ones can't get a frame
+	rebuilt from bytes that never arrived.
+	Usage: ./udp_loopback [frames payload_bytes]
+*/
+struct LoopbackResult
+{
+	uint32_t received;
+	uint32_t lost;
+	uint32_t corrupt;
+};
+
+
+FrameHeader make_header(uint64_t sequence, size_t payload_size)
+{
+	FrameHeader header		   = {};
+	header.magic			   = FRAME_MAGIC;
+	header.version			   = FRAME_PROTOCOL_VERSION;
+	header.header_size		   = FRAME_HEADER_SIZE;
+	header.sequence			   = sequence;
+	header.server_timestamp_us = timestamp_us();
+	header.format			   = FRAME_FORMAT_RGB8;
+	header.codec			   = FRAME_CODEC_RAW;
+	header.payload_size		   = payload_size;
+	return header;
+}
+
+
+LoopbackResult run_loopback(uint32_t num_frames, size_t payload_size, uint32_t fec_group, double loss_rate)
+{
+	UdpFrameReceiver receiver(0);
+	sockaddr_in address = {
+		.sin_family = AF_INET,
+		.sin_port	= htons(receiver.port()),
+	};
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	UdpFrameSender sender(address, fec_group, loss_rate);
+
+	std::vector<uint8_t> payload(payload_size);
+	std::vector<uint8_t> out(payload_size);
+	std::vector<uint8_t> compressed(payload_size);
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	LoopbackResult result = {0, 0, 0};
+
+	for(uint64_t sequence = 1; sequence <= num_frames; sequence++)
+	{
+		for(size_t i = 0; i < payload.size(); i++)
+		{
+			payload[i] = rand();
+		}
+		encode_frame_header(make_header(sequence, payload_size), header_bytes);
+		sender.send_frame(sequence, header_bytes, payload.data(), payload.size(), FRAME_CODEC_RAW);
+
+		FrameHeader header;
+		if(!receiver.receive_frame(header, out.data(), out.size(), compressed.data(), compressed.size(), 50))
+		{
+			result.lost++;
+			continue;
+		}
+
+		result.received++;
+		if(header.sequence != sequence || header.payload_size != payload_size || out != payload)
+		{
+			result.corrupt++;
+		}
+	}
+
+	sender.destroy();
+	receiver.destroy();
+	return result;
+}
+
+
+/*
+	One group of 4 data packets and its parity. Data packet 1 first shows up
+	cut short, packet 2 never does. The short packet mustn't count, so the
+	frame can't finish until the real packet 1 arrives, and then packet 2 is
+	rebuilt from the parity.
+*/
+bool check_bad_packet_recovery()
+{
+	const uint32_t fec_group = 4;
+	size_t payload_size		 = fec_group * UDP_PACKET_DATA - FRAME_HEADER_SIZE;
+	std::vector<uint8_t> frame_bytes(FRAME_HEADER_SIZE + payload_size);
+	encode_frame_header(make_header(1, payload_size), frame_bytes.data());
+	for(size_t i = FRAME_HEADER_SIZE; i < frame_bytes.size(); i++)
+	{
+		frame_bytes[i] = rand();
+	}
+
+	std::vector<uint8_t> parity(UDP_PACKET_DATA, 0);
+	for(uint32_t index = 0; index < fec_group; index++)
+	{
+		xor_bytes(parity.data(), frame_bytes.data() + (size_t) index * UDP_PACKET_DATA, UDP_PACKET_DATA);
+	}
+
+	UdpFrameReceiver receiver;
+	std::vector<uint8_t> out(payload_size);
+	UdpPacketHeader packet_header = {
+		.frame_id	 = 1,
+		.frame_bytes = (uint32_t) frame_bytes.size(),
+		.index		 = 0,
+		.num_data	 = (uint16_t) fec_group,
+		.fec_group	 = (uint8_t) fec_group,
+		.codec		 = FRAME_CODEC_RAW,
+	};
+
+	const uint32_t order[] = {0, 1, 3, fec_group};
+	const bool short_one[] = {false, true, false, false};
+	for(uint32_t i = 0; i < 4; i++)
+	{
+		packet_header.index = order[i];
+		const uint8_t *data = order[i] == fec_group ? parity.data() : frame_bytes.data() + (size_t) order[i] * UDP_PACKET_DATA;
+		if(receiver.add_packet(packet_header, data, short_one[i] ? UDP_PACKET_DATA / 2 : UDP_PACKET_DATA, out.data(), out.size(), nullptr, 0))
+		{
+			printf("frame finished with a short packet standing in for a real one\n");
+			return false;
+		}
+	}
+
+	packet_header.index = 1;
+	if(!receiver.add_packet(packet_header, frame_bytes.data() + UDP_PACKET_DATA, UDP_PACKET_DATA, out.data(), out.size(), nullptr, 0))
+	{
+		printf("frame didn't finish once the lost packet could be rebuilt\n");
+		return false;
+	}
+
+	bool ok = memcmp(receiver.header_bytes, frame_bytes.data(), FRAME_HEADER_SIZE) == 0 &&
+			  memcmp(out.data(), frame_bytes.data() + FRAME_HEADER_SIZE, payload_size) == 0;
+	if(!ok)
+	{
+		printf("rebuilt frame doesn't match what was sent\n");
+	}
+	return ok;
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t num_frames = argc > 2 ? atoi(argv[1]) : 200;
+	size_t payload_size = argc > 2 ? atoi(argv[2]) : 300 * 1024;
+
+	int failed = !check_bad_packet_recovery();
+	printf("bad packet recovery: %s\n", failed ? "FAILED" : "ok");
+
+	struct
+	{
+		uint32_t fec_group;
+		double loss_rate;
+	} runs[] = {{0, 0.0}, {8, 0.0}, {0, 0.001}, {8, 0.001}, {8, 0.01}};
+
+	printf("%u frames of %zu bytes\n", num_frames, payload_size);
+	printf("%-6s %-8s %10s %10s %10s\n", "fec", "loss", "received", "lost", "corrupt");
+	for(uint32_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+	{
+		LoopbackResult result = run_loopback(num_frames, payload_size, runs[i].fec_group, runs[i].loss_rate);
+		printf("%-6u %-8.3f %10u %10u %10u\n", runs[i].fec_group, runs[i].loss_rate, result.received, result.lost, result.corrupt);
+
+		// Corrupt frames are always a bug. Lost ones only are when nothing was dropped
+		failed |= result.corrupt > 0 || (runs[i].loss_rate == 0.0 && result.lost > 0);
+	}
+
+	return failed;
+}
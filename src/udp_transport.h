@@ -0,0 +1,539 @@
+#ifndef UDP_TRANSPORT_H
+#define UDP_TRANSPORT_H
+
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "protocol.h"
+
+
+/*
+	Frames over UDP, as an alternative to the TCP stream.
+	Over TCP, one lost segment holds up everything behind it until it's
+	retransmitted. Over UDP a lost packet only costs its own frame, and
+	the parity packets usually mean it doesn't even cost that.
+
+	A frame is the same bytes it would be over TCP (the encoded FrameHeader,
+	then the payload), cut into UDP_PACKET_DATA byte data packets. With FEC
+	on, every fec_group data packets are followed by a parity packet, the
+	XOR of them all (short packets count as zero padded), so any one lost
+	packet of a group can be rebuilt from the others.
+	Every packet starts with a UDP_PACKET_HEADER_SIZE byte little endian
+	header:
+	  u64 frame id (the FrameHeader's sequence)
+	  u32 frame bytes (header plus payload)
+	  u16 packet index (data packets first, then one parity packet per group)
+	  u16 number of data packets
+	  u8  fec_group, 0 if there's no parity
+	  u8  codec of the payload, so the receiver knows where to put it
+	  u16 reserved, 0
+*/
+#define UDP_PACKET_HEADER_SIZE 20
+#define UDP_PACKET_DATA 1400 // keeps packets under a 1500 byte MTU, after IP and UDP headers
+#define UDP_PACKET_SIZE (UDP_PACKET_HEADER_SIZE + UDP_PACKET_DATA)
+#define UDP_SEND_BATCH 64 // packets per sendmmsg()
+
+
+struct UdpPacketHeader
+{
+	uint64_t frame_id;
+	uint32_t frame_bytes;
+	uint16_t index;
+	uint16_t num_data;
+	uint8_t fec_group;
+	uint8_t codec;
+};
+
+void encode_udp_packet_header(const UdpPacketHeader &header, uint8_t *out)
+{
+	write_le(out, header.frame_id, 8);
+	write_le(out, header.frame_bytes, 4);
+	write_le(out, header.index, 2);
+	write_le(out, header.num_data, 2);
+	write_le(out, header.fec_group, 1);
+	write_le(out, header.codec, 1);
+	write_le(out, 0, 2);
+}
+
+void decode_udp_packet_header(const uint8_t *in, UdpPacketHeader &header)
+{
+	header.frame_id	   = read_le(in, 8);
+	header.frame_bytes = read_le(in, 4);
+	header.index	   = read_le(in, 2);
+	header.num_data	   = read_le(in, 2);
+	header.fec_group   = read_le(in, 1);
+	header.codec	   = read_le(in, 1);
+}
+
+uint32_t udp_num_groups(uint32_t num_data, uint32_t fec_group)
+{
+	return fec_group == 0 ? 0 : (num_data + fec_group - 1) / fec_group;
+}
+
+void xor_bytes(uint8_t *dst, const uint8_t *src, size_t num_bytes)
+{
+	for(size_t i = 0; i < num_bytes; i++)
+	{
+		dst[i] ^= src[i];
+	}
+}
+
+
+// Big socket buffers, so a whole frame's burst of packets fits without the kernel dropping any
+void set_udp_buffer_sizes(int fd)
+{
+	int size = 8 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+
+/*
+	Server side. Packetizes frames and sends them to one client, in batches
+	of sendmmsg() calls. loss_rate drops that fraction of packets on purpose
+	instead of sending them, to test over loopback.
+*/
+struct UdpFrameSender
+{
+	int socket_fd	   = -1;
+	uint32_t fec_group = 0;
+	double loss_rate   = 0.0;
+	std::mt19937 rng;
+
+	std::vector<uint8_t> packets; // one batch of packets, built here before they go out
+	std::vector<uint8_t> parity;
+
+	UdpFrameSender()
+	{
+		// don't use this
+	}
+
+	// Sends to the client at address, from a new socket
+	UdpFrameSender(sockaddr_in address, uint32_t fec_group, double loss_rate)
+		: fec_group(fec_group), loss_rate(loss_rate), rng(1234)
+	{
+		socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(socket_fd == -1)
+		{
+			throw std::runtime_error("Could not create UDP socket");
+		}
+		set_udp_buffer_sizes(socket_fd);
+
+		if(connect(socket_fd, (sockaddr *) &address, sizeof(address)) == -1)
+		{
+			throw std::runtime_error("Could not connect UDP socket to client");
+		}
+
+		packets.resize(UDP_SEND_BATCH * UDP_PACKET_SIZE);
+		parity.resize(UDP_PACKET_DATA);
+	}
+
+	// Copies bytes [offset, offset + num_bytes) of the frame, header_bytes followed by payload
+	static void read_frame(const uint8_t *header_bytes, const uint8_t *payload, size_t offset, uint8_t *out, size_t num_bytes)
+	{
+		while(num_bytes > 0 && offset < FRAME_HEADER_SIZE)
+		{
+			*out++ = header_bytes[offset++];
+			num_bytes--;
+		}
+		memcpy(out, payload + (offset - FRAME_HEADER_SIZE), num_bytes);
+	}
+
+	/*
+		Sends one frame: header_bytes (FRAME_HEADER_SIZE of them) and payload.
+		Returns false if the client has gone away.
+	*/
+	bool send_frame(uint64_t frame_id, const uint8_t *header_bytes, const uint8_t *payload, size_t payload_size, uint16_t codec)
+	{
+		size_t frame_bytes	= FRAME_HEADER_SIZE + payload_size;
+		uint32_t num_data	= (frame_bytes + UDP_PACKET_DATA - 1) / UDP_PACKET_DATA;
+		uint32_t num_groups = udp_num_groups(num_data, fec_group);
+		std::bernoulli_distribution lost(loss_rate);
+
+		UdpPacketHeader packet_header = {
+			.frame_id	 = frame_id,
+			.frame_bytes = (uint32_t) frame_bytes,
+			.index		 = 0,
+			.num_data	 = (uint16_t) num_data,
+			.fec_group	 = (uint8_t) fec_group,
+			.codec		 = (uint8_t) codec,
+		};
+
+		mmsghdr messages[UDP_SEND_BATCH];
+		iovec iovs[UDP_SEND_BATCH];
+		uint32_t num_batched = 0;
+
+		// Each group's parity packet goes out right after its last data packet
+		uint32_t group_size = fec_group != 0 ? fec_group : num_data;
+		for(uint32_t first = 0, group = 0; first < num_data; first += group_size, group++)
+		{
+			uint32_t last = std::min(first + group_size, num_data);
+			std::fill(parity.begin(), parity.end(), 0);
+
+			for(uint32_t index = first; index <= last; index++)
+			{
+				bool is_parity = index == last;
+				if(is_parity && num_groups == 0)
+				{
+					break;
+				}
+
+				uint8_t *packet	   = packets.data() + num_batched * UDP_PACKET_SIZE;
+				size_t packet_size = UDP_PACKET_HEADER_SIZE;
+
+				if(is_parity)
+				{
+					packet_header.index = num_data + group;
+					memcpy(packet + UDP_PACKET_HEADER_SIZE, parity.data(), UDP_PACKET_DATA);
+					packet_size += UDP_PACKET_DATA;
+				}
+				else
+				{
+					size_t offset	 = (size_t) index * UDP_PACKET_DATA;
+					size_t num_bytes = std::min<size_t>(UDP_PACKET_DATA, frame_bytes - offset);
+					read_frame(header_bytes, payload, offset, packet + UDP_PACKET_HEADER_SIZE, num_bytes);
+					packet_size += num_bytes;
+
+					if(num_groups > 0)
+					{
+						xor_bytes(parity.data(), packet + UDP_PACKET_HEADER_SIZE, num_bytes);
+					}
+					packet_header.index = index;
+				}
+				encode_udp_packet_header(packet_header, packet);
+
+				if(loss_rate > 0.0 && lost(rng))
+				{
+					continue;
+				}
+
+				iovs[num_batched]						 = {packet, packet_size};
+				messages[num_batched]					 = {};
+				messages[num_batched].msg_hdr.msg_iov	 = &iovs[num_batched];
+				messages[num_batched].msg_hdr.msg_iovlen = 1;
+				num_batched++;
+
+				if(num_batched == UDP_SEND_BATCH && !send_batch(messages, num_batched))
+				{
+					return false;
+				}
+			}
+		}
+
+		return send_batch(messages, num_batched);
+	}
+
+	// Sends and empties the batch
+	bool send_batch(mmsghdr *messages, uint32_t &num_batched)
+	{
+		for(uint32_t sent = 0; sent < num_batched;)
+		{
+			int result = sendmmsg(socket_fd, messages + sent, num_batched - sent, 0);
+			if(result == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			// Nobody listening on the other end, as far as ICMP is concerned
+			if(result == -1 && errno == ECONNREFUSED)
+			{
+				num_batched = 0;
+				return false;
+			}
+			// Anything else (a full interface queue, say) is the same as the packets getting lost
+			if(result == -1)
+			{
+				break;
+			}
+			sent += result;
+		}
+
+		num_batched = 0;
+		return true;
+	}
+
+	void destroy()
+	{
+		if(socket_fd != -1)
+		{
+			close(socket_fd);
+			socket_fd = -1;
+		}
+	}
+};
+
+
+/*
+	Client side. Puts packets back together straight into the caller's
+	buffers, rebuilding lost ones from parity where it can. Only one frame
+	is assembled at a time: packets for older frames are ignored, and the
+	first packet of a newer frame gives up on the current one, since it's
+	never going to be shown now anyway.
+*/
+struct UdpFrameReceiver
+{
+	int socket_fd = -1;
+
+	// The frame being put together
+	UdpPacketHeader frame;
+	bool assembling			= false;
+	uint64_t next_frame_id	= 0; // frames before this one have been shown or given up on
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	uint8_t *payload;
+	size_t payload_capacity;
+	std::vector<uint8_t> received; // per packet, data then parity
+	std::vector<uint32_t> missing; // data packets still missing per group
+	std::vector<uint8_t> parity;   // every group's parity packet, once it arrives
+	uint32_t num_missing;
+
+	std::vector<uint8_t> packet;
+	uint64_t frames_lost = 0;
+	uint64_t frame_started_us; // when the frame's first packet arrived
+	uint64_t receive_us;	   // how long the last whole frame took to arrive, first packet to last
+
+	UdpFrameReceiver()
+	{
+		// don't use this
+	}
+
+	// Listens on any free port, see port()
+	UdpFrameReceiver(int)
+	{
+		socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(socket_fd == -1)
+		{
+			throw std::runtime_error("Could not create UDP socket");
+		}
+		set_udp_buffer_sizes(socket_fd);
+
+		sockaddr_in address = {
+			.sin_family = AF_INET,
+			.sin_port	= 0,
+		};
+		if(bind(socket_fd, (sockaddr *) &address, sizeof(address)) == -1)
+		{
+			throw std::runtime_error("Could not bind UDP socket");
+		}
+
+		packet.resize(UDP_PACKET_SIZE);
+	}
+
+	uint16_t port()
+	{
+		sockaddr_in address;
+		socklen_t length = sizeof(address);
+		getsockname(socket_fd, (sockaddr *) &address, &length);
+		return ntohs(address.sin_port);
+	}
+
+	/*
+		Waits up to timeout_ms for a whole frame, writing its header into
+		header and its payload into raw_out if it's uncompressed, or
+		compressed_out if it isn't. Frames too big for their buffer are
+		dropped. Returns false if no frame made it in time.
+	*/
+	bool receive_frame(FrameHeader &header, uint8_t *raw_out, size_t raw_size, uint8_t *compressed_out, size_t compressed_size, int timeout_ms)
+	{
+		uint64_t deadline = timestamp_us() + (uint64_t) timeout_ms * 1000;
+
+		while(true)
+		{
+			int64_t remaining_us = (int64_t) (deadline - timestamp_us());
+			pollfd pfd			 = {socket_fd, POLLIN, 0};
+			if(remaining_us <= 0 || poll(&pfd, 1, (remaining_us + 999) / 1000) <= 0)
+			{
+				// Too late for whatever's half done, the next one will be newer
+				give_up();
+				return false;
+			}
+
+			ssize_t packet_size = recv(socket_fd, packet.data(), packet.size(), MSG_DONTWAIT);
+			if(packet_size < UDP_PACKET_HEADER_SIZE)
+			{
+				continue;
+			}
+
+			UdpPacketHeader packet_header;
+			decode_udp_packet_header(packet.data(), packet_header);
+			if(!add_packet(packet_header, packet.data() + UDP_PACKET_HEADER_SIZE, packet_size - UDP_PACKET_HEADER_SIZE, raw_out, raw_size, compressed_out, compressed_size))
+			{
+				continue;
+			}
+
+			assembling	  = false;
+			next_frame_id = frame.frame_id + 1;
+			receive_us	  = timestamp_us() - frame_started_us;
+			return decode_frame_header(header_bytes, header);
+		}
+	}
+
+	void give_up()
+	{
+		if(assembling)
+		{
+			frames_lost++;
+			next_frame_id = frame.frame_id + 1;
+		}
+		assembling = false;
+	}
+
+	// Returns true once the packet finishes its frame
+	bool add_packet(const UdpPacketHeader &packet_header, const uint8_t *data, size_t num_bytes, uint8_t *raw_out, size_t raw_size, uint8_t *compressed_out, size_t compressed_size)
+	{
+		if(packet_header.frame_id < next_frame_id)
+		{
+			return false;
+		}
+
+		if(!assembling || packet_header.frame_id != frame.frame_id)
+		{
+			give_up();
+			if(!start_frame(packet_header, raw_out, raw_size, compressed_out, compressed_size))
+			{
+				next_frame_id = packet_header.frame_id + 1;
+				frames_lost++;
+				return false;
+			}
+		}
+
+		uint32_t num_groups = udp_num_groups(frame.num_data, frame.fec_group);
+		uint32_t index		= packet_header.index;
+		if(index >= frame.num_data + num_groups || received[index])
+		{
+			return false;
+		}
+
+		// A packet the wrong size can't be trusted, and counting it as received would let recover() XOR in bytes that were never written
+		bool is_parity			= index >= frame.num_data;
+		size_t offset			= (size_t) index * UDP_PACKET_DATA;
+		size_t expected_bytes = is_parity ? UDP_PACKET_DATA : std::min<size_t>(UDP_PACKET_DATA, frame.frame_bytes - offset);
+		if(num_bytes != expected_bytes)
+		{
+			return false;
+		}
+		received[index] = 1;
+
+		if(!is_parity)
+		{
+			write_frame(offset, data, num_bytes);
+			num_missing--;
+			if(num_groups > 0)
+			{
+				missing[index / frame.fec_group]--;
+			}
+		}
+		else
+		{
+			memcpy(parity.data() + (size_t) (index - frame.num_data) * UDP_PACKET_DATA, data, UDP_PACKET_DATA);
+		}
+
+		// One packet short with the parity in hand is as good as complete
+		if(num_groups > 0)
+		{
+			uint32_t group = index < frame.num_data ? index / frame.fec_group : index - frame.num_data;
+			if(missing[group] == 1 && received[frame.num_data + group])
+			{
+				recover(group);
+			}
+		}
+
+		return num_missing == 0;
+	}
+
+	bool start_frame(const UdpPacketHeader &packet_header, uint8_t *raw_out, size_t raw_size, uint8_t *compressed_out, size_t compressed_size)
+	{
+		frame				= packet_header;
+		bool compressed		= frame.codec != FRAME_CODEC_RAW;
+		payload				= compressed ? compressed_out : raw_out;
+		payload_capacity	= compressed ? compressed_size : raw_size;
+		uint32_t num_groups = udp_num_groups(frame.num_data, frame.fec_group);
+
+		if(frame.frame_bytes < FRAME_HEADER_SIZE || frame.frame_bytes - FRAME_HEADER_SIZE > payload_capacity ||
+		   frame.num_data != (frame.frame_bytes + UDP_PACKET_DATA - 1) / UDP_PACKET_DATA)
+		{
+			return false;
+		}
+
+		received.assign(frame.num_data + num_groups, 0);
+		missing.assign(num_groups, frame.fec_group);
+		if(num_groups > 0)
+		{
+			// The last group can be short
+			missing[num_groups - 1] = frame.num_data - (num_groups - 1) * frame.fec_group;
+		}
+		parity.resize((size_t) num_groups * UDP_PACKET_DATA);
+		num_missing		 = frame.num_data;
+		assembling		 = true;
+		frame_started_us = timestamp_us();
+		return true;
+	}
+
+	// The frame's bytes are header_bytes and then payload, same as on the sender's side
+	void write_frame(size_t offset, const uint8_t *data, size_t num_bytes)
+	{
+		while(num_bytes > 0 && offset < FRAME_HEADER_SIZE)
+		{
+			header_bytes[offset++] = *data++;
+			num_bytes--;
+		}
+		memcpy(payload + (offset - FRAME_HEADER_SIZE), data, num_bytes);
+	}
+
+	void xor_frame(size_t offset, uint8_t *out, size_t num_bytes)
+	{
+		for(size_t i = 0; i < num_bytes; i++, offset++)
+		{
+			out[i] ^= offset < FRAME_HEADER_SIZE ? header_bytes[offset] : payload[offset - FRAME_HEADER_SIZE];
+		}
+	}
+
+	// XORs the parity with every packet of the group that did arrive, which leaves the one that didn't
+	void recover(uint32_t group)
+	{
+		uint8_t *rebuilt = parity.data() + (size_t) group * UDP_PACKET_DATA;
+		uint32_t first	 = group * frame.fec_group;
+		uint32_t last	 = std::min<uint32_t>(first + frame.fec_group, frame.num_data);
+		uint32_t lost	 = first;
+
+		for(uint32_t index = first; index < last; index++)
+		{
+			size_t offset = (size_t) index * UDP_PACKET_DATA;
+			if(received[index])
+			{
+				xor_frame(offset, rebuilt, std::min<size_t>(UDP_PACKET_DATA, frame.frame_bytes - offset));
+			}
+			else
+			{
+				lost = index;
+			}
+		}
+
+		size_t offset = (size_t) lost * UDP_PACKET_DATA;
+		write_frame(offset, rebuilt, std::min<size_t>(UDP_PACKET_DATA, frame.frame_bytes - offset));
+		received[lost] = 1;
+		missing[group] = 0;
+		num_missing--;
+	}
+
+	void destroy()
+	{
+		if(socket_fd != -1)
+		{
+			close(socket_fd);
+			socket_fd = -1;
+		}
+	}
+};
+
+
+#endif
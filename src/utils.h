@@ -1,9 +1,14 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
-
+#include <immintrin.h>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 static std::vector<char> parse_shader_file(const std::string &filename)
@@ -27,26 +32,365 @@ static std::vector<char> parse_shader_file(const std::string &filename)
 }
 
 
-void rgba_to_rgb(const uint8_t* __restrict__ in, uint8_t* __restrict__ out, size_t len)
+/*
+	Pixel format conversions between the RGBA8 frames the GPU renders and the
+	RGB8 frames that go over the network. They touch every pixel of every
+	frame on both ends, so each one has explicit SIMD kernels rather than
+	leaning on autovectorization. The widest kernel isn't always the fastest
+	(wide shuffles can cost more than they save), so each conversion is timed
+	once at startup and the fastest one the CPU supports is used. Every kernel
+	handles any number of pixels; whatever doesn't fill a whole vector is
+	finished off by a narrower kernel.
+*/
+typedef void (*PixelConvertFn)(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels);
+
+
+// bgra reads blue, green, red, alpha source pixels and still writes red first
+template <bool bgra = false>
+void rgba_to_rgb_scalar(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		out[i * 3 + 0] = in[i * 4 + (bgra ? 2 : 0)];
+		out[i * 3 + 1] = in[i * 4 + 1];
+		out[i * 3 + 2] = in[i * 4 + (bgra ? 0 : 2)];
+	}
+}
+
+void rgb_to_rgba_scalar(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
 {
-	for(size_t i = 0, j = 0; i < len; i += 4, j += 3)
+	for(size_t i = 0; i < num_pixels; i++)
 	{
-		out[j + 0] = in[i + 0];
-		out[j + 1] = in[i + 1];
-		out[j + 2] = in[i + 2];
+		out[i * 4 + 0] = in[i * 3 + 0];
+		out[i * 4 + 1] = in[i * 3 + 1];
+		out[i * 4 + 2] = in[i * 3 + 2];
+		out[i * 4 + 3] = 255;
 	}
 }
 
 
-void rgb_to_rgba(const uint8_t* __restrict__ in, uint8_t* __restrict__ out, size_t len)
+// 16 pixels at a time: four 4 pixel shuffles, then stitched together into three stores
+template <bool bgra = false>
+__attribute__((target("ssse3"))) void rgba_to_rgb_ssse3(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
 {
-	for(size_t i = 0, j = 0; i < len; i += 4, j+= 3)
+	const __m128i pack = bgra ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+							  : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	size_t i = 0;
+	for(; i + 16 <= num_pixels; i += 16)
 	{
-		out[i + 0] = in[j + 0];
-		out[i + 1] = in[j + 1];
-		out[i + 2] = in[j + 2];
-		out[i + 3] = 255;
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i * 4 + 0)), pack);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i * 4 + 16)), pack);
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i * 4 + 32)), pack);
+		__m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i * 4 + 48)), pack);
+
+		_mm_storeu_si128((__m128i *) (out + i * 3 + 0), _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128((__m128i *) (out + i * 3 + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128((__m128i *) (out + i * 3 + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
 	}
+
+	rgba_to_rgb_scalar<bgra>(in + i * 4, out + i * 3, num_pixels - i);
+}
+
+// 4 pixels at a time. Each load reads 16 bytes for the 12 it uses, so stop while 16 are still there
+__attribute__((target("ssse3"))) void rgb_to_rgba_ssse3(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
+{
+	const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha	 = _mm_set1_epi32(0xFF000000);
+
+	size_t i = 0;
+	for(; i + 6 <= num_pixels; i += 4)
+	{
+		__m128i rgb = _mm_loadu_si128((const __m128i *) (in + i * 3));
+		_mm_storeu_si128((__m128i *) (out + i * 4), _mm_or_si128(_mm_shuffle_epi8(rgb, expand), alpha));
+	}
+
+	rgb_to_rgba_scalar(in + i * 3, out + i * 4, num_pixels - i);
+}
+
+
+/*
+	32 pixels at a time, the SSSE3 kernel run on both 128 bit lanes at once.
+	pshufb only shuffles within a lane, so rather than permuting lanes
+	together afterwards, lane 0 is loaded with the first 16 pixels and lane 1
+	with the next 16. Each lane then comes out as 48 contiguous bytes, and
+	goes out with plain 16 byte stores.
+*/
+template <bool bgra = false>
+__attribute__((target("avx2"))) void rgba_to_rgb_avx2(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
+{
+	const __m256i pack = bgra ? _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+												 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+							  : _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+												 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	size_t i = 0;
+	for(; i + 32 <= num_pixels; i += 32)
+	{
+		const uint8_t *src = in + i * 4;
+		__m256i a		   = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + 0))), _mm_loadu_si128((const __m128i *) (src + 64)), 1);
+		__m256i b		   = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + 16))), _mm_loadu_si128((const __m128i *) (src + 80)), 1);
+		__m256i c		   = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + 32))), _mm_loadu_si128((const __m128i *) (src + 96)), 1);
+		__m256i d		   = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + 48))), _mm_loadu_si128((const __m128i *) (src + 112)), 1);
+		a				   = _mm256_shuffle_epi8(a, pack);
+		b				   = _mm256_shuffle_epi8(b, pack);
+		c				   = _mm256_shuffle_epi8(c, pack);
+		d				   = _mm256_shuffle_epi8(d, pack);
+
+		__m256i out0 = _mm256_or_si256(a, _mm256_slli_si256(b, 12));
+		__m256i out1 = _mm256_or_si256(_mm256_srli_si256(b, 4), _mm256_slli_si256(c, 8));
+		__m256i out2 = _mm256_or_si256(_mm256_srli_si256(c, 8), _mm256_slli_si256(d, 4));
+
+		uint8_t *dst = out + i * 3;
+		_mm_storeu_si128((__m128i *) (dst + 0), _mm256_castsi256_si128(out0));
+		_mm_storeu_si128((__m128i *) (dst + 16), _mm256_castsi256_si128(out1));
+		_mm_storeu_si128((__m128i *) (dst + 32), _mm256_castsi256_si128(out2));
+		_mm_storeu_si128((__m128i *) (dst + 48), _mm256_extracti128_si256(out0, 1));
+		_mm_storeu_si128((__m128i *) (dst + 64), _mm256_extracti128_si256(out1, 1));
+		_mm_storeu_si128((__m128i *) (dst + 80), _mm256_extracti128_si256(out2, 1));
+	}
+
+	rgba_to_rgb_ssse3<bgra>(in + i * 4, out + i * 3, num_pixels - i);
+}
+
+// 8 pixels at a time, 4 per lane. The second lane's load reads 4 bytes past its 12, so stop while they're there
+__attribute__((target("avx2"))) void rgb_to_rgba_avx2(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
+{
+	const __m256i expand = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+											0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i alpha	 = _mm256_set1_epi32(0xFF000000);
+
+	size_t i = 0;
+	for(; i + 10 <= num_pixels; i += 8)
+	{
+		__m256i rgb = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (in + i * 3)));
+		rgb			= _mm256_inserti128_si256(rgb, _mm_loadu_si128((const __m128i *) (in + i * 3 + 12)), 1);
+		_mm256_storeu_si256((__m256i *) (out + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(rgb, expand), alpha));
+	}
+
+	rgb_to_rgba_ssse3(in + i * 3, out + i * 4, num_pixels - i);
+}
+
+
+/*
+	Where each byte of three output vectors comes from, given four input
+	vectors, for the two input permute. Output vector k draws from inputs k
+	and k + 1, and indices past 63 pick the second one.
+*/
+struct RgbPackIndices
+{
+	alignas(64) uint8_t index[3][64];
+
+	RgbPackIndices(bool bgra)
+	{
+		for(uint32_t k = 0; k < 3; k++)
+		{
+			for(uint32_t j = 0; j < 64; j++)
+			{
+				uint32_t byte	= 64 * k + j;
+				uint32_t source = (byte / 3) * 4 + (bgra ? 2 - byte % 3 : byte % 3);
+				index[k][j]		= source - 64 * k;
+			}
+		}
+	}
+};
+
+/*
+	64 pixels at a time: four loads, then three two-source byte permutes fill
+	three whole output vectors, so every store is a full unmasked one. Whatever
+	is left goes 16 pixels at a time through a single permute, and masked
+	loads/stores handle the tail without reading or writing past either buffer.
+*/
+template <bool bgra = false>
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) void rgba_to_rgb_avx512vbmi(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
+{
+	static const RgbPackIndices indices(bgra);
+	const __m512i pack0 = _mm512_load_si512(indices.index[0]);
+	const __m512i pack1 = _mm512_load_si512(indices.index[1]);
+	const __m512i pack2 = _mm512_load_si512(indices.index[2]);
+
+	size_t i = 0;
+	for(; i + 64 <= num_pixels; i += 64)
+	{
+		const uint8_t *src = in + i * 4;
+		__m512i a		   = _mm512_loadu_si512(src + 0);
+		__m512i b		   = _mm512_loadu_si512(src + 64);
+		__m512i c		   = _mm512_loadu_si512(src + 128);
+		__m512i d		   = _mm512_loadu_si512(src + 192);
+
+		uint8_t *dst = out + i * 3;
+		_mm512_storeu_si512(dst + 0, _mm512_permutex2var_epi8(a, pack0, b));
+		_mm512_storeu_si512(dst + 64, _mm512_permutex2var_epi8(b, pack1, c));
+		_mm512_storeu_si512(dst + 128, _mm512_permutex2var_epi8(c, pack2, d));
+	}
+
+	// The first 48 bytes of the first vector's indices only reach into the first input, so they do for 16 pixels too
+	for(; i + 16 <= num_pixels; i += 16)
+	{
+		__m512i rgba = _mm512_loadu_si512(in + i * 4);
+		_mm512_mask_storeu_epi8(out + i * 3, 0xFFFFFFFFFFFFull, _mm512_permutexvar_epi8(pack0, rgba));
+	}
+
+	size_t remaining = num_pixels - i;
+	if(remaining > 0)
+	{
+		__m512i rgba = _mm512_maskz_loadu_epi8((1ull << (remaining * 4)) - 1, in + i * 4);
+		_mm512_mask_storeu_epi8(out + i * 3, (1ull << (remaining * 3)) - 1, _mm512_permutexvar_epi8(pack0, rgba));
+	}
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) void rgb_to_rgba_avx512vbmi(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t num_pixels)
+{
+	// Alpha comes from the 0xFF set in the permuted result, so its indices don't matter
+	const __m512i expand = _mm512_set_epi8(0, 47, 46, 45, 0, 44, 43, 42, 0, 41, 40, 39, 0, 38, 37, 36,
+										   0, 35, 34, 33, 0, 32, 31, 30, 0, 29, 28, 27, 0, 26, 25, 24,
+										   0, 23, 22, 21, 0, 20, 19, 18, 0, 17, 16, 15, 0, 14, 13, 12,
+										   0, 11, 10, 9, 0, 8, 7, 6, 0, 5, 4, 3, 0, 2, 1, 0);
+	const __m512i alpha	 = _mm512_set1_epi32(0xFF000000);
+
+	size_t i = 0;
+	for(; i + 16 <= num_pixels; i += 16)
+	{
+		__m512i rgb = _mm512_maskz_loadu_epi8(0xFFFFFFFFFFFFull, in + i * 3);
+		_mm512_storeu_si512(out + i * 4, _mm512_or_si512(_mm512_permutexvar_epi8(expand, rgb), alpha));
+	}
+
+	size_t remaining = num_pixels - i;
+	if(remaining > 0)
+	{
+		__m512i rgb = _mm512_maskz_loadu_epi8((1ull << (remaining * 3)) - 1, in + i * 3);
+		_mm512_mask_storeu_epi8(out + i * 4, (1ull << (remaining * 4)) - 1, _mm512_or_si512(_mm512_permutexvar_epi8(expand, rgb), alpha));
+	}
+}
+
+
+struct PixelConvertKernels
+{
+	const char *name;
+	PixelConvertFn rgba_to_rgb;
+	PixelConvertFn bgra_to_rgb;
+	PixelConvertFn rgb_to_rgba;
+};
+
+// Every variant this CPU can run, narrowest first. The scalar one always works
+std::vector<PixelConvertKernels> supported_pixel_convert_kernels()
+{
+	std::vector<PixelConvertKernels> kernels;
+	kernels.push_back({"scalar", rgba_to_rgb_scalar<false>, rgba_to_rgb_scalar<true>, rgb_to_rgba_scalar});
+
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		kernels.push_back({"ssse3", rgba_to_rgb_ssse3<false>, rgba_to_rgb_ssse3<true>, rgb_to_rgba_ssse3});
+	}
+	if(__builtin_cpu_supports("avx2"))
+	{
+		kernels.push_back({"avx2", rgba_to_rgb_avx2<false>, rgba_to_rgb_avx2<true>, rgb_to_rgba_avx2});
+	}
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi"))
+	{
+		kernels.push_back({"avx512vbmi", rgba_to_rgb_avx512vbmi<false>, rgba_to_rgb_avx512vbmi<true>, rgb_to_rgba_avx512vbmi});
+	}
+
+	return kernels;
+}
+
+/*
+	Times every supported kernel for each conversion on a frame sized buffer,
+	and puts the fastest of each together. Runs take turns between kernels
+	and only each one's best run counts, so a noisy moment can't single one
+	out. name lists which kernel won each conversion.
+*/
+PixelConvertKernels fastest_pixel_convert_kernels()
+{
+	static std::string name;
+	std::vector<PixelConvertKernels> kernels = supported_pixel_convert_kernels();
+	PixelConvertKernels fastest				 = kernels[0];
+
+	const size_t num_pixels = 512 * 512;
+	std::vector<uint8_t> in(num_pixels * 4, 0x80);
+	std::vector<uint8_t> out(num_pixels * 4);
+
+	PixelConvertFn PixelConvertKernels::*conversions[] = {&PixelConvertKernels::rgba_to_rgb, &PixelConvertKernels::bgra_to_rgb, &PixelConvertKernels::rgb_to_rgba};
+	const char *conversion_names[]					   = {"rgba_to_rgb", "bgra_to_rgb", "rgb_to_rgba"};
+	for(uint32_t c = 0; c < 3; c++)
+	{
+		std::vector<double> best_times(kernels.size(), 1e30);
+		for(uint32_t run = 0; run < 8; run++)
+		{
+			for(uint32_t k = 0; k < kernels.size(); k++)
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				(kernels[k].*conversions[c])(in.data(), out.data(), num_pixels);
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				best_times[k]						  = std::min(best_times[k], elapsed.count());
+			}
+		}
+
+		uint32_t best			= std::min_element(best_times.begin(), best_times.end()) - best_times.begin();
+		fastest.*conversions[c] = kernels[best].*conversions[c];
+		name += std::string(c > 0 ? ", " : "") + conversion_names[c] + " " + kernels[best].name;
+	}
+
+	fastest.name = name.c_str();
+	return fastest;
+}
+
+// Picked once, the first time a conversion runs
+const PixelConvertKernels &pixel_convert_kernels()
+{
+	static const PixelConvertKernels best = fastest_pixel_convert_kernels();
+	return best;
+}
+
+
+/*
+	Converts a width x height image whose rows start in_pitch/out_pitch bytes
+	apart, so padded rows (e.g. a VkSubresourceLayout's rowPitch) are fine on
+	either side. When both sides are tightly packed it's done as one long row.
+	RGB8 frames always go out in red, green, blue order, so BGRA sources
+	(bgra) get swizzled on the way.
+*/
+void rgba_to_rgb_strided(const uint8_t *__restrict__ in, size_t in_pitch, uint8_t *__restrict__ out, size_t out_pitch, size_t width, size_t height, bool bgra = false)
+{
+	PixelConvertFn convert = bgra ? pixel_convert_kernels().bgra_to_rgb : pixel_convert_kernels().rgba_to_rgb;
+	if(in_pitch == width * 4 && out_pitch == width * 3)
+	{
+		convert(in, out, width * height);
+		return;
+	}
+
+	for(size_t y = 0; y < height; y++)
+	{
+		convert(in + y * in_pitch, out + y * out_pitch, width);
+	}
+}
+
+void rgb_to_rgba_strided(const uint8_t *__restrict__ in, size_t in_pitch, uint8_t *__restrict__ out, size_t out_pitch, size_t width, size_t height)
+{
+	PixelConvertFn convert = pixel_convert_kernels().rgb_to_rgba;
+	if(in_pitch == width * 3 && out_pitch == width * 4)
+	{
+		convert(in, out, width * height);
+		return;
+	}
+
+	for(size_t y = 0; y < height; y++)
+	{
+		convert(in + y * in_pitch, out + y * out_pitch, width);
+	}
+}
+
+
+// Tightly packed versions. len is the size of the RGBA side in bytes, for both directions
+void rgba_to_rgb(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t len)
+{
+	pixel_convert_kernels().rgba_to_rgb(in, out, len / 4);
+}
+
+void rgb_to_rgba(const uint8_t *__restrict__ in, uint8_t *__restrict__ out, size_t len)
+{
+	pixel_convert_kernels().rgb_to_rgba(in, out, len / 4);
 }
 
 
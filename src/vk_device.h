@@ -26,6 +26,7 @@ struct VulkanDevice
 		// Don't use this
 	}
 
+	// Pass a VK_NULL_HANDLE surface for a headless device, which doesn't need swapchain support
 	VulkanDevice(VkInstance instance, VkSurfaceKHR surface)
 	{
 		select_physical_device(instance, surface);
@@ -76,7 +77,15 @@ struct VulkanDevice
 
 		VkPhysicalDeviceFeatures device_features = {};
 		device_features.samplerAnisotropy		 = VK_TRUE;
-		VkDeviceCreateInfo logical_device_ci	 = vki::deviceCreateInfo(device_queue_ci.size(), device_queue_ci.data(), required_validation_layers.size(), required_validation_layers.data(), required_device_extensions.size(), required_device_extensions.data(), &device_features);
+		std::vector<const char *> extensions	 = find_device_extensions(surface);
+		VkDeviceCreateInfo logical_device_ci	 = vki::deviceCreateInfo(device_queue_ci.size(), device_queue_ci.data(), required_validation_layers.size(), required_validation_layers.data(), extensions.size(), extensions.data(), &device_features);
+
+		// Timeline semaphores are core in 1.2, but still have to be switched on
+		VkPhysicalDeviceVulkan12Features vulkan12_features = {
+			.sType			   = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+			.timelineSemaphore = VK_TRUE,
+		};
+		logical_device_ci.pNext = &vulkan12_features;
 
 
 		if(vkCreateDevice(physical_device, &logical_device_ci, nullptr, &logical_device) != VK_SUCCESS)
@@ -93,10 +102,10 @@ struct VulkanDevice
 	{
 		QueueFamilyIndices indices = search_queue_families(device, surface);
 
-		bool extensions_supported = check_device_extensions_supported(device);
+		bool extensions_supported = check_device_extensions_supported(device, surface);
 
-		bool swapchain_supported = false;
-		if(extensions_supported)
+		bool swapchain_supported = surface == VK_NULL_HANDLE;
+		if(extensions_supported && surface != VK_NULL_HANDLE)
 		{
 			SwapChainSupportDetails swapchain_support_details = query_swapchain_support(device, surface);
 			swapchain_supported								  = !swapchain_support_details.formats.empty() && !swapchain_support_details.present_modes.empty();
@@ -105,10 +114,29 @@ struct VulkanDevice
 		VkPhysicalDeviceFeatures features_supported;
 		vkGetPhysicalDeviceFeatures(device, &features_supported);
 
-		return indices.qf_completed() && extensions_supported && swapchain_supported && features_supported.samplerAnisotropy;
+		VkPhysicalDeviceVulkan12Features vulkan12_features_supported = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+		};
+		VkPhysicalDeviceFeatures2 features2_supported = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &vulkan12_features_supported,
+		};
+		vkGetPhysicalDeviceFeatures2(device, &features2_supported);
+
+		return indices.qf_completed() && extensions_supported && swapchain_supported && features_supported.samplerAnisotropy && vulkan12_features_supported.timelineSemaphore;
 	}
 
-	bool check_device_extensions_supported(VkPhysicalDevice device)
+	std::vector<const char *> find_device_extensions(VkSurfaceKHR surface)
+	{
+		if(surface == VK_NULL_HANDLE)
+		{
+			return std::vector<const char *>();
+		}
+
+		return required_device_extensions;
+	}
+
+	bool check_device_extensions_supported(VkPhysicalDevice device, VkSurfaceKHR surface)
 	{
 		uint32_t num_extensions;
 		vkEnumerateDeviceExtensionProperties(device, nullptr, &num_extensions, nullptr);
@@ -116,7 +144,8 @@ struct VulkanDevice
 		std::vector<VkExtensionProperties> available_extensions(num_extensions);
 		vkEnumerateDeviceExtensionProperties(device, nullptr, &num_extensions, available_extensions.data());
 
-		std::set<std::string> required_extensions(required_device_extensions.begin(), required_device_extensions.end());
+		std::vector<const char *> device_extensions = find_device_extensions(surface);
+		std::set<std::string> required_extensions(device_extensions.begin(), device_extensions.end());
 
 		for(VkExtensionProperties extension : available_extensions)
 		{
@@ -167,13 +196,19 @@ struct VulkanDevice
 };
 
 
-std::vector<const char *> find_required_extensions()
+// Headless instances don't have a window, so they don't need GLFW's surface extensions
+std::vector<const char *> find_required_extensions(bool headless = false)
 {
-	uint32_t glfw_extension_count = 0;
-	const char **glfw_extensions;
-	glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+	std::vector<const char *> extensions;
 
-	std::vector<const char *> extensions(glfw_extensions, glfw_extensions + glfw_extension_count);
+	if(!headless)
+	{
+		uint32_t glfw_extension_count = 0;
+		const char **glfw_extensions;
+		glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+
+		extensions = std::vector<const char *>(glfw_extensions, glfw_extensions + glfw_extension_count);
+	}
 
 	if(ENABLE_VALIDATION_LAYERS)
 	{
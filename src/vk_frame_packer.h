@@ -0,0 +1,203 @@
+#ifndef VK_FRAME_PACKER_H
+#define VK_FRAME_PACKER_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "utils.h"
+#include "vk_device.h"
+#include "vk_image.h"
+#include "vk_initializers.h"
+#include "vk_readback.h"
+#include "vk_shaders.h"
+
+
+// Matches the push constant block of the packing compute shaders
+struct FramePackPushConstants
+{
+	uint32_t width;
+	uint32_t height;
+};
+
+
+/*
+	Compute pass that packs a rendered frame into its transport format on
+	the GPU, writing straight into the frame's readback slot instead of it
+	being copied back as RGBA. Fewer bytes cross the bus, and the CPU has
+	nothing left to convert.
+	Like the readback ring, there's one descriptor set per swapchain image,
+	which reads image i and writes slot i.
+*/
+struct GpuFramePacker
+{
+	VkDescriptorSetLayout descriptor_set_layout;
+	VkDescriptorPool descriptor_pool;
+	std::vector<VkDescriptorSet> descriptor_sets;
+	VkPipelineLayout pipeline_layout;
+	VkPipeline pipeline;
+	VkSampler sampler;
+	uint32_t pixels_per_invocation_x; // how many pixels each invocation packs, from the shader
+	uint32_t pixels_per_invocation_y;
+
+	GpuFramePacker()
+	{
+		// don't use this
+	}
+
+	/*
+		shader_path is a compute shader with an 8x8 workgroup, a sampler2D at binding 0 and a
+		uint[] storage buffer at binding 1, where each invocation packs a block of
+		pixels_per_invocation_x by pixels_per_invocation_y pixels.
+	*/
+	GpuFramePacker(VulkanDevice device, const std::string &shader_path, uint32_t pixels_per_invocation_x, uint32_t pixels_per_invocation_y,
+				   const std::vector<VkImageView> &image_views, const ReadbackRing &readback_ring)
+		: pixels_per_invocation_x(pixels_per_invocation_x), pixels_per_invocation_y(pixels_per_invocation_y)
+	{
+		VkDescriptorSetLayoutBinding bindings[] = {
+			vki::descriptorSetLayoutBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr),
+			vki::descriptorSetLayoutBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr),
+		};
+		VkDescriptorSetLayoutCreateInfo descriptor_set_layout_ci = vki::descriptorSetLayoutCreateInfo(2, bindings);
+		if(vkCreateDescriptorSetLayout(device.logical_device, &descriptor_set_layout_ci, nullptr, &descriptor_set_layout) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not create frame packer descriptor set layout");
+		}
+
+		VkPushConstantRange push_constant_range = {
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+			.offset		= 0,
+			.size		= sizeof(FramePackPushConstants),
+		};
+		VkPipelineLayoutCreateInfo pipeline_layout_ci = vki::pipelineLayoutCreateInfo(1, &descriptor_set_layout, 1, &push_constant_range);
+		if(vkCreatePipelineLayout(device.logical_device, &pipeline_layout_ci, nullptr, &pipeline_layout) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not create frame packer pipeline layout");
+		}
+
+		std::vector<char> shader_code = parse_shader_file(shader_path);
+		VkShaderModule shader_module  = setup_shader_module(shader_code, device);
+
+		VkComputePipelineCreateInfo pipeline_ci = {
+			.sType	= VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+			.stage	= vki::pipelineShaderStageCreateInfo(VK_SHADER_STAGE_COMPUTE_BIT, shader_module),
+			.layout = pipeline_layout,
+		};
+		if(vkCreateComputePipelines(device.logical_device, VK_NULL_HANDLE, 1, &pipeline_ci, nullptr, &pipeline) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not create frame packer pipeline");
+		}
+		vkDestroyShaderModule(device.logical_device, shader_module, nullptr);
+
+		// Only ever texelFetch'ed
+		VkSamplerCreateInfo sampler_ci = {
+			.sType		  = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+			.magFilter	  = VK_FILTER_NEAREST,
+			.minFilter	  = VK_FILTER_NEAREST,
+			.mipmapMode	  = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+			.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+			.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+			.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+			.maxLod		  = 1.0f,
+		};
+		if(vkCreateSampler(device.logical_device, &sampler_ci, nullptr, &sampler) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not create frame packer sampler");
+		}
+
+		uint32_t num_sets				 = image_views.size();
+		VkDescriptorPoolSize poolsizes[] = {
+			vki::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_sets),
+			vki::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, num_sets),
+		};
+		VkDescriptorPoolCreateInfo pool_ci = vki::descriptorPoolCreateInfo(num_sets, 2, poolsizes);
+		if(vkCreateDescriptorPool(device.logical_device, &pool_ci, nullptr, &descriptor_pool) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not create frame packer descriptor pool");
+		}
+
+		std::vector<VkDescriptorSetLayout> layouts(num_sets, descriptor_set_layout);
+		descriptor_sets.resize(num_sets);
+		VkDescriptorSetAllocateInfo set_ai = vki::descriptorSetAllocateInfo(descriptor_pool, num_sets, layouts.data());
+		if(vkAllocateDescriptorSets(device.logical_device, &set_ai, descriptor_sets.data()) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not allocate frame packer descriptor sets");
+		}
+
+		for(uint32_t i = 0; i < num_sets; i++)
+		{
+			VkDescriptorImageInfo image_info   = vki::descriptorImageInfo(sampler, image_views[i], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+			VkDescriptorBufferInfo buffer_info = vki::descriptorBufferInfo(readback_ring.slots[i].buffer, 0, readback_ring.slot_size);
+
+			VkWriteDescriptorSet write_descriptor_sets[] = {
+				vki::writeDescriptorSet(descriptor_sets[i], 0, 0, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &image_info),
+				vki::writeDescriptorSet(descriptor_sets[i], 1, 0, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &buffer_info),
+			};
+			vkUpdateDescriptorSets(device.logical_device, 2, write_descriptor_sets, 0, nullptr);
+		}
+	}
+
+	/*
+		Record packing image (swapchain image index) into readback slot index, after the renderpass.
+		layout is the layout the renderpass left the image in, and it gets put back into it afterwards.
+	*/
+	void record(VulkanDevice device, VkCommandPool command_pool, VkCommandBuffer cmdbuf, uint32_t index, VkImage image, VkImageLayout layout, VkExtent2D extent, const ReadbackRing &readback_ring)
+	{
+		transition_image_layout(device, command_pool, cmdbuf,
+								image,
+								VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+								VK_ACCESS_SHADER_READ_BIT,
+								layout,
+								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+								VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+								VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+		FramePackPushConstants push_constants = {extent.width, extent.height};
+
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+		vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout, 0, 1, &descriptor_sets[index], 0, nullptr);
+		vkCmdPushConstants(cmdbuf, pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
+
+		// 8x8 invocations per workgroup
+		uint32_t invocations_x = extent.width / pixels_per_invocation_x;
+		uint32_t invocations_y = extent.height / pixels_per_invocation_y;
+		vkCmdDispatch(cmdbuf, (invocations_x + 7) / 8, (invocations_y + 7) / 8, 1);
+
+		// Make the packed frame visible to the host once the timeline semaphore signals
+		VkBufferMemoryBarrier buffer_barrier = {
+			.sType				 = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+			.srcAccessMask		 = VK_ACCESS_SHADER_WRITE_BIT,
+			.dstAccessMask		 = VK_ACCESS_HOST_READ_BIT,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.buffer				 = readback_ring.slots[index].buffer,
+			.offset				 = 0,
+			.size				 = VK_WHOLE_SIZE,
+		};
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_barrier, 0, nullptr);
+
+		transition_image_layout(device, command_pool, cmdbuf,
+								image,
+								VK_ACCESS_SHADER_READ_BIT,
+								0,
+								VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+								layout,
+								VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+								VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+	}
+
+	void destroy(VkDevice device)
+	{
+		vkDestroyDescriptorPool(device, descriptor_pool, nullptr);
+		vkDestroySampler(device, sampler, nullptr);
+		vkDestroyPipeline(device, pipeline, nullptr);
+		vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+		vkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+	}
+};
+
+
+#endif
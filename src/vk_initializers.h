@@ -73,6 +73,17 @@ namespace vki
 		return rect_2D;
 	}
 
+	inline VkPipelineDynamicStateCreateInfo pipelineDynamicStateCreateInfo(const VkDynamicState *pDynamicStates, uint32_t dynamicStateCount)
+	{
+		VkPipelineDynamicStateCreateInfo pipeline_dynamic_state_create_info = {
+			.sType			   = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+			.dynamicStateCount = dynamicStateCount,
+			.pDynamicStates	   = pDynamicStates,
+		};
+
+		return pipeline_dynamic_state_create_info;
+	}
+
 
 	//////////////////// VERTEX INPUT
 	inline VkVertexInputBindingDescription vertexInputBindingDescription(uint32_t binding, uint32_t stride, VkVertexInputRate inputRate)
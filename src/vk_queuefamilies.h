@@ -34,12 +34,20 @@ QueueFamilyIndices search_queue_families(VkPhysicalDevice device, VkSurfaceKHR s
 			indices.graphics_qf = queue_index;
 		}
 
-		VkBool32 present_support = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, queue_index, surface, &present_support);
-
-		if(present_support)
+		// Headless has nothing to present to, so "present" just goes through the graphics queue
+		if(surface == VK_NULL_HANDLE)
+		{
+			indices.present_qf = indices.graphics_qf;
+		}
+		else
 		{
-			indices.present_qf = queue_index;
+			VkBool32 present_support = false;
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, queue_index, surface, &present_support);
+
+			if(present_support)
+			{
+				indices.present_qf = queue_index;
+			}
 		}
 
 		if(indices.qf_completed())
@@ -0,0 +1,330 @@
+#ifndef VK_READBACK_H
+#define VK_READBACK_H
+
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include "spsc_queue.h"
+#include "vk_buffers.h"
+#include "vk_device.h"
+#include "vk_image.h"
+#include "vk_initializers.h"
+
+
+/*
+	One persistently mapped readback buffer. timeline_value is the value the
+	readback ring's timeline semaphore reaches once the frame copied into it
+	has landed. timestamp_us, the pose and the camera are filled in by the
+	renderer when it submits the frame, so they can travel with the pixels.
+	Rings that read back depth too have a second buffer per slot for it.
+*/
+struct ReadbackSlot
+{
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	uint8_t *data;
+	uint64_t timeline_value;
+	uint64_t timestamp_us;
+	uint64_t pose_id; // camera pose the frame was rendered with, 0 if none
+	glm::mat4 view;
+	glm::mat4 projection;
+	VkBuffer depth_buffer;
+	VkDeviceMemory depth_memory;
+	uint8_t *depth_data;
+};
+
+
+/*
+	Ring of readback slots, one per swapchain (or offscreen) image, so getting a frame back
+	to the CPU doesn't allocate anything or idle the whole queue.
+	The copy itself is recorded into the frame's own command buffer with
+	record_copy(), and completion is tracked with a single timeline semaphore,
+	so the thread reading a slot can wait on frame N while frame N+1 renders.
+*/
+struct ReadbackRing
+{
+	std::vector<ReadbackSlot> slots;
+	std::vector<std::atomic<bool>> busy; // set while a slot's frame hasn't been consumed yet
+	Wakeup released;					 // signalled whenever a slot stops being busy
+	VkSemaphore timeline;
+	VkDeviceSize row_pitch; // bytes between the starts of two rows in a slot
+	VkDeviceSize slot_size;
+	VkDeviceSize depth_size; // 0 if depth isn't read back
+	bool host_cached;
+
+	ReadbackRing()
+	{
+		// don't use this
+	}
+
+	/*
+		Slots hold an RGBA copy of the frame by default. Frames packed by a
+		GpuFramePacker have bytes_per_pixel rows, or packed_size bytes all
+		up if the format isn't just rows of pixels.
+		With depth, each slot also gets the frame's 16 bit depth buffer, see record_depth_copy().
+	*/
+	ReadbackRing(VulkanDevice device, uint32_t num_slots, VkExtent2D extent, uint32_t bytes_per_pixel = 4, VkDeviceSize packed_size = 0, bool depth = false)
+	{
+		// Buffer copies and the packers lay rows out however we ask, so this is just tight
+		row_pitch	= extent.width * bytes_per_pixel;
+		slot_size	= packed_size != 0 ? packed_size : row_pitch * extent.height;
+		depth_size	= depth ? (VkDeviceSize) extent.width * extent.height * sizeof(uint16_t) : 0;
+		host_cached = memory_type_available(device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+
+		// Cached memory makes the CPU side reads much faster, but isn't guaranteed to be coherent
+		VkMemoryPropertyFlags properties = host_cached ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+													   : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+		slots.resize(num_slots);
+		busy = std::vector<std::atomic<bool>>(num_slots);
+		released.create();
+
+		for(uint32_t i = 0; i < slots.size(); i++)
+		{
+			create_buffer(device, slot_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, properties, slots[i].buffer, slots[i].memory);
+
+			// Stays mapped for the lifetime of the ring
+			if(vkMapMemory(device.logical_device, slots[i].memory, 0, VK_WHOLE_SIZE, 0, (void **) &slots[i].data) != VK_SUCCESS)
+			{
+				throw std::runtime_error("Could not map readback buffer");
+			}
+
+			slots[i].depth_data = nullptr;
+			if(depth_size != 0)
+			{
+				create_buffer(device, depth_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties, slots[i].depth_buffer, slots[i].depth_memory);
+				if(vkMapMemory(device.logical_device, slots[i].depth_memory, 0, VK_WHOLE_SIZE, 0, (void **) &slots[i].depth_data) != VK_SUCCESS)
+				{
+					throw std::runtime_error("Could not map depth readback buffer");
+				}
+			}
+
+			slots[i].timeline_value = 0;
+			slots[i].timestamp_us	= 0;
+			slots[i].pose_id		= 0;
+			slots[i].view			= glm::mat4(1.0f);
+			slots[i].projection		= glm::mat4(1.0f);
+			busy[i].store(false);
+		}
+
+		VkSemaphoreTypeCreateInfo semaphore_type_ci = {
+			.sType		   = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+			.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+			.initialValue  = 0,
+		};
+		VkSemaphoreCreateInfo semaphore_ci = vki::semaphoreCreateInfo();
+		semaphore_ci.pNext				   = &semaphore_type_ci;
+
+		if(vkCreateSemaphore(device.logical_device, &semaphore_ci, nullptr, &timeline) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Could not create readback timeline semaphore");
+		}
+	}
+
+	bool memory_type_available(VulkanDevice device, VkMemoryPropertyFlags properties)
+	{
+		VkPhysicalDeviceMemoryProperties memprops;
+		vkGetPhysicalDeviceMemoryProperties(device.physical_device, &memprops);
+
+		for(uint32_t i = 0; i < memprops.memoryTypeCount; i++)
+		{
+			if((memprops.memoryTypes[i].propertyFlags & properties) == properties)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/*
+		Record the copy of src_image into a slot at the end of a frame's command buffer, after its renderpass.
+		Only for RGBA slots, packed ones are written by GpuFramePacker::record() instead.
+		src_layout is the layout the renderpass left the image in, and it gets put back into it afterwards.
+	*/
+	void record_copy(VulkanDevice device, VkCommandPool command_pool, VkCommandBuffer cmdbuf, uint32_t slot, VkImage src_image, VkImageLayout src_layout, VkExtent2D extent)
+	{
+		// Transition to the transfer source layout. Offscreen images are already in it, but still need the barrier
+		transition_image_layout(device, command_pool, cmdbuf,
+								src_image,
+								VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+								VK_ACCESS_TRANSFER_READ_BIT,
+								src_layout,
+								VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+								VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+								VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+		// Rows land row_pitch bytes apart. bufferRowLength is in texels
+		VkBufferImageCopy copy_region = {
+			.bufferOffset	   = 0,
+			.bufferRowLength   = (uint32_t) (row_pitch / sizeof(uint32_t)),
+			.bufferImageHeight = 0,
+			.imageSubresource  = vki::imageSubresourceLayers(VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1),
+			.imageOffset	   = {0, 0, 0},
+			.imageExtent	   = {extent.width, extent.height, 1},
+		};
+
+		vkCmdCopyImageToBuffer(cmdbuf, src_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slots[slot].buffer, 1, &copy_region);
+
+		// Make the copy visible to the host once the timeline semaphore signals
+		VkBufferMemoryBarrier buffer_barrier = {
+			.sType				 = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+			.srcAccessMask		 = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask		 = VK_ACCESS_HOST_READ_BIT,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.buffer				 = slots[slot].buffer,
+			.offset				 = 0,
+			.size				 = VK_WHOLE_SIZE,
+		};
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_barrier, 0, nullptr);
+
+		// Transition back to be presented now that copying is done
+		if(src_layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+		{
+			transition_image_layout(device, command_pool, cmdbuf,
+									src_image,
+									VK_ACCESS_TRANSFER_READ_BIT,
+									0,
+									VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+									src_layout,
+									VK_PIPELINE_STAGE_TRANSFER_BIT,
+									VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+		}
+	}
+
+	/*
+		Record the copy of a D16_UNORM depth image into a slot's depth buffer,
+		after the renderpass left it in DEPTH_STENCIL_ATTACHMENT_OPTIMAL. It's
+		left in that layout again, and the next frame's renderpass waits for
+		the copy before it clears it.
+	*/
+	void record_depth_copy(VkCommandBuffer cmdbuf, uint32_t slot, VkImage depth_image, VkExtent2D extent)
+	{
+		VkImageSubresourceRange depth_range = vki::imageSubresourceRange(VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1);
+		VkImageMemoryBarrier to_transfer	= vki::imageMemoryBarrier(VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+																	  VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+																	  VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, depth_image, depth_range);
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &to_transfer);
+
+		VkBufferImageCopy copy_region = {
+			.bufferOffset	   = 0,
+			.bufferRowLength   = 0,
+			.bufferImageHeight = 0,
+			.imageSubresource  = vki::imageSubresourceLayers(VK_IMAGE_ASPECT_DEPTH_BIT, 0, 0, 1),
+			.imageOffset	   = {0, 0, 0},
+			.imageExtent	   = {extent.width, extent.height, 1},
+		};
+		vkCmdCopyImageToBuffer(cmdbuf, depth_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slots[slot].depth_buffer, 1, &copy_region);
+
+		VkBufferMemoryBarrier buffer_barrier = {
+			.sType				 = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+			.srcAccessMask		 = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask		 = VK_ACCESS_HOST_READ_BIT,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.buffer				 = slots[slot].depth_buffer,
+			.offset				 = 0,
+			.size				 = VK_WHOLE_SIZE,
+		};
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_barrier, 0, nullptr);
+
+		VkImageMemoryBarrier to_attachment = vki::imageMemoryBarrier(VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+																	 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+																	 VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, depth_image, depth_range);
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1, &to_attachment);
+	}
+
+	// Render thread: sleep until whoever reads a slot is done with it, then claim it for the frame that signals timeline_value
+	void acquire(uint32_t slot, uint64_t timeline_value)
+	{
+		while(busy[slot].load(std::memory_order_acquire))
+		{
+			released.wait(-1);
+		}
+
+		slots[slot].timeline_value = timeline_value;
+		busy[slot].store(true, std::memory_order_relaxed);
+	}
+
+	// Reader thread: block until the slot's copy has landed and hand back its mapped pixels
+	uint8_t *wait(VulkanDevice device, uint32_t slot)
+	{
+		VkSemaphoreWaitInfo wait_info = {
+			.sType			= VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+			.semaphoreCount = 1,
+			.pSemaphores	= &timeline,
+			.pValues		= &slots[slot].timeline_value,
+		};
+		vkWaitSemaphores(device.logical_device, &wait_info, UINT64_MAX);
+
+		if(host_cached)
+		{
+			VkMappedMemoryRange ranges[] = {
+				{
+					.sType	= VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+					.memory = slots[slot].memory,
+					.offset = 0,
+					.size	= VK_WHOLE_SIZE,
+				},
+				{
+					.sType	= VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+					.memory = slots[slot].depth_memory,
+					.offset = 0,
+					.size	= VK_WHOLE_SIZE,
+				},
+			};
+			vkInvalidateMappedMemoryRanges(device.logical_device, depth_size != 0 ? 2 : 1, ranges);
+		}
+
+		return slots[slot].data;
+	}
+
+	// Reader thread: done with the slot's pixels, the render thread can reuse it
+	void release(uint32_t slot)
+	{
+		busy[slot].store(false, std::memory_order_release);
+		released.signal();
+	}
+
+	// Render thread: wait for every slot to be consumed, e.g. before tearing the ring down
+	void drain()
+	{
+		for(uint32_t i = 0; i < busy.size(); i++)
+		{
+			while(busy[i].load(std::memory_order_acquire))
+			{
+				released.wait(-1);
+			}
+		}
+	}
+
+	void destroy(VulkanDevice device)
+	{
+		for(uint32_t i = 0; i < slots.size(); i++)
+		{
+			vkUnmapMemory(device.logical_device, slots[i].memory);
+			vkDestroyBuffer(device.logical_device, slots[i].buffer, nullptr);
+			vkFreeMemory(device.logical_device, slots[i].memory, nullptr);
+
+			if(depth_size != 0)
+			{
+				vkUnmapMemory(device.logical_device, slots[i].depth_memory);
+				vkDestroyBuffer(device.logical_device, slots[i].depth_buffer, nullptr);
+				vkFreeMemory(device.logical_device, slots[i].depth_memory, nullptr);
+			}
+		}
+
+		vkDestroySemaphore(device.logical_device, timeline, nullptr);
+		released.destroy();
+		slots.clear();
+	}
+};
+
+
+#endif
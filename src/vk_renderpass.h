@@ -8,6 +8,22 @@
 #include "vk_initializers.h"
 #include "vk_swapchain.h"
 
+/*
+	Depth buffers that get copied out after the renderpass are 16 bit, which
+	is all that gets sent of them anyway, and every device can copy out of a
+	D16_UNORM attachment.
+*/
+VkFormat find_depth_format(VulkanDevice device, bool read_back)
+{
+	if(read_back)
+	{
+		return device.find_format({VK_FORMAT_D16_UNORM}, VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_TRANSFER_SRC_BIT);
+	}
+
+	std::vector<VkFormat> formats = {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT};
+	return device.find_format(formats, VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+}
+
 struct VulkanRenderpass
 {
 	VkRenderPass renderpass;
@@ -17,12 +33,13 @@ struct VulkanRenderpass
 		// don't use
 	}
 
-	VulkanRenderpass(VulkanDevice device, VulkanSwapchain swapchain)
+	// read_back_depth keeps the depth buffer around after the pass, see find_depth_format()
+	VulkanRenderpass(VulkanDevice device, VulkanSwapchain swapchain, bool read_back_depth = false)
 	{
-		setup_renderpass(device, swapchain);
+		setup_renderpass(device, swapchain, read_back_depth);
 	}
 
-	void setup_renderpass(VulkanDevice device, VulkanSwapchain swapchain)
+	void setup_renderpass(VulkanDevice device, VulkanSwapchain swapchain, bool read_back_depth = false)
 	{
 		VkAttachmentDescription colour_attachment_description = {
 			.format			= swapchain.format,
@@ -32,7 +49,7 @@ struct VulkanRenderpass
 			.stencilLoadOp	= VK_ATTACHMENT_LOAD_OP_DONT_CARE,
 			.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
 			.initialLayout	= VK_IMAGE_LAYOUT_UNDEFINED,
-			.finalLayout	= VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+			.finalLayout	= swapchain.final_layout(),
 		};
 
 		VkAttachmentReference colour_attachment_ref = {
@@ -41,12 +58,11 @@ struct VulkanRenderpass
 		};
 
 		// Depth setup
-		std::vector<VkFormat> formats						 = {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT};
 		VkAttachmentDescription depth_attachment_description = {
-			.format			= device.find_format(formats, VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT), // depth format
+			.format			= find_depth_format(device, read_back_depth),
 			.samples		= VK_SAMPLE_COUNT_1_BIT,
 			.loadOp			= VK_ATTACHMENT_LOAD_OP_CLEAR,
-			.storeOp		= VK_ATTACHMENT_STORE_OP_DONT_CARE, // Won't use it after drawing, so no need to specify storage
+			.storeOp		= read_back_depth ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE, // Only kept if it gets read back
 			.stencilLoadOp	= VK_ATTACHMENT_LOAD_OP_DONT_CARE,
 			.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
 			.initialLayout	= VK_IMAGE_LAYOUT_UNDEFINED, // Since previous depth contents don't matter, can be undefined... may be useful to change for some AA
@@ -19,17 +19,29 @@ struct UBO
 	glm::mat4 projection;
 };
 
+// Where the server's vertex shader puts one layer of a (possibly foveated) frame
+struct LayerPushConstants
+{
+	glm::vec2 clip_scale;  // clip space x and y get multiplied by this
+	glm::vec2 clip_offset; // and then moved by this (times w), for off-axis layers
+};
+
+// What the client's fullscreen quad needs to know about the server image. std140, so rect and the mat4 have to start on 16 bytes
+struct ServerFrameUBO
+{
+	int32_t format;			// FrameFormat
+	int32_t foveated;		// whether it's a foveated atlas
+	int32_t width;			// of the frame in pixels, which isn't the same as the image's
+	int32_t reproject;		// whether there's depth to reproject the frame with
+	int32_t rect[4];		// where the fovea goes on screen, as (x, y, width, height) in pixels from the top left
+	glm::mat4 reprojection; // from the server's clip space when it rendered the frame to what it would be now
+};
+
 struct UBOClient
 {
 	glm::mat4 model;
 	glm::mat4 view;
 	glm::mat4 projection;
-
-	// Viewport
-	/*float x		 = CLIENTWIDTH / 2 - SERVERWIDTH / 2; // x and y are viewport's upper left corner (x, y)
-	float y		 = CLIENTWIDTH / 2 - SERVERWIDTH / 2;
-	float width	 = SERVERWIDTH; // width and height are viewport's width and height
-	float height = SERVERWIDTH;*/
 };
 
 
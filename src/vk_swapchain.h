@@ -7,6 +7,7 @@
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan.h>
 
+#include "vk_image.h"
 #include "vk_initializers.h"
 #include "vk_queuefamilies.h"
 #include "vk_swapchain_support.h"
@@ -18,15 +19,84 @@ struct VulkanSwapchain
 	VkSwapchainKHR swapchain;
 	std::vector<VkImage> images;
 	VkFormat format;
+	VkImageUsageFlags usage;
 	VkExtent2D swapchain_extent;
 	std::vector<VkImageView> image_views;
 	std::vector<VkFramebuffer> framebuffers;
 
+	// Only used by offscreen swapchains, where the images are ours to allocate
+	std::vector<VkDeviceMemory> image_memory;
+
 	VulkanSwapchain()
 	{
 		// don't use this
 	}
 
+	/*
+		Offscreen "swapchain" for headless rendering. There's no VkSwapchainKHR
+		and nothing is ever presented, the images are plain colour attachments
+		that get read back to be streamed.
+		BGRA to match what the windowed swapchain normally picks, so the client
+		gets the same bytes either way.
+	*/
+	VulkanSwapchain(VulkanDevice device, VkExtent2D extent, uint32_t num_images)
+	{
+		swapchain		 = VK_NULL_HANDLE;
+		format			 = VK_FORMAT_B8G8R8A8_SRGB;
+		usage			 = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		swapchain_extent = extent;
+
+		images.resize(num_images);
+		image_memory.resize(num_images);
+
+		for(uint32_t i = 0; i < num_images; i++)
+		{
+			create_image(device, 0, VK_IMAGE_TYPE_2D, format, {extent.width, extent.height, 1}, 1, 1, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL, usage, VK_SHARING_MODE_EXCLUSIVE, VK_IMAGE_LAYOUT_UNDEFINED, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, images[i], image_memory[i]);
+		}
+
+		setup_image_views(device.logical_device);
+	}
+
+	bool offscreen()
+	{
+		return swapchain == VK_NULL_HANDLE;
+	}
+
+	// Whether compute passes can read the images
+	bool sampleable()
+	{
+		return (usage & VK_IMAGE_USAGE_SAMPLED_BIT) != 0;
+	}
+
+	// BGRA images read back as blue, green, red, alpha bytes
+	bool bgr()
+	{
+		return format == VK_FORMAT_B8G8R8A8_SRGB || format == VK_FORMAT_B8G8R8A8_UNORM;
+	}
+
+	// The layout images are left in after rendering, ready to present or to read back
+	VkImageLayout final_layout()
+	{
+		return offscreen() ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	}
+
+	// Swapchain images belong to the swapchain, offscreen ones have to be freed by hand
+	void destroy(VkDevice device)
+	{
+		if(offscreen())
+		{
+			for(uint32_t i = 0; i < images.size(); i++)
+			{
+				vkDestroyImage(device, images[i], nullptr);
+				vkFreeMemory(device, image_memory[i], nullptr);
+			}
+		}
+		else
+		{
+			vkDestroySwapchainKHR(device, swapchain, nullptr);
+		}
+	}
+
 	VulkanSwapchain(SwapChainSupportDetails swapchain_support, VkSurfaceKHR surface, VulkanDevice device, GLFWwindow *window)
 	{
 		setup_swapchain(swapchain_support, surface, device, window);
@@ -57,6 +127,8 @@ struct VulkanSwapchain
 		swapchain_ci.imageExtent			  = extent;
 		swapchain_ci.imageArrayLayers		  = 1;
 		swapchain_ci.imageUsage				  = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		// So compute passes can read the frame, where the surface allows it
+		swapchain_ci.imageUsage |= swapchain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_SAMPLED_BIT;
 		swapchain_ci.imageSharingMode		  = graphics_qf_equals_present_qf ? VK_SHARING_MODE_EXCLUSIVE : VK_SHARING_MODE_CONCURRENT;
 		swapchain_ci.queueFamilyIndexCount	  = graphics_qf_equals_present_qf ? 0 : 2;
 		swapchain_ci.pQueueFamilyIndices	  = graphics_qf_equals_present_qf ? nullptr : qf_indices;
@@ -76,6 +148,7 @@ struct VulkanSwapchain
 		vkGetSwapchainImagesKHR(device.logical_device, swapchain, &num_images, images.data());
 
 		format			 = surface_format.format;
+		usage			 = swapchain_ci.imageUsage;
 		swapchain_extent = extent;
 	}
 